@@ -0,0 +1,252 @@
+/*
+ * OPERATING SYSTEMS DESING - 16/17
+ *
+ * @file 	async.c
+ * @brief 	Worker pool serving the asynchronous file system calls.
+ * @date	01/03/2017
+ */
+
+#include "include/filesystem.h"		// Headers for the core functionality
+#include "include/metadata.h"		// MAX_NUMBER_OF_FILES
+#include "include/async.h"			// Headers for the worker pool
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { ASYNC_READ, ASYNC_WRITE, ASYNC_CHECK };
+
+/* A queued call and, once served, its result */
+struct FSRequest {
+    int op;
+    int fd;                             // -1 for calls that take a file name
+    void * buffer;
+    int numBytes;
+    char * fileName;
+    FSCallback callback;
+    void * arg;
+    long result;
+    int done;
+    struct FSRequest * next;
+};
+
+static pthread_mutex_t ASYNC_LOCK = PTHREAD_MUTEX_INITIALIZER; // Guards everything below
+static pthread_cond_t ASYNC_READY = PTHREAD_COND_INITIALIZER;   // A request can be served
+static pthread_cond_t ASYNC_DONE = PTHREAD_COND_INITIALIZER;    // A request was served
+static FSRequest * ASYNC_HEAD = NULL;
+static FSRequest * ASYNC_TAIL = NULL;
+static pthread_t ASYNC_THREADS[ASYNC_WORKERS];
+static int ASYNC_RUNNING = 0;           // Workers started
+static int ASYNC_STOP = 0;
+static int ASYNC_BUSY[MAX_NUMBER_OF_FILES]; // Descriptors with a request being served
+
+/* Whether request runs on a descriptor of the open file table */
+static int async_uses_fd(FSRequest * request)
+{
+    return request->fd >= 0 && request->fd < MAX_NUMBER_OF_FILES;
+}
+
+/* Takes the oldest request whose descriptor is idle, so that the requests
+   on one descriptor are served one at a time and in submission order.
+   Returns NULL if there is none */
+static FSRequest * async_next(void)
+{
+    FSRequest * previous = NULL;
+    for (FSRequest * request = ASYNC_HEAD; request != NULL; previous = request, request = request->next) {
+        if (async_uses_fd(request) && ASYNC_BUSY[request->fd]) {
+            continue;
+        }
+        if (previous != NULL) {
+            previous->next = request->next;
+        } else {
+            ASYNC_HEAD = request->next;
+        }
+        if (ASYNC_TAIL == request) {
+            ASYNC_TAIL = previous;
+        }
+        return request;
+    }
+    return NULL;
+}
+
+static long async_run(FSRequest * request)
+{
+    switch (request->op) {
+        case ASYNC_READ:
+            return readFile(request->fd, request->buffer, request->numBytes);
+        case ASYNC_WRITE:
+            return writeFile(request->fd, request->buffer, request->numBytes);
+        default:
+            return checkFile(request->fileName);
+    }
+}
+
+static void * async_worker(void * arg)
+{
+    pthread_mutex_lock(&ASYNC_LOCK);
+    while (1) {
+        FSRequest * request;
+        // Queued requests are still served after stop
+        while ((request = async_next()) == NULL && !(ASYNC_STOP && ASYNC_HEAD == NULL)) {
+            pthread_cond_wait(&ASYNC_READY, &ASYNC_LOCK);
+        }
+        if (request == NULL) {
+            break;
+        }
+        if (async_uses_fd(request)) {
+            ASYNC_BUSY[request->fd] = 1;
+        }
+        pthread_mutex_unlock(&ASYNC_LOCK);
+
+        request->result = async_run(request);
+        if (request->callback != NULL) {
+            request->callback(request, request->result, request->arg);
+        }
+
+        pthread_mutex_lock(&ASYNC_LOCK);
+        if (async_uses_fd(request)) {
+            ASYNC_BUSY[request->fd] = 0;
+            pthread_cond_broadcast(&ASYNC_READY);
+        }
+        request->done = 1;
+        pthread_cond_broadcast(&ASYNC_DONE);
+    }
+    pthread_mutex_unlock(&ASYNC_LOCK);
+    return NULL;
+}
+
+/* Queues a request, starting the workers on first use. Returns the request,
+   or NULL after releasing it if it cannot be served */
+static FSRequest * async_submit(FSRequest * request)
+{
+    pthread_mutex_lock(&ASYNC_LOCK);
+    for (; ASYNC_RUNNING < ASYNC_WORKERS; ASYNC_RUNNING++) {
+        if (pthread_create(&ASYNC_THREADS[ASYNC_RUNNING], NULL, async_worker, NULL) != 0) {
+            break;
+        }
+    }
+    if (ASYNC_RUNNING == 0) {
+        pthread_mutex_unlock(&ASYNC_LOCK);
+        free(request->fileName);
+        free(request);
+        return NULL;
+    }
+    request->next = NULL;
+    if (ASYNC_TAIL != NULL) {
+        ASYNC_TAIL->next = request;
+    } else {
+        ASYNC_HEAD = request;
+    }
+    ASYNC_TAIL = request;
+    pthread_cond_signal(&ASYNC_READY);
+    pthread_mutex_unlock(&ASYNC_LOCK);
+    return request;
+}
+
+static FSRequest * async_new(int op, int fd, FSCallback callback, void * arg)
+{
+    FSRequest * request = calloc(1, sizeof(FSRequest));
+    if (request != NULL) {
+        request->op = op;
+        request->fd = fd;
+        request->callback = callback;
+        request->arg = arg;
+    }
+    return request;
+}
+
+/* Waits for every queued request to be served and stops the workers */
+void async_stop(void)
+{
+    pthread_mutex_lock(&ASYNC_LOCK);
+    int running = ASYNC_RUNNING;
+    ASYNC_STOP = 1;
+    pthread_cond_broadcast(&ASYNC_READY);
+    pthread_mutex_unlock(&ASYNC_LOCK);
+    for (int i = 0; i < running; i++) {
+        pthread_join(ASYNC_THREADS[i], NULL);
+    }
+    pthread_mutex_lock(&ASYNC_LOCK);
+    ASYNC_RUNNING = 0;
+    ASYNC_STOP = 0;
+    pthread_mutex_unlock(&ASYNC_LOCK);
+}
+
+/*
+ * @brief	Queues a readFile call on a worker thread. Requests on the same descriptor
+ * 		are served in submission order.
+ * @return	The request, NULL in case of error.
+ */
+FSRequest * readFileAsync(int fileDescriptor, void *buffer, int numBytes, FSCallback callback, void *arg)
+{
+    FSRequest * request = async_new(ASYNC_READ, fileDescriptor, callback, arg);
+    if (request == NULL) {
+        return NULL;
+    }
+    request->buffer = buffer;
+    request->numBytes = numBytes;
+    return async_submit(request);
+}
+
+/*
+ * @brief	Queues a writeFile call on a worker thread. Requests on the same descriptor
+ * 		are served in submission order.
+ * @return	The request, NULL in case of error.
+ */
+FSRequest * writeFileAsync(int fileDescriptor, void *buffer, int numBytes, FSCallback callback, void *arg)
+{
+    FSRequest * request = async_new(ASYNC_WRITE, fileDescriptor, callback, arg);
+    if (request == NULL) {
+        return NULL;
+    }
+    request->buffer = buffer;
+    request->numBytes = numBytes;
+    return async_submit(request);
+}
+
+/*
+ * @brief	Queues a checkFile call on a worker thread.
+ * @return	The request, NULL in case of error.
+ */
+FSRequest * checkFileAsync(char *fileName, FSCallback callback, void *arg)
+{
+    FSRequest * request = async_new(ASYNC_CHECK, -1, callback, arg);
+    if (request == NULL || (request->fileName = strdup(fileName)) == NULL) {
+        free(request);
+        return NULL;
+    }
+    return async_submit(request);
+}
+
+/*
+ * @brief	Tells whether a request was served, without waiting, storing its result
+ * 		in result unless it is NULL.
+ * @return	1 if it was served, 0 if it is still pending.
+ */
+int pollRequest(FSRequest *request, long *result)
+{
+    pthread_mutex_lock(&ASYNC_LOCK);
+    int done = request->done;
+    pthread_mutex_unlock(&ASYNC_LOCK);
+    if (done && result != NULL) {
+        *result = request->result;
+    }
+    return done;
+}
+
+/*
+ * @brief	Waits for a request to be served and releases it. Every request must be
+ * 		released this way, after its callback if it has one.
+ * @return	The value returned by the synchronous call.
+ */
+long waitRequest(FSRequest *request)
+{
+    pthread_mutex_lock(&ASYNC_LOCK);
+    while (!request->done) {
+        pthread_cond_wait(&ASYNC_DONE, &ASYNC_LOCK);
+    }
+    pthread_mutex_unlock(&ASYNC_LOCK);
+    long result = request->result;
+    free(request->fileName);
+    free(request);
+    return result;
+}
@@ -0,0 +1,1037 @@
+/*
+ * OPERATING SYSTEMS DESING - 16/17
+ *
+ * @file 	backend.c
+ * @brief 	Block device backends: image files, RAM disks and a latency injector.
+ * @date	01/03/2017
+ */
+
+#define _GNU_SOURCE
+#include "include/backend.h"		// Headers for the backends
+#include "include/blocks_cache.h"	// BLOCK_SIZE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static BlockBackend * CURRENT_BACKEND = NULL; // Chosen with backend_set
+static BlockBackend * DEFAULT_BACKEND = NULL; // Image file named by deviceName
+static char * DEFAULT_PATH = NULL;
+static pthread_mutex_t DEFAULT_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static BlockBackend * backend_new(const char * name, void * state)
+{
+    BlockBackend * backend = calloc(1, sizeof(BlockBackend));
+    if (backend != NULL) {
+        backend->name = name;
+        backend->state = state;
+    }
+    return backend;
+}
+
+/***************/
+/* Image file. */
+/***************/
+
+typedef struct FileState {
+    int fd;
+    long num_blocks;
+} FileState;
+
+/* The size is cached at open and only looked up again when a block falls past
+   it, so images grown by another process are still reachable */
+static int file_contains(FileState * file, int block)
+{
+    struct stat st;
+    if (block >= file->num_blocks && fstat(file->fd, &st) == 0) {
+        file->num_blocks = st.st_size / BLOCK_SIZE;
+    }
+    return block >= 0 && block < file->num_blocks;
+}
+
+static int file_read(BlockBackend * self, int block, char * buffer)
+{
+    FileState * file = self->state;
+    if (!file_contains(file, block)) {
+        return -1;
+    }
+    off_t offset = (off_t) block * BLOCK_SIZE;
+    int total = 0;
+    while (total < BLOCK_SIZE) {
+        ssize_t result = pread(file->fd, buffer + total, BLOCK_SIZE - total, offset + total);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return -1;
+        }
+        total += result;
+    }
+    return 0;
+}
+
+static int file_write(BlockBackend * self, int block, char * buffer)
+{
+    FileState * file = self->state;
+    if (!file_contains(file, block)) {
+        return -1;
+    }
+    off_t offset = (off_t) block * BLOCK_SIZE;
+    int total = 0;
+    while (total < BLOCK_SIZE) {
+        ssize_t result = pwrite(file->fd, buffer + total, BLOCK_SIZE - total, offset + total);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return -1;
+        }
+        total += result;
+    }
+    return 0;
+}
+
+/* Punches a hole in the image, keeping its size */
+static int file_discard(BlockBackend * self, int block, int count)
+{
+    FileState * file = self->state;
+    if (count <= 0 || !file_contains(file, block) || !file_contains(file, block + count - 1)) {
+        return -1;
+    }
+    return fallocate(file->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                     (off_t) block * BLOCK_SIZE, (off_t) count * BLOCK_SIZE) == 0 ? 0 : -1;
+}
+
+static long file_num_blocks(BlockBackend * self)
+{
+    return ((FileState *) self->state)->num_blocks;
+}
+
+static void file_close(BlockBackend * self)
+{
+    FileState * file = self->state;
+    close(file->fd);
+    free(file);
+    free(self);
+}
+
+/* Opens an existing image file, which stays open until the backend is closed */
+BlockBackend * backend_file_open(const char * path)
+{
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    FileState * file = malloc(sizeof(FileState));
+    BlockBackend * backend = backend_new("file", file);
+    if (fstat(fd, &st) != 0 || file == NULL || backend == NULL) {
+        close(fd);
+        free(file);
+        free(backend);
+        return NULL;
+    }
+    file->fd = fd;
+    file->num_blocks = st.st_size / BLOCK_SIZE;
+    backend->read = file_read;
+    backend->write = file_write;
+    backend->discard = file_discard;
+    backend->num_blocks = file_num_blocks;
+    backend->close = file_close;
+    return backend;
+}
+
+/*************/
+/* RAM disk. */
+/*************/
+
+typedef struct RamState {
+    char * data;
+    long num_blocks;
+} RamState;
+
+static int ram_read(BlockBackend * self, int block, char * buffer)
+{
+    RamState * ram = self->state;
+    if (block < 0 || block >= ram->num_blocks) {
+        return -1;
+    }
+    memcpy(buffer, ram->data + (long) block * BLOCK_SIZE, BLOCK_SIZE);
+    return 0;
+}
+
+static int ram_write(BlockBackend * self, int block, char * buffer)
+{
+    RamState * ram = self->state;
+    if (block < 0 || block >= ram->num_blocks) {
+        return -1;
+    }
+    memcpy(ram->data + (long) block * BLOCK_SIZE, buffer, BLOCK_SIZE);
+    return 0;
+}
+
+static int ram_discard(BlockBackend * self, int block, int count)
+{
+    RamState * ram = self->state;
+    if (block < 0 || count <= 0 || block + (long) count > ram->num_blocks) {
+        return -1;
+    }
+    memset(ram->data + (long) block * BLOCK_SIZE, 0, (long) count * BLOCK_SIZE);
+    return 0;
+}
+
+static long ram_num_blocks(BlockBackend * self)
+{
+    return ((RamState *) self->state)->num_blocks;
+}
+
+static void ram_close(BlockBackend * self)
+{
+    RamState * ram = self->state;
+    free(ram->data);
+    free(ram);
+    free(self);
+}
+
+/* Creates a zeroed device of num_blocks blocks held in memory */
+BlockBackend * backend_ram_create(long num_blocks)
+{
+    RamState * ram = malloc(sizeof(RamState));
+    BlockBackend * backend = backend_new("ram", ram);
+    char * data = num_blocks > 0 ? calloc(num_blocks, BLOCK_SIZE) : NULL;
+    if (ram == NULL || backend == NULL || data == NULL) {
+        free(ram);
+        free(backend);
+        free(data);
+        return NULL;
+    }
+    ram->data = data;
+    ram->num_blocks = num_blocks;
+    backend->read = ram_read;
+    backend->write = ram_write;
+    backend->discard = ram_discard;
+    backend->num_blocks = ram_num_blocks;
+    backend->close = ram_close;
+    return backend;
+}
+
+/* Creates an in-memory device with the contents of an image file */
+BlockBackend * backend_ram_load(const char * path)
+{
+    BlockBackend * file = backend_file_open(path);
+    if (file == NULL) {
+        return NULL;
+    }
+    BlockBackend * ram = backend_ram_create(file->num_blocks(file));
+    for (long i = 0; ram != NULL && i < file->num_blocks(file); i++) {
+        if (file->read(file, i, ((RamState *) ram->state)->data + i * BLOCK_SIZE) != 0) {
+            ram->close(ram);
+            ram = NULL;
+        }
+    }
+    file->close(file);
+    return ram;
+}
+
+/* Writes the contents of an in-memory device to an image file */
+int backend_ram_save(BlockBackend * ram, const char * path)
+{
+    RamState * state = ram->state;
+    int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+    if (fd < 0) {
+        return -1;
+    }
+    long size = state->num_blocks * BLOCK_SIZE;
+    long total = 0;
+    while (total < size) {
+        ssize_t result = write(fd, state->data + total, size - total);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            close(fd);
+            return -1;
+        }
+        total += result;
+    }
+    return close(fd) == 0 ? 0 : -1;
+}
+
+/********************/
+/* Latency wrapper. */
+/********************/
+
+typedef struct LatencyState {
+    BlockBackend * inner;
+    long read_us;
+    long write_us;
+    long jitter_us;
+    unsigned int seed;
+} LatencyState;
+
+static void latency_delay(LatencyState * latency, long base_us)
+{
+    long delay = base_us;
+    if (latency->jitter_us > 0) {
+        delay += rand_r(&latency->seed) % latency->jitter_us;
+    }
+    struct timespec ts = {delay / 1000000, (delay % 1000000) * 1000};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+static int latency_read(BlockBackend * self, int block, char * buffer)
+{
+    LatencyState * latency = self->state;
+    latency_delay(latency, latency->read_us);
+    return latency->inner->read(latency->inner, block, buffer);
+}
+
+static int latency_write(BlockBackend * self, int block, char * buffer)
+{
+    LatencyState * latency = self->state;
+    latency_delay(latency, latency->write_us);
+    return latency->inner->write(latency->inner, block, buffer);
+}
+
+static int latency_discard(BlockBackend * self, int block, int count)
+{
+    BlockBackend * inner = ((LatencyState *) self->state)->inner;
+    return inner->discard != NULL ? inner->discard(inner, block, count) : -1;
+}
+
+static long latency_num_blocks(BlockBackend * self)
+{
+    BlockBackend * inner = ((LatencyState *) self->state)->inner;
+    return inner->num_blocks(inner);
+}
+
+static void latency_close(BlockBackend * self)
+{
+    LatencyState * latency = self->state;
+    latency->inner->close(latency->inner);
+    free(latency);
+    free(self);
+}
+
+/* Wraps inner, delaying every read and write by a fixed time plus a random jitter */
+BlockBackend * backend_latency_wrap(BlockBackend * inner, long read_us, long write_us, long jitter_us)
+{
+    LatencyState * latency = malloc(sizeof(LatencyState));
+    BlockBackend * backend = backend_new("latency", latency);
+    if (inner == NULL || latency == NULL || backend == NULL) {
+        free(latency);
+        free(backend);
+        return NULL;
+    }
+    latency->inner = inner;
+    latency->read_us = read_us;
+    latency->write_us = write_us;
+    latency->jitter_us = jitter_us;
+    latency->seed = 1;
+    backend->read = latency_read;
+    backend->write = latency_write;
+    backend->discard = latency_discard;
+    backend->num_blocks = latency_num_blocks;
+    backend->close = latency_close;
+    return backend;
+}
+
+/*******************/
+/* Member workers. */
+/*******************/
+
+/* Blocks of one batch that belong to the same member */
+typedef struct MemberTask {
+    int is_write;
+    int count;
+    int * blocks;                       // Member block numbers
+    char ** buffers;
+    int result;
+    struct MemberBatch * batch;         // NULL for background tasks, freed once done
+    struct MemberTask * next;
+} MemberTask;
+
+/* Completion of the tasks a batch was split into */
+typedef struct MemberBatch {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending;
+} MemberBatch;
+
+/* Serves the tasks of one member, in submission order */
+typedef struct MemberWorker {
+    BlockBackend * member;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    MemberTask * head;
+    MemberTask * tail;
+    int stop;
+    int inflight;                       // Blocks queued or in progress, to balance reads
+} MemberWorker;
+
+/* A background rewrite of one block, allocated along with its data */
+typedef struct RepairTask {
+    MemberTask task;
+    int block;
+    char * buffer;
+    char data[BLOCK_SIZE];
+} RepairTask;
+
+static void member_run(MemberWorker * worker, MemberTask * task)
+{
+    BlockBackend * member = worker->member;
+    task->result = 0;
+    for (int i = 0; i < task->count && task->result == 0; i++) {
+        task->result = task->is_write ? member->write(member, task->blocks[i], task->buffers[i])
+                                      : member->read(member, task->blocks[i], task->buffers[i]);
+    }
+    __atomic_sub_fetch(&worker->inflight, task->count, __ATOMIC_RELAXED);
+}
+
+static void * member_worker(void * arg)
+{
+    MemberWorker * worker = arg;
+    pthread_mutex_lock(&worker->lock);
+    while (1) {
+        while (worker->head == NULL && !worker->stop) {
+            pthread_cond_wait(&worker->ready, &worker->lock);
+        }
+        // Queued tasks are still served after stop
+        if (worker->head == NULL) {
+            break;
+        }
+        MemberTask * task = worker->head;
+        worker->head = task->next;
+        if (worker->head == NULL) {
+            worker->tail = NULL;
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        member_run(worker, task);
+        MemberBatch * batch = task->batch;
+        if (batch == NULL) {
+            free(task);
+        } else {
+            pthread_mutex_lock(&batch->lock);
+            if (--batch->pending == 0) {
+                pthread_cond_signal(&batch->done);
+            }
+            pthread_mutex_unlock(&batch->lock);
+        }
+
+        pthread_mutex_lock(&worker->lock);
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+static void member_submit(MemberWorker * worker, MemberTask * task)
+{
+    __atomic_add_fetch(&worker->inflight, task->count, __ATOMIC_RELAXED);
+    task->next = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail != NULL) {
+        worker->tail->next = task;
+    } else {
+        worker->head = task;
+    }
+    worker->tail = task;
+    pthread_cond_signal(&worker->ready);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/* Hands every non-empty task to the worker of its member and waits for all
+   of them. With serve_locally, the first one is served by the calling thread
+   meanwhile, which skips the queue and so is only right for reads.
+   Returns 0 if every task succeeded, -1 otherwise */
+static int members_dispatch(MemberWorker * workers, MemberTask * tasks, int num_members, int serve_locally)
+{
+    MemberBatch batch;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.done, NULL);
+    batch.pending = 0;
+    for (int m = 0; m < num_members; m++) {
+        batch.pending += tasks[m].count > 0;
+    }
+
+    int local = -1;
+    for (int m = 0; m < num_members; m++) {
+        if (tasks[m].count == 0) {
+            continue;
+        }
+        if (serve_locally && local == -1) {
+            local = m;
+            continue;
+        }
+        tasks[m].batch = &batch;
+        member_submit(&workers[m], &tasks[m]);
+    }
+    pthread_mutex_lock(&batch.lock);
+    if (local != -1) {
+        batch.pending--;
+        pthread_mutex_unlock(&batch.lock);
+        __atomic_add_fetch(&workers[local].inflight, tasks[local].count, __ATOMIC_RELAXED);
+        member_run(&workers[local], &tasks[local]);
+        pthread_mutex_lock(&batch.lock);
+    }
+    while (batch.pending > 0) {
+        pthread_cond_wait(&batch.done, &batch.lock);
+    }
+    pthread_mutex_unlock(&batch.lock);
+    pthread_mutex_destroy(&batch.lock);
+    pthread_cond_destroy(&batch.done);
+
+    for (int m = 0; m < num_members; m++) {
+        if (tasks[m].count > 0 && tasks[m].result != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Queues a rewrite of one member block with a copy of buffer, without waiting */
+static int member_repair(MemberWorker * worker, int block, char * buffer)
+{
+    RepairTask * repair = calloc(1, sizeof(RepairTask));
+    if (repair == NULL) {
+        return -1;
+    }
+    memcpy(repair->data, buffer, BLOCK_SIZE);
+    repair->block = block;
+    repair->buffer = repair->data;
+    repair->task.is_write = 1;
+    repair->task.count = 1;
+    repair->task.blocks = &repair->block;
+    repair->task.buffers = &repair->buffer;
+    member_submit(worker, &repair->task);
+    return 0;
+}
+
+/* Lets every worker finish its queue, then closes the members that are set */
+static void members_stop(MemberWorker * workers, int num_members)
+{
+    for (int m = 0; m < num_members; m++) {
+        MemberWorker * worker = &workers[m];
+        pthread_mutex_lock(&worker->lock);
+        worker->stop = 1;
+        pthread_cond_signal(&worker->ready);
+        pthread_mutex_unlock(&worker->lock);
+        pthread_join(worker->thread, NULL);
+        if (worker->member != NULL) {
+            worker->member->close(worker->member);
+        }
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->ready);
+    }
+    free(workers);
+}
+
+/* Starts one worker per member. Returns the workers, or NULL leaving the
+   members to the caller */
+static MemberWorker * members_start(BlockBackend ** members, int num_members)
+{
+    MemberWorker * workers = calloc(num_members, sizeof(MemberWorker));
+    if (workers == NULL) {
+        return NULL;
+    }
+    int started = 0;
+    for (; started < num_members; started++) {
+        workers[started].member = members[started];
+        pthread_mutex_init(&workers[started].lock, NULL);
+        pthread_cond_init(&workers[started].ready, NULL);
+        if (pthread_create(&workers[started].thread, NULL, member_worker, &workers[started]) != 0) {
+            break;
+        }
+    }
+    if (started == num_members) {
+        return workers;
+    }
+    pthread_mutex_destroy(&workers[started].lock);
+    pthread_cond_destroy(&workers[started].ready);
+    for (int m = 0; m < started; m++) {
+        workers[m].member = NULL;
+    }
+    members_stop(workers, started);
+    return NULL;
+}
+
+/* The number of blocks of the smallest member */
+static long members_min_blocks(BlockBackend ** members, int num_members)
+{
+    long min_blocks = -1;
+    for (int m = 0; m < num_members; m++) {
+        long blocks = members[m] != NULL ? members[m]->num_blocks(members[m]) : 0;
+        if (min_blocks == -1 || blocks < min_blocks) {
+            min_blocks = blocks;
+        }
+    }
+    return min_blocks;
+}
+
+/* Opens the image files named by pattern, a printf format taking the member
+   number, and builds a backend over them with create */
+static BlockBackend * members_open(const char * pattern, int num_members, int arg,
+                                   BlockBackend * (*create)(BlockBackend **, int, int))
+{
+    if (num_members < 1) {
+        return NULL;
+    }
+    BlockBackend * members[num_members];
+    int opened = 0;
+    for (; opened < num_members; opened++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), pattern, opened);
+        if ((members[opened] = backend_file_open(path)) == NULL) {
+            break;
+        }
+    }
+    BlockBackend * backend = opened == num_members ? create(members, num_members, arg) : NULL;
+    if (backend == NULL) {
+        for (int m = 0; m < opened; m++) {
+            members[m]->close(members[m]);
+        }
+    }
+    return backend;
+}
+
+/***************/
+/* RAID-0 set. */
+/***************/
+
+typedef struct StripeState {
+    int num_members;
+    int stripe_blocks;
+    long num_blocks;
+    MemberWorker * workers;
+} StripeState;
+
+/* Finds the member holding block and its number inside the member */
+static int stripe_locate(StripeState * stripe, int block, int * member_block)
+{
+    long chunk = block / stripe->stripe_blocks;
+    *member_block = (chunk / stripe->num_members) * stripe->stripe_blocks + block % stripe->stripe_blocks;
+    return chunk % stripe->num_members;
+}
+
+static int stripe_read(BlockBackend * self, int block, char * buffer)
+{
+    StripeState * stripe = self->state;
+    int member_block;
+    if (block < 0 || block >= stripe->num_blocks) {
+        return -1;
+    }
+    BlockBackend * member = stripe->workers[stripe_locate(stripe, block, &member_block)].member;
+    return member->read(member, member_block, buffer);
+}
+
+static int stripe_write(BlockBackend * self, int block, char * buffer)
+{
+    StripeState * stripe = self->state;
+    int member_block;
+    if (block < 0 || block >= stripe->num_blocks) {
+        return -1;
+    }
+    BlockBackend * member = stripe->workers[stripe_locate(stripe, block, &member_block)].member;
+    return member->write(member, member_block, buffer);
+}
+
+/* Splits a batch by member and serves the parts in parallel */
+static int stripe_batch(BlockBackend * self, int is_write, int * blocks, char * buffers, int count)
+{
+    StripeState * stripe = self->state;
+    int n = stripe->num_members;
+    MemberTask tasks[n];
+    int * member_blocks = malloc(count * sizeof(int));
+    char ** member_buffers = malloc(count * sizeof(char *));
+    int ret = member_blocks != NULL && member_buffers != NULL ? 0 : -1;
+
+    // Count the blocks of every member to give each task its slice
+    memset(tasks, 0, sizeof(tasks));
+    for (int i = 0; i < count && ret == 0; i++) {
+        int member_block;
+        if (blocks[i] < 0 || blocks[i] >= stripe->num_blocks) {
+            ret = -1;
+        } else {
+            tasks[stripe_locate(stripe, blocks[i], &member_block)].count++;
+        }
+    }
+    if (ret == 0) {
+        int next = 0;
+        for (int m = 0; m < n; m++) {
+            tasks[m].is_write = is_write;
+            tasks[m].blocks = member_blocks + next;
+            tasks[m].buffers = member_buffers + next;
+            next += tasks[m].count;
+            tasks[m].count = 0;
+        }
+        for (int i = 0; i < count; i++) {
+            int member_block;
+            MemberTask * task = &tasks[stripe_locate(stripe, blocks[i], &member_block)];
+            task->blocks[task->count] = member_block;
+            task->buffers[task->count++] = buffers + (long) i * BLOCK_SIZE;
+        }
+        ret = members_dispatch(stripe->workers, tasks, n, 1);
+    }
+    free(member_blocks);
+    free(member_buffers);
+    return ret;
+}
+
+static int stripe_read_blocks(BlockBackend * self, int * blocks, char * buffers, int count)
+{
+    return stripe_batch(self, 0, blocks, buffers, count);
+}
+
+static int stripe_write_blocks(BlockBackend * self, int * blocks, char * buffers, int count)
+{
+    return stripe_batch(self, 1, blocks, buffers, count);
+}
+
+/* Members keeping several copies of a block, such as mirrors, are reached through the stripe */
+static int stripe_read_replica(BlockBackend * self, int block, int replica, char * buffer)
+{
+    StripeState * stripe = self->state;
+    int member_block;
+    if (block < 0 || block >= stripe->num_blocks) {
+        return -1;
+    }
+    BlockBackend * member = stripe->workers[stripe_locate(stripe, block, &member_block)].member;
+    if (member->read_replica != NULL) {
+        return member->read_replica(member, member_block, replica, buffer);
+    }
+    return replica == 0 ? member->read(member, member_block, buffer) : -1;
+}
+
+static int stripe_repair(BlockBackend * self, int block, int replica, char * buffer)
+{
+    StripeState * stripe = self->state;
+    int member_block;
+    if (block < 0 || block >= stripe->num_blocks) {
+        return -1;
+    }
+    BlockBackend * member = stripe->workers[stripe_locate(stripe, block, &member_block)].member;
+    return member->repair != NULL ? member->repair(member, member_block, replica, buffer) : -1;
+}
+
+/* Discards the part of the range inside every chunk from its member */
+static int stripe_discard(BlockBackend * self, int block, int count)
+{
+    StripeState * stripe = self->state;
+    if (block < 0 || count <= 0 || block + (long) count > stripe->num_blocks) {
+        return -1;
+    }
+    int ret = 0;
+    while (count > 0) {
+        int member_block;
+        BlockBackend * member = stripe->workers[stripe_locate(stripe, block, &member_block)].member;
+        int length = stripe->stripe_blocks - block % stripe->stripe_blocks;
+        length = length < count ? length : count;
+        if (member->discard == NULL || member->discard(member, member_block, length) != 0) {
+            ret = -1;
+        }
+        block += length;
+        count -= length;
+    }
+    return ret;
+}
+
+static long stripe_num_blocks(BlockBackend * self)
+{
+    return ((StripeState *) self->state)->num_blocks;
+}
+
+static void stripe_close(BlockBackend * self)
+{
+    StripeState * stripe = self->state;
+    members_stop(stripe->workers, stripe->num_members);
+    free(stripe);
+    free(self);
+}
+
+/* Spreads blocks over num_members backends in chunks of stripe_blocks blocks.
+   The members are only owned by the stripe when it is created */
+BlockBackend * backend_stripe_create(BlockBackend ** members, int num_members, int stripe_blocks)
+{
+    if (num_members < 1 || stripe_blocks < 1) {
+        return NULL;
+    }
+    // Only whole chunks of the smallest member are usable
+    long member_chunks = members_min_blocks(members, num_members) / stripe_blocks;
+    StripeState * stripe = calloc(1, sizeof(StripeState));
+    BlockBackend * backend = backend_new("stripe", stripe);
+    if (member_chunks <= 0 || stripe == NULL || backend == NULL ||
+            (stripe->workers = members_start(members, num_members)) == NULL) {
+        free(stripe);
+        free(backend);
+        return NULL;
+    }
+    stripe->num_members = num_members;
+    stripe->stripe_blocks = stripe_blocks;
+    stripe->num_blocks = member_chunks * num_members * stripe_blocks;
+    backend->read = stripe_read;
+    backend->write = stripe_write;
+    backend->read_blocks = stripe_read_blocks;
+    backend->write_blocks = stripe_write_blocks;
+    backend->read_replica = stripe_read_replica;
+    backend->repair = stripe_repair;
+    backend->discard = stripe_discard;
+    backend->num_blocks = stripe_num_blocks;
+    backend->close = stripe_close;
+    return backend;
+}
+
+/* Stripes the image files named by pattern, a printf format taking the member number */
+BlockBackend * backend_stripe_open(const char * pattern, int num_members, int stripe_blocks)
+{
+    return members_open(pattern, num_members, stripe_blocks, backend_stripe_create);
+}
+
+/***************/
+/* RAID-1 set. */
+/***************/
+
+typedef struct MirrorState {
+    int num_members;
+    long num_blocks;
+    MemberWorker * workers;
+    unsigned int rotation;              // Where the search for the least busy member starts
+} MirrorState;
+
+/* Returns the member with the fewest blocks in flight plus planned */
+static int mirror_pick(MirrorState * mirror, int * planned)
+{
+    int n = mirror->num_members;
+    int first = __atomic_fetch_add(&mirror->rotation, 1, __ATOMIC_RELAXED) % n;
+    int best = first;
+    int best_depth = -1;
+    for (int k = 0; k < n; k++) {
+        int m = (first + k) % n;
+        int depth = __atomic_load_n(&mirror->workers[m].inflight, __ATOMIC_RELAXED) + (planned ? planned[m] : 0);
+        if (best_depth == -1 || depth < best_depth) {
+            best = m;
+            best_depth = depth;
+        }
+    }
+    return best;
+}
+
+/* Reads from the least busy member, falling back to the others on error */
+static int mirror_read(BlockBackend * self, int block, char * buffer)
+{
+    MirrorState * mirror = self->state;
+    if (block < 0 || block >= mirror->num_blocks) {
+        return -1;
+    }
+    int first = mirror_pick(mirror, NULL);
+    for (int k = 0; k < mirror->num_members; k++) {
+        MemberWorker * worker = &mirror->workers[(first + k) % mirror->num_members];
+        __atomic_add_fetch(&worker->inflight, 1, __ATOMIC_RELAXED);
+        int ret = worker->member->read(worker->member, block, buffer);
+        __atomic_sub_fetch(&worker->inflight, 1, __ATOMIC_RELAXED);
+        if (ret == 0) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Spreads the blocks of a batch over the members by queue depth */
+static int mirror_read_blocks(BlockBackend * self, int * blocks, char * buffers, int count)
+{
+    MirrorState * mirror = self->state;
+    int n = mirror->num_members;
+    MemberTask tasks[n];
+    int planned[n];
+    int * member_blocks = malloc((long) n * count * sizeof(int));
+    char ** member_buffers = malloc((long) n * count * sizeof(char *));
+    int ret = member_blocks != NULL && member_buffers != NULL ? 0 : -1;
+
+    memset(tasks, 0, sizeof(tasks));
+    memset(planned, 0, sizeof(planned));
+    for (int m = 0; m < n; m++) {
+        tasks[m].blocks = member_blocks + (long) m * count;
+        tasks[m].buffers = member_buffers + (long) m * count;
+    }
+    for (int i = 0; i < count && ret == 0; i++) {
+        if (blocks[i] < 0 || blocks[i] >= mirror->num_blocks) {
+            ret = -1;
+            break;
+        }
+        int m = mirror_pick(mirror, planned);
+        planned[m]++;
+        tasks[m].blocks[tasks[m].count] = blocks[i];
+        tasks[m].buffers[tasks[m].count++] = buffers + (long) i * BLOCK_SIZE;
+    }
+    if (ret == 0 && members_dispatch(mirror->workers, tasks, n, 1) != 0) {
+        // Some member failed: retry every block with the fallback of single reads
+        for (int i = 0; i < count && ret == 0; i++) {
+            ret = mirror_read(self, blocks[i], buffers + (long) i * BLOCK_SIZE);
+        }
+    }
+    free(member_blocks);
+    free(member_buffers);
+    return ret;
+}
+
+/* Writes the batch to every member in parallel. Writes always go through the
+   queues so that they are ordered after any pending repair */
+static int mirror_write_blocks(BlockBackend * self, int * blocks, char * buffers, int count)
+{
+    MirrorState * mirror = self->state;
+    int n = mirror->num_members;
+    MemberTask tasks[n];
+    char ** block_buffers = malloc(count * sizeof(char *));
+    if (block_buffers == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (blocks[i] < 0 || blocks[i] >= mirror->num_blocks) {
+            free(block_buffers);
+            return -1;
+        }
+        block_buffers[i] = buffers + (long) i * BLOCK_SIZE;
+    }
+    memset(tasks, 0, sizeof(tasks));
+    for (int m = 0; m < n; m++) {
+        tasks[m].is_write = 1;
+        tasks[m].count = count;
+        tasks[m].blocks = blocks;
+        tasks[m].buffers = block_buffers;
+    }
+    int ret = members_dispatch(mirror->workers, tasks, n, 0);
+    free(block_buffers);
+    return ret;
+}
+
+static int mirror_write(BlockBackend * self, int block, char * buffer)
+{
+    return mirror_write_blocks(self, &block, buffer, 1);
+}
+
+static int mirror_read_replica(BlockBackend * self, int block, int replica, char * buffer)
+{
+    MirrorState * mirror = self->state;
+    if (block < 0 || block >= mirror->num_blocks || replica < 0 || replica >= mirror->num_members) {
+        return -1;
+    }
+    BlockBackend * member = mirror->workers[replica].member;
+    return member->read(member, block, buffer);
+}
+
+static int mirror_repair(BlockBackend * self, int block, int replica, char * buffer)
+{
+    MirrorState * mirror = self->state;
+    if (block < 0 || block >= mirror->num_blocks || replica < 0 || replica >= mirror->num_members) {
+        return -1;
+    }
+    return member_repair(&mirror->workers[replica], block, buffer);
+}
+
+/* Discards the range from every member. Only unused blocks are discarded,
+   so it does not need to be ordered with the queues */
+static int mirror_discard(BlockBackend * self, int block, int count)
+{
+    MirrorState * mirror = self->state;
+    if (block < 0 || count <= 0 || block + (long) count > mirror->num_blocks) {
+        return -1;
+    }
+    int ret = 0;
+    for (int m = 0; m < mirror->num_members; m++) {
+        BlockBackend * member = mirror->workers[m].member;
+        if (member->discard == NULL || member->discard(member, block, count) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static long mirror_num_blocks(BlockBackend * self)
+{
+    return ((MirrorState *) self->state)->num_blocks;
+}
+
+static void mirror_close(BlockBackend * self)
+{
+    MirrorState * mirror = self->state;
+    members_stop(mirror->workers, mirror->num_members);
+    free(mirror);
+    free(self);
+}
+
+/* Keeps a copy of every block in each of num_members backends.
+   The members are only owned by the mirror when it is created */
+BlockBackend * backend_mirror_create(BlockBackend ** members, int num_members)
+{
+    long num_blocks = members_min_blocks(members, num_members);
+    MirrorState * mirror = calloc(1, sizeof(MirrorState));
+    BlockBackend * backend = backend_new("mirror", mirror);
+    if (num_members < 1 || num_blocks <= 0 || mirror == NULL || backend == NULL ||
+            (mirror->workers = members_start(members, num_members)) == NULL) {
+        free(mirror);
+        free(backend);
+        return NULL;
+    }
+    mirror->num_members = num_members;
+    mirror->num_blocks = num_blocks;
+    backend->read = mirror_read;
+    backend->write = mirror_write;
+    backend->read_blocks = mirror_read_blocks;
+    backend->write_blocks = mirror_write_blocks;
+    backend->read_replica = mirror_read_replica;
+    backend->repair = mirror_repair;
+    backend->discard = mirror_discard;
+    backend->num_blocks = mirror_num_blocks;
+    backend->close = mirror_close;
+    return backend;
+}
+
+static BlockBackend * mirror_create(BlockBackend ** members, int num_members, int unused)
+{
+    return backend_mirror_create(members, num_members);
+}
+
+/* Mirrors the image files named by pattern, a printf format taking the member number */
+BlockBackend * backend_mirror_open(const char * pattern, int num_members)
+{
+    return members_open(pattern, num_members, 0, mirror_create);
+}
+
+/**************/
+/* Selection. */
+/**************/
+
+/* Makes bread and bwrite use backend, or an image file named after their
+   deviceName argument when it is NULL. The caller keeps ownership */
+void backend_set(BlockBackend * backend)
+{
+    __atomic_store_n(&CURRENT_BACKEND, backend, __ATOMIC_RELEASE);
+}
+
+/* Returns the backend serving deviceName, NULL if there is none. Without a
+   chosen backend the image file is opened on first use and kept open */
+BlockBackend * backend_get(const char * deviceName)
+{
+    BlockBackend * backend = __atomic_load_n(&CURRENT_BACKEND, __ATOMIC_ACQUIRE);
+    if (backend != NULL) {
+        return backend;
+    }
+    pthread_mutex_lock(&DEFAULT_LOCK);
+    if (DEFAULT_BACKEND == NULL || strcmp(DEFAULT_PATH, deviceName) != 0) {
+        if (DEFAULT_BACKEND != NULL) {
+            DEFAULT_BACKEND->close(DEFAULT_BACKEND);
+            free(DEFAULT_PATH);
+        }
+        DEFAULT_BACKEND = backend_file_open(deviceName);
+        DEFAULT_PATH = DEFAULT_BACKEND != NULL ? strdup(deviceName) : NULL;
+    }
+    backend = DEFAULT_BACKEND;
+    pthread_mutex_unlock(&DEFAULT_LOCK);
+    return backend;
+}
@@ -0,0 +1,298 @@
+/*
+ * OPERATING SYSTEMS DESING - 16/17
+ *
+ * @file 	bench.c
+ * @brief 	Microbenchmarks of the file system, reported as JSON.
+ * @date	01/03/2017
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "include/filesystem.h"
+
+#define DEFAULT_BLOCKS 32768            // Size of the benchmarked device, in blocks
+#define NUM_FILES 512                   // Files created, opened and removed
+#define FILE_SIZE (16 << 20)            // Bytes of the file used by the read/write workloads
+#define RANDOM_OPS 256                  // Operations of every random workload
+#define CHECK_REPEATS 5                 // Runs of checkFile and checkFS
+
+/* Samples of one workload */
+typedef struct Workload {
+    const char * name;
+    const char * pattern;               // "seq", "random" or "" for metadata operations
+    int io_size;                        // Bytes per operation, 0 for metadata operations
+    int ops;
+    double * latencies;                 // Seconds taken by every operation
+    double seconds;
+} Workload;
+
+static FILE * OUTPUT;
+static int FIRST_RESULT = 1;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void workload_begin(Workload * w, const char * name, const char * pattern, int io_size, int max_ops)
+{
+    w->name = name;
+    w->pattern = pattern;
+    w->io_size = io_size;
+    w->ops = 0;
+    w->latencies = malloc(max_ops * sizeof(double));
+    w->seconds = 0;
+    fsStatsReset();
+}
+
+/* Records the latency of one operation started at start */
+static void workload_sample(Workload * w, double start)
+{
+    double latency = now() - start;
+    w->latencies[w->ops++] = latency;
+    w->seconds += latency;
+}
+
+static int compare_doubles(const void * a, const void * b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double * sorted, int count, double p)
+{
+    int index = (int) (p * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+/* Prints the summary of a workload as a JSON object and releases its samples */
+static void workload_end(Workload * w)
+{
+    FSStats stats;
+    fsStats(&stats);
+    qsort(w->latencies, w->ops, sizeof(double), compare_doubles);
+    double seconds = w->seconds > 0 ? w->seconds : 1e-9;
+    double bytes = (double) w->io_size * w->ops;
+
+    fprintf(OUTPUT, "%s\n    {\"name\": \"%s\", \"pattern\": \"%s\", \"io_size\": %d, \"ops\": %d, "
+            "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f,\n",
+            FIRST_RESULT ? "" : ",", w->name, w->pattern, w->io_size, w->ops,
+            w->seconds, w->ops / seconds, bytes / seconds / (1 << 20));
+    if (w->ops > 0) {
+        fprintf(OUTPUT, "     \"latency_us\": {\"mean\": %.2f, \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f},\n",
+                w->seconds / w->ops * 1e6, percentile(w->latencies, w->ops, 0.50) * 1e6,
+                percentile(w->latencies, w->ops, 0.90) * 1e6, percentile(w->latencies, w->ops, 0.99) * 1e6,
+                w->latencies[w->ops - 1] * 1e6);
+    }
+    fprintf(OUTPUT, "     \"device_reads\": %ld, \"device_writes\": %ld, \"metadata_reads\": %ld, \"metadata_writes\": %ld, "
+            "\"data_reads\": %ld, \"data_writes\": %ld}",
+            stats.ops[STAT_BREAD].calls + stats.ops[STAT_BREAD_BLOCKS].bytes / BLOCK_SIZE,
+            stats.ops[STAT_BWRITE].calls + stats.ops[STAT_BWRITE_BLOCKS].bytes / BLOCK_SIZE, stats.metadata_reads,
+            stats.metadata_writes, stats.data_reads, stats.data_writes);
+    FIRST_RESULT = 0;
+    free(w->latencies);
+}
+
+static void bench_metadata(void)
+{
+    Workload w;
+    char name[32];
+    double start;
+
+    workload_begin(&w, "createFile", "", 0, NUM_FILES);
+    for (int i = 0; i < NUM_FILES; i++) {
+        sprintf(name, "bench%d", i);
+        start = now();
+        createFile(name);
+        workload_sample(&w, start);
+    }
+    workload_end(&w);
+
+    workload_begin(&w, "openFile", "", 0, NUM_FILES);
+    for (int i = 0; i < NUM_FILES; i++) {
+        sprintf(name, "bench%d", i);
+        start = now();
+        int fd = openFile(name);
+        workload_sample(&w, start);
+        closeFile(fd);
+    }
+    workload_end(&w);
+
+    workload_begin(&w, "removeFile", "", 0, NUM_FILES);
+    for (int i = 0; i < NUM_FILES; i++) {
+        sprintf(name, "bench%d", i);
+        start = now();
+        removeFile(name);
+        workload_sample(&w, start);
+    }
+    workload_end(&w);
+
+    // The same files again, as one batch each way
+    char (*names)[32] = malloc(NUM_FILES * sizeof(*names));
+    char ** list = malloc(NUM_FILES * sizeof(char *));
+    int * results = malloc(NUM_FILES * sizeof(int));
+    for (int i = 0; i < NUM_FILES; i++) {
+        sprintf(names[i], "bench%d", i);
+        list[i] = names[i];
+    }
+    workload_begin(&w, "createFiles", "", 0, 1);
+    start = now();
+    createFiles(list, NUM_FILES, results);
+    workload_sample(&w, start);
+    workload_end(&w);
+
+    workload_begin(&w, "removeFiles", "", 0, 1);
+    start = now();
+    removeFiles(list, NUM_FILES, results);
+    workload_sample(&w, start);
+    workload_end(&w);
+    free(names);
+    free(list);
+    free(results);
+}
+
+/* Sequential passes over the whole file with one io_size */
+static void bench_sequential(int fd, char * buffer, int io_size)
+{
+    Workload w;
+    double start;
+    int ops = FILE_SIZE / io_size;
+
+    workload_begin(&w, "writeFile", "seq", io_size, ops);
+    lseekFile(fd, 0, FS_SEEK_BEGIN);
+    for (int i = 0; i < ops; i++) {
+        start = now();
+        writeFile(fd, buffer, io_size);
+        workload_sample(&w, start);
+    }
+    workload_end(&w);
+
+    workload_begin(&w, "readFile", "seq", io_size, ops);
+    lseekFile(fd, 0, FS_SEEK_BEGIN);
+    for (int i = 0; i < ops; i++) {
+        start = now();
+        readFile(fd, buffer, io_size);
+        workload_sample(&w, start);
+    }
+    workload_end(&w);
+}
+
+/* Operations at random offsets aligned to io_size */
+static void bench_random(int fd, char * buffer, int io_size)
+{
+    Workload w;
+    double start;
+    int slots = FILE_SIZE / io_size;
+
+    srand(io_size);
+    workload_begin(&w, "writeFile", "random", io_size, RANDOM_OPS);
+    for (int i = 0; i < RANDOM_OPS; i++) {
+        lseekFile(fd, (long) (rand() % slots) * io_size, FS_SEEK_BEGIN);
+        start = now();
+        writeFile(fd, buffer, io_size);
+        workload_sample(&w, start);
+    }
+    workload_end(&w);
+
+    workload_begin(&w, "readFile", "random", io_size, RANDOM_OPS);
+    for (int i = 0; i < RANDOM_OPS; i++) {
+        lseekFile(fd, (long) (rand() % slots) * io_size, FS_SEEK_BEGIN);
+        start = now();
+        readFile(fd, buffer, io_size);
+        workload_sample(&w, start);
+    }
+    workload_end(&w);
+}
+
+static void bench_data(void)
+{
+    static const int seq_sizes[] = {4096, 65536, 1 << 20};
+    static const int random_sizes[] = {4096, 65536};
+    char * buffer = malloc(1 << 20);
+    for (int i = 0; i < (1 << 20); i++) {
+        buffer[i] = rand();
+    }
+
+    createFile("bench.dat");
+    int fd = openFile("bench.dat");
+    for (int i = 0; i < sizeof(seq_sizes) / sizeof(seq_sizes[0]); i++) {
+        bench_sequential(fd, buffer, seq_sizes[i]);
+    }
+    for (int i = 0; i < sizeof(random_sizes) / sizeof(random_sizes[0]); i++) {
+        bench_random(fd, buffer, random_sizes[i]);
+    }
+    closeFile(fd);
+
+    Workload w;
+    double start;
+    workload_begin(&w, "checkFile", "", 0, CHECK_REPEATS);
+    for (int i = 0; i < CHECK_REPEATS; i++) {
+        start = now();
+        checkFile("bench.dat");
+        workload_sample(&w, start);
+    }
+    workload_end(&w);
+
+    workload_begin(&w, "checkFS", "", 0, CHECK_REPEATS);
+    for (int i = 0; i < CHECK_REPEATS; i++) {
+        start = now();
+        checkFS();
+        workload_sample(&w, start);
+    }
+    workload_end(&w);
+
+    removeFile("bench.dat");
+    free(buffer);
+}
+
+int main(int argc, char *argv[])
+{
+    long num_blocks = DEFAULT_BLOCKS;
+    int flags = 0;
+    char * path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:f:o:")) != -1) {
+        switch (opt) {
+            case 'b':
+                num_blocks = atol(optarg);
+                break;
+            case 'f':
+                flags = atoi(optarg);
+                break;
+            case 'o':
+                path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Syntax: ./fs_bench [-b num_blocks] [-f mkfs_flags] [-o output.json]\n");
+                return -1;
+        }
+    }
+
+    OUTPUT = stdout;
+    if (path != NULL && (OUTPUT = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "ERROR: UNABLE TO OPEN %s\n", path);
+        return -1;
+    }
+    if (mkFSWithFlags(num_blocks * BLOCK_SIZE, flags) != 0 || mountFS() != 0) {
+        fprintf(stderr, "ERROR: UNABLE TO FORMAT %s WITH %ld BLOCKS\n", DEVICE_IMAGE, num_blocks);
+        return -1;
+    }
+
+    fprintf(OUTPUT, "{\"block_size\": %d, \"device_blocks\": %ld, \"flags\": %d, \"results\": [",
+            FS_BLOCK_SIZE, num_blocks, flags);
+    bench_metadata();
+    bench_data();
+    fprintf(OUTPUT, "\n]}\n");
+
+    unmountFS();
+    if (OUTPUT != stdout) {
+        fclose(OUTPUT);
+    }
+    return 0;
+}
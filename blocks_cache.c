@@ -6,6 +6,9 @@
  */
 
 #include "blocks_cache.h"
+#include "backend.h"
+#include "stats.h"
+#include "trace.h"
 
 /****************/
 /* Disk access. */
@@ -17,63 +20,163 @@
  * read.
  */
 int bread(char *deviceName, int blockNumber, char *buffer) {
-	int fd = open(deviceName, O_RDONLY);
+	TRACE_BEGIN("bread", blockNumber);
+	long start = stats_now();
+	BlockBackend *backend = backend_get(deviceName);
 
-	if(fd < 0){
-		/* fprintf(stderr, "ERROR: UNABLE TO OPEN DISK FILE %s \n", deviceName); */
+	if(backend == NULL || backend->read(backend, blockNumber, buffer) != 0){
+		TRACE_END("bread", -1);
 		return -1;
 	}
 
-	int len = lseek(fd, 0, SEEK_END) + 1;
-	if((BLOCK_SIZE*blockNumber+BLOCK_SIZE) > len) {
-		close(fd);
+	stats_count_io(blockNumber, 0);
+	stats_record(STAT_BREAD, start, BLOCK_SIZE);
+
+	TRACE_END("bread", 0);
+	return 0;
+}
+
+/*
+ * Writes a block from a buffer to the device.
+ * Returns 0 or -1 in case of error.
+ */
+int bwrite(char *deviceName, int blockNumber, char*buffer) {
+	TRACE_BEGIN("bwrite", blockNumber);
+	long start = stats_now();
+	BlockBackend *backend = backend_get(deviceName);
+
+	if(backend == NULL || backend->write(backend, blockNumber, buffer) != 0){
+		TRACE_END("bwrite", -1);
 		return -1;
 	}
 
-	lseek(fd, BLOCK_SIZE*blockNumber, SEEK_SET);
+	stats_count_io(blockNumber, 1);
+	stats_record(STAT_BWRITE, start, BLOCK_SIZE);
 
-	int total_read, read_result;
+	TRACE_END("bwrite", 0);
+	return 0;
+}
 
-	total_read = 0;
-	do{
-		read_result = read(fd, buffer+total_read, BLOCK_SIZE-total_read);
-		total_read = total_read + read_result;
-	} while(total_read < BLOCK_SIZE && read_result >= 0);
+/*
+ * Reads count blocks from the device into consecutive buffers, letting the
+ * backend serve them in parallel.
+ * Returns 0 or -1 in case of error.
+ */
+int bread_blocks(char *deviceName, int *blockNumbers, char *buffers, int count) {
+	TRACE_BEGIN("bread_blocks", count);
+	long start = stats_now();
+	BlockBackend *backend = backend_get(deviceName);
+	int ret = backend == NULL ? -1 : 0;
+
+	if(backend != NULL && backend->read_blocks != NULL){
+		ret = backend->read_blocks(backend, blockNumbers, buffers, count);
+	} else {
+		for(int i = 0; i < count && ret == 0; i++){
+			ret = backend->read(backend, blockNumbers[i], buffers + (long) i * BLOCK_SIZE);
+		}
+	}
+	if(ret != 0){
+		TRACE_END("bread_blocks", -1);
+		return -1;
+	}
 
-	close(fd);
+	for(int i = 0; i < count; i++){
+		stats_count_io(blockNumbers[i], 0);
+	}
+	stats_record(STAT_BREAD_BLOCKS, start, (long) count * BLOCK_SIZE);
 
+	TRACE_END("bread_blocks", 0);
 	return 0;
 }
 
 /*
- * Writes a block from a buffer to the device.
+ * Writes count blocks from consecutive buffers to the device, letting the
+ * backend serve them in parallel.
  * Returns 0 or -1 in case of error.
  */
-int bwrite(char *deviceName, int blockNumber, char*buffer) {
-	int fd = open(deviceName, O_WRONLY);
-
-	if(fd < 0){
-		/* fprintf(stderr, "ERROR: UNABLE TO OPEN DISK FILE %s \n", deviceName); */
+int bwrite_blocks(char *deviceName, int *blockNumbers, char *buffers, int count) {
+	TRACE_BEGIN("bwrite_blocks", count);
+	long start = stats_now();
+	BlockBackend *backend = backend_get(deviceName);
+	int ret = backend == NULL ? -1 : 0;
+
+	if(backend != NULL && backend->write_blocks != NULL){
+		ret = backend->write_blocks(backend, blockNumbers, buffers, count);
+	} else {
+		for(int i = 0; i < count && ret == 0; i++){
+			ret = backend->write(backend, blockNumbers[i], buffers + (long) i * BLOCK_SIZE);
+		}
+	}
+	if(ret != 0){
+		TRACE_END("bwrite_blocks", -1);
 		return -1;
 	}
 
-	int len = lseek(fd, 0, SEEK_END) + 1;
-	if((BLOCK_SIZE*blockNumber+BLOCK_SIZE) > len) {
-		close(fd);
+	for(int i = 0; i < count; i++){
+		stats_count_io(blockNumbers[i], 1);
+	}
+	stats_record(STAT_BWRITE_BLOCKS, start, (long) count * BLOCK_SIZE);
+
+	TRACE_END("bwrite_blocks", 0);
+	return 0;
+}
+
+/*
+ * Reads one of the copies of a block kept by the device.
+ * Returns 0 or -1 in case of error or past the last copy.
+ */
+int bread_replica(char *deviceName, int blockNumber, int replica, char *buffer) {
+	TRACE_BEGIN("bread_replica", blockNumber);
+	long start = stats_now();
+	BlockBackend *backend = backend_get(deviceName);
+	int ret = -1;
+
+	if(backend != NULL && backend->read_replica != NULL){
+		ret = backend->read_replica(backend, blockNumber, replica, buffer);
+	} else if(backend != NULL && replica == 0){
+		ret = backend->read(backend, blockNumber, buffer);
+	}
+	if(ret != 0){
+		TRACE_END("bread_replica", -1);
 		return -1;
 	}
 
-	lseek(fd, BLOCK_SIZE*blockNumber, SEEK_SET);
+	stats_count_io(blockNumber, 0);
+	stats_record(STAT_BREAD, start, BLOCK_SIZE);
 
-	int total_write, write_result;
+	TRACE_END("bread_replica", 0);
+	return 0;
+}
 
-	total_write = 0;
-	do{
-		write_result = write(fd, buffer+total_write, BLOCK_SIZE-total_write);
-		total_write = total_write + write_result;
-	} while(total_write < BLOCK_SIZE && write_result >= 0);
+/*
+ * Queues rewriting one copy of a block with buffer, in the background.
+ * Returns 0 or -1 in case of error or when the device keeps no copies.
+ */
+int brepair(char *deviceName, int blockNumber, int replica, char *buffer) {
+	BlockBackend *backend = backend_get(deviceName);
+
+	if(backend == NULL || backend->repair == NULL){
+		return -1;
+	}
+	return backend->repair(backend, blockNumber, replica, buffer);
+}
 
-	close(fd);
+/*
+ * Tells the device that count blocks from blockNumber on are no longer used.
+ * Returns 0 or -1 in case of error or when the device cannot discard blocks.
+ */
+int bdiscard(char *deviceName, int blockNumber, int count) {
+	TRACE_BEGIN("bdiscard", blockNumber);
+	long start = stats_now();
+	BlockBackend *backend = backend_get(deviceName);
+
+	if(backend == NULL || backend->discard == NULL ||
+			backend->discard(backend, blockNumber, count) != 0){
+		TRACE_END("bdiscard", -1);
+		return -1;
+	}
+	stats_record(STAT_DISCARD, start, (long) count * BLOCK_SIZE);
 
+	TRACE_END("bdiscard", 0);
 	return 0;
 }
@@ -1,4 +1,3 @@
-
 /*
  * OPERATING SYSTEMS DESING - 16/17
  *
@@ -10,44 +9,169 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include "include/filesystem.h"
 
+#define FILL_BUFFER_SIZE (1 << 20)	// Bytes written by every call in fill mode
+#define MAX_FILL_THREADS 64
+
+/* Range of the image written by one fill thread */
+typedef struct fill_task {
+	int fd;
+	off_t start;
+	off_t end;
+	int result;
+} fill_task_t;
+
+static void usage(void)
+{
+	printf("Syntax: ./create_disk <num_blocks> [-m fill|sparse|alloc] [-j threads] [-o path]\n");
+	printf("  fill    writes the '0' pattern to every block (default)\n");
+	printf("  sparse  only sets the size of the image, blocks read as zeros\n");
+	printf("  alloc   reserves the blocks in the host file system without writing them\n");
+}
+
+/* Writes the fill pattern to a range of the image with large buffers */
+static void *fill_range(void *arg)
+{
+	fill_task_t *task = (fill_task_t *) arg;
+	char *buffer = malloc(FILL_BUFFER_SIZE);
+	task->result = -1;
+	if (buffer == NULL) {
+		return NULL;
+	}
+	memset(buffer, '0', FILL_BUFFER_SIZE);
+
+	off_t position = task->start;
+	while (position < task->end) {
+		size_t length = task->end - position < FILL_BUFFER_SIZE ? task->end - position : FILL_BUFFER_SIZE;
+		ssize_t written = pwrite(task->fd, buffer, length, position);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			free(buffer);
+			return NULL;
+		}
+		position += written;
+	}
+	free(buffer);
+	task->result = 0;
+	return NULL;
+}
+
+/* Fills the image using num_threads threads, each one writing a contiguous range */
+static int fill_disk(int fd, off_t size, int num_threads)
+{
+	pthread_t threads[MAX_FILL_THREADS];
+	fill_task_t tasks[MAX_FILL_THREADS];
+	off_t per_thread = (size / num_threads + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+
+	int started;
+	for (started = 0; started < num_threads; started++) {
+		tasks[started].fd = fd;
+		tasks[started].start = started * per_thread < size ? started * per_thread : size;
+		tasks[started].end = (started + 1) * per_thread < size ? (started + 1) * per_thread : size;
+		if (pthread_create(&threads[started], NULL, fill_range, &tasks[started]) != 0) {
+			break;
+		}
+	}
+
+	int ret = started == num_threads ? 0 : -1;
+	for (int i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+		if (tasks[i].result != 0) {
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
 int main ( int argc, char *argv[] )
 {
+	char *path = DEVICE_IMAGE;
+	char *mode = "fill";
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
 
-	char dummy_block[BLOCK_SIZE];
+	while ((opt = getopt(argc, argv, "m:j:o:")) != -1) {
+		switch (opt) {
+			case 'm':
+				mode = optarg;
+				break;
+			case 'j':
+				num_threads = atol(optarg);
+				break;
+			case 'o':
+				path = optarg;
+				break;
+			default:
+				usage();
+				return -1;
+		}
+	}
 
-	if(argc != 2){
+	if(optind != argc - 1){
 		printf("ERROR: Incorrect number of arguments:\n");
-		printf("Syntax: ./create_disk <num_blocks>\n");
+		usage();
 		return -1;
 	}
 
-	int num_blocks = atoi(argv[1]);
+	long num_blocks = atol(argv[optind]);
+	if (num_blocks <= 0) {
+		fprintf(stderr, "ERROR: INVALID NUMBER OF BLOCKS %s\n", argv[optind]);
+		return -1;
+	}
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+	if (num_threads > MAX_FILL_THREADS) {
+		num_threads = MAX_FILL_THREADS;
+	}
+	off_t size = (off_t) num_blocks * BLOCK_SIZE;
 
-	int fd = open("disk.dat", O_CREAT | O_RDWR | O_TRUNC, 0666);
+	int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0666);
 
 	if(fd < 0){
-		fprintf(stderr, "ERROR: UNABLE TO OPEN DISK FILE disk.dat \n");
+		fprintf(stderr, "ERROR: UNABLE TO OPEN DISK FILE %s: %s\n", path, strerror(errno));
+		return -1;
 	}
 
-	memset(dummy_block, '0', BLOCK_SIZE);
+	int ret;
+	if (strcmp(mode, "sparse") == 0) {
+		ret = ftruncate(fd, size);
+	} else if (strcmp(mode, "alloc") == 0) {
+		ret = fallocate(fd, 0, 0, size);
+	} else if (strcmp(mode, "fill") == 0) {
+		// Set the final size first so that every thread writes inside the file
+		ret = ftruncate(fd, size);
+		if (ret == 0) {
+			ret = fill_disk(fd, size, num_threads);
+		}
+	} else {
+		fprintf(stderr, "ERROR: UNKNOWN MODE %s\n", mode);
+		usage();
+		close(fd);
+		return -1;
+	}
 
-	int i;
-	int total_write, write_result;
-	for(i = 0; i < num_blocks; i++){
-		total_write = 0;
-		do{
-			write_result = write(fd, dummy_block+total_write, BLOCK_SIZE-total_write);
-			total_write = total_write + write_result;
-		}while(total_write < BLOCK_SIZE && write_result >= 0);
+	if (ret != 0) {
+		fprintf(stderr, "ERROR: UNABLE TO PROVISION DISK FILE %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if (close(fd) != 0) {
+		fprintf(stderr, "ERROR: UNABLE TO CLOSE DISK FILE %s: %s\n", path, strerror(errno));
+		return -1;
 	}
 
 	return 0;
@@ -6,19 +6,88 @@
  * @date	01/03/2017
  */
 
+#define _GNU_SOURCE
 #include "include/crc.h"			// Headers for the CRC functionality
 #include "include/filesystem.h"		// Headers for the core functionality
 #include "include/metadata.h"		// Type and structure declaration of the file system
 #include "include/auxiliary.h"		// Headers for auxiliary functions
+#include "include/stats.h"			// Headers for the runtime statistics
+#include "include/trace.h"			// Tracepoints, compiled in with FS_TRACE
+#include "include/async.h"			// Worker pool of the asynchronous calls
 #include <string.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <zlib.h>
+#include <pthread.h>
 
-#define MAX_NUMBER_OF_FILES 10
 OFT_Entry * OPEN_FILE_TABLE[MAX_NUMBER_OF_FILES] = {0}; // Pointers to structures OFT_Entry
 
+#define WRITE_CHUNK_BLOCKS 256 // Blocks staged in memory at once by writeFile
+#define READ_CHUNK_BLOCKS 256 // Blocks requested from the device at once by readFile
+#define RECLAIM_BATCH_FILES 16 // Removed files reclaimed every time the reclaimer takes FS_LOCK
+
+int INODE_BITMAP_START = 1;
+int DATA_BITMAP_START = 2;
+int CRC_START = 3;
 int INODE_START = -1;
+long NUM_INODE_BLOCKS = 0; // Blocks of the inode table
 int DATA_BLOCK_START = -1;
+long MAX_INODES = 0;
+long MAX_DATA_BLOCKS = 0;
+long FS_FLAGS = 0;
+long LOG_TAIL = 0; // Next data block to try when appending in log-structured mode
+int REFCOUNT_START = -1; // -1 when data blocks cannot be shared
+long DEFRAG_CURSOR = 0; // INode where the next defragFS step starts
+int DEDUP_START = -1;
+long NUM_DEDUP_BLOCKS = 0;
+int IMAP_START = -1; // Inode map, only in log-structured mode
+long NUM_IMAP_BLOCKS = 0;
+int32_t * INODE_MAP = NULL; // Inode map while mounted in log-structured mode, NULL otherwise
+char * IMAP_DIRTY = NULL; // Inode map blocks changed since the superblock was last saved
+long DIR_ROOT = -1; // Root node of the directory B-tree, -1 if there are no files
+long NUM_INODES_IN_USE = 0;
+long FREE_INODES = 0; // Free space summary kept in memory while mounted
+long FREE_DATA_BLOCKS = 0;
+long FREE_EXTENTS = 0;
+long FREE_EXTENT_SIZES[FS_EXTENT_CLASSES] = {0}; // Runs of every size class
+long FREE_HINT = 0; // Every data block before it is allocated, so searches start there
+int MOUNTED = 0; // Written to the superblock, which only says unmounted once unmountFS saved the counters
+
+/* Cache of directory nodes, evicting the least recently used. It is
+   write-through except during batched calls, which flush it at the end */
+struct {
+    long block; // -1 if the slot is free
+    unsigned long last_used;
+    int dirty; // Only while DIR_WRITE_BACK is set
+    DirNode node;
+} DIR_CACHE[DIR_CACHE_SIZE];
+unsigned long DIR_CACHE_CLOCK = 0;
+int DIR_WRITE_BACK = 0;
+
+long NUM_LAZY_GROUPS = 0;
+long LAZY_GROUP_BLOCKS = 0;
+char UNINIT_GROUPS[LAZY_MAX_GROUPS / 8]; // Groups of the metadata regions not zeroed yet
+pthread_mutex_t FS_LOCK = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP; // Serializes public calls, CRC updates and background work
+pthread_t LAZY_THREAD;
+int LAZY_THREAD_RUNNING = 0;
+volatile int LAZY_THREAD_STOP = 0;
+pthread_t RECLAIM_THREAD;
+int RECLAIM_THREAD_RUNNING = 0;
+int RECLAIM_THREAD_STOP = 0;
+int RECLAIM_SCANNED = 0; // Set once the files removed before the last unmount are queued
+pthread_mutex_t RECLAIM_LOCK = PTHREAD_MUTEX_INITIALIZER; // Guards the reclaim queue
+pthread_cond_t RECLAIM_READY = PTHREAD_COND_INITIALIZER;
+ReclaimEntry * RECLAIM_HEAD = NULL; // Removed files whose blocks are not released yet
+ReclaimEntry * RECLAIM_TAIL = NULL;
+pthread_t CLEAN_THREAD;
+int CLEAN_THREAD_RUNNING = 0;
+int CLEAN_THREAD_STOP = 0;
+int CLEAN_PENDING = 0; // The log tail wrapped around since the last pass of the cleaner
+int CLEANING = 0; // A pass of the cleaner is moving blocks, under FS_LOCK
+pthread_mutex_t CLEAN_LOCK = PTHREAD_MUTEX_INITIALIZER; // Guards the flags of the cleaner thread
+pthread_cond_t CLEAN_READY = PTHREAD_COND_INITIALIZER;
+uint16_t * CRC_TABLE = NULL; // CRCs of the data blocks while mounted with FS_FLAG_VERIFY, NULL otherwise
+char * VERIFIED = NULL; // Data blocks whose CRC was checked or written since the mount
 
 /*
  * @brief 	Generates the proper file system structure in a storage device, as designed by the student.
@@ -26,62 +95,175 @@ int DATA_BLOCK_START = -1;
  */
 int mkFS(long deviceSize)
 {
+    return mkFSWithFlags(deviceSize, 0);
+}
+
+/* Body of mkFSWithFlags, timed by the public wrapper below */
+static int mkfs_with_flags(long deviceSize, int flags)
+{
+    async_stop();
+    lazy_stop();
+    reclaim_stop(0);
+    clean_stop();
+    crc_table_drop();
+    imap_drop();
+    MOUNTED = 0;
     SuperBlock superblock;
-    init_superblock(&superblock, deviceSize); 
+    init_superblock(&superblock, deviceSize, flags); 
+    if (superblock.max_inodes <= 0 || superblock.max_data_blocks <= 0) {
+        return -1;
+    }
+    set_layout(&superblock);
+
+    /* The SuperBlock goes first, so that initializing a group can record
+       it there. Its CRC is written with the final version below */
+    if (fs_bwrite(DEVICE_IMAGE, 0, (char *) &superblock) != 0) {
+        return -1;
+    }
     
-    char buffer[BLOCK_SIZE] = {0};
+    char buffer[FS_BLOCK_SIZE] = {0};
 
     /* Write zeroes to the allocation bitmap blocks  */
-    bwrite_with_crc(DEVICE_IMAGE, 1, buffer);
-    bwrite_with_crc(DEVICE_IMAGE, 2, buffer);
+    for (long i = INODE_BITMAP_START; i < CRC_START; i++) {
+        bwrite_with_crc(DEVICE_IMAGE, i, buffer);
+    }
+
+    /* CRCs, inodes, reference counts, the hash index and the inode map start
+       zeroed as well, unless it is deferred to their first use */
+    if (!(flags & FS_FLAG_LAZY_INIT)) {
+        for (long group = 0; group < NUM_LAZY_GROUPS; group++) {
+            if (lazy_init_group(group) != 0) {
+                return -1;
+            }
+        }
+    }
    
     /* Write the SuperBlock to the disk */ 
-    memcpy(buffer, (void *) &superblock, sizeof(SuperBlock));
-    bwrite_with_crc(DEVICE_IMAGE, 0, buffer);
-
-	return 0;
+    return save_superblock();
 }
 
 /*
- * @brief 	Mounts a file system in the simulated device.
+ * @brief 	Generates the proper file system structure in a storage device, using the
+ * 		layout options given in flags (FS_FLAG_*).
  * @return 	0 if success, -1 otherwise.
  */
-int mountFS(void)
+int mkFSWithFlags(long deviceSize, int flags)
+{
+    TRACE_BEGIN("mkFSWithFlags", flags);
+    long start = stats_now();
+    int ret = mkfs_with_flags(deviceSize, flags);
+    stats_record(STAT_MKFS, start, 0);
+    TRACE_END("mkFSWithFlags", ret);
+    return ret;
+}
+
+/* Body of mountFS, timed by the public wrapper below */
+static int mount_fs(void)
 {
 
+    // Every structure is laid out for the block size of this build
     SuperBlock sblock = load_superblock();
-    INODE_START = 3 + sblock.num_crc_blocks;
-    DATA_BLOCK_START = 3 + sblock.max_inodes;
+    if (sblock.block_size != FS_BLOCK_SIZE) {
+        return -1;
+    }
+    lazy_stop();
+    reclaim_stop(1);
+    clean_stop();
+    imap_drop();
+    set_layout(&sblock);
+    DEFRAG_CURSOR = 0;
+    crc_table_drop();
+    if ((FS_FLAGS & FS_FLAG_VERIFY) && crc_table_load() != 0) {
+        return -1;
+    }
+    if ((FS_FLAGS & FS_FLAG_LOG) && imap_load() != 0) {
+        return -1;
+    }
+
+    /* The counters of an image that was not unmounted are older than its
+       bitmaps, so they are counted again. Until unmountFS the image says so */
+    if (sblock.mounted) {
+        if (count_free_space(&FREE_INODES, &FREE_DATA_BLOCKS, &FREE_EXTENTS, FREE_EXTENT_SIZES) != 0 ||
+                count_files(&NUM_INODES_IN_USE) != 0) {
+            return -1;
+        }
+        FREE_HINT = 0;
+    }
+    MOUNTED = 1;
+    if (save_superblock() != 0) {
+        return -1;
+    }
 
+    // Zero the remaining groups while the file system is in use
+    if (FS_FLAGS & FS_FLAG_LAZY_INIT) {
+        lazy_start();
+    }
+    // Release the blocks of removed files, starting with any left by the last mount
+    reclaim_start();
+    if (FS_FLAGS & FS_FLAG_LOG) {
+        clean_start();
+    }
     return 0;
 }
 
 /*
- * @brief 	Unmounts the file system from the simulated device.
+ * @brief 	Mounts a file system in the simulated device.
  * @return 	0 if success, -1 otherwise.
  */
-int unmountFS(void)
+int mountFS(void)
+{
+    TRACE_BEGIN("mountFS", 0);
+    long start = stats_now();
+    int ret = mount_fs();
+    stats_record(STAT_MOUNT, start, 0);
+    TRACE_END("mountFS", ret);
+    return ret;
+}
+
+/* Body of unmountFS, timed by the public wrapper below */
+static int unmount_fs(void)
 {
     if (INODE_START == -1) {
         return -1;
     }
+    // Persist the counters kept in memory while mounted
+    async_stop();
+    lazy_stop();
+    reclaim_stop(1);
+    clean_stop();
+    MOUNTED = 0;
+    save_superblock();
+    crc_table_drop();
+    imap_drop();
 	INODE_START = -1;
     DATA_BLOCK_START = -1;
+    stats_set_data_start(-1);
     return 0;
 }
 
 /*
- * @brief	Creates a new file, provided it it doesn't exist in the file system.
- * @return	0 if success, -1 if the file already exists, -2 in case of error.
+ * @brief 	Unmounts the file system from the simulated device.
+ * @return 	0 if success, -1 otherwise.
  */
-int createFile(char *fileName)
+int unmountFS(void)
+{
+    TRACE_BEGIN("unmountFS", 0);
+    long start = stats_now();
+    int ret = unmount_fs();
+    stats_record(STAT_UNMOUNT, start, 0);
+    TRACE_END("unmountFS", ret);
+    return ret;
+}
+
+/* Gives a new file the INode passed and adds it to the directory.
+   Returns 0 on success, -1 if the file already exists, -2 in case of error */
+static int new_file(char *fileName, INode *inode)
 {
     // Check filename
     if (strlen(fileName) > MAX_FILENAME) {
         return -2;
     }
-    SuperBlock sblock = load_superblock();
-    if (get_inode_index(&sblock, fileName) != -1) {
+    if (dir_lookup(fileName) != -1) {
         return -1;
     }
     // Update INode allocation
@@ -89,65 +271,263 @@ int createFile(char *fileName)
     if (inode_index == -1) {
         return -1;
     } 
-    // Create INode
-    INode inode;
-    // Init INode
-    inode.size = 0;
-    inode.num_blocks = 0;
     // Write INode to disk
-    bwrite_with_crc(DEVICE_IMAGE, INODE_START + inode_index, (char*) &inode);
-    // Update SuperBlock
-    sblock.num_inodes_in_use++;
-    memcpy(&(sblock.filenames[inode_index].name), fileName, strlen(fileName));
-    sblock.filenames[inode_index].index = inode_index;
-    bwrite_with_crc(DEVICE_IMAGE, 0, (char *) &sblock);
+    write_inode(inode_index, inode);
+    // Add the name to the directory
+    if (dir_insert(fileName, inode_index) != 0) {
+        free_inodes(1, &inode_index);
+        return -2;
+    }
+    NUM_INODES_IN_USE++;
     return 0;
 }
 
+/* Body of createFile, timed by the public wrapper below */
+static int create_file(char *fileName)
+{
+    // Init INode. New files start inline until they outgrow the inode
+    INode inode;
+    memset(&inode, 0, sizeof(INode));
+    inode.flags = INODE_INLINE;
+    return new_file(fileName, &inode);
+}
+
 /*
- * @brief	Deletes a file, provided it exists in the file system.
- * @return	0 if success, -1 if the file does not exist, -2 in case of error..
+ * @brief	Creates a new file, provided it it doesn't exist in the file system.
+ * @return	0 if success, -1 if the file already exists, -2 in case of error.
  */
-int removeFile(char *fileName)
+int createFile(char *fileName)
+{
+    TRACE_BEGIN("createFile", 0);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    int ret = create_file(fileName);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_CREATE, start, 0);
+    TRACE_END("createFile", ret);
+    return ret;
+}
+
+/* Body of removeFile, timed by the public wrapper below */
+static int remove_file(char *fileName)
 {
-    // Load Superblock
-    SuperBlock sblock = load_superblock();
     // Check that file exists
-    long inode_index = get_inode_index(&sblock, fileName);
+    long inode_index = dir_lookup(fileName);
     if (inode_index == -1) {
         return -1;
     }
-    // Prepare bitmap
-    char bitmap[BLOCK_SIZE];
-    // Update data allocation
-    bread(DEVICE_IMAGE, 2, bitmap);
-    INode inode;
-    bread(DEVICE_IMAGE, INODE_START + inode_index, (char *) &inode);
-    for (int i = 0; i < inode.num_blocks; i++) {
-        long data_index = inode.blocks[i];
-        bitmap_setbit(bitmap, data_index, 0);
+    // Remove the name from the directory
+    if (dir_remove(fileName) != 0) {
+        return -2;
     }
-    bwrite_with_crc(DEVICE_IMAGE, 2, bitmap); 
-    // Update inode allocation
-    bread(DEVICE_IMAGE, 1, bitmap);
-    bitmap_setbit(bitmap, inode_index, 0);
-    bwrite_with_crc(DEVICE_IMAGE, 1, bitmap);
-    // Update superblock
-    sblock.filenames[inode_index].index = -1;
-    sblock.num_inodes_in_use--;
-    bwrite_with_crc(DEVICE_IMAGE, 0, (char *) &sblock);
+    // The blocks and the inode are released later by the reclaimer
+    INode inode;
+    read_inode(inode_index, &inode);
+    inode.flags |= INODE_ORPHAN;
+    write_inode(inode_index, &inode);
+    NUM_INODES_IN_USE--;
+    reclaim_enqueue(inode_index);
     return 0;
 }
 
 /*
- * @brief	Opens an existing file.
- * @return	The file descriptor if possible, -1 if file does not exist, -2 in case of error..
+ * @brief	Deletes a file, provided it exists in the file system. Its space is given back
+ * 		in the background, or right away by reclaimFS.
+ * @return	0 if success, -1 if the file does not exist, -2 in case of error..
  */
-int openFile(char *fileName)
+int removeFile(char *fileName)
+{
+    TRACE_BEGIN("removeFile", 0);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    int ret = remove_file(fileName);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_REMOVE, start, 0);
+    TRACE_END("removeFile", ret);
+    return ret;
+}
+
+/* Body of createFiles, timed by the public wrapper below */
+static int create_files(char **fileNames, int count, int *results)
+{
+    if (fileNames == NULL || results == NULL || count < 0) {
+        return -2;
+    }
+    int * inodes = malloc((count + 1) * sizeof(int));
+    INode * table = calloc(count + 1, sizeof(INode));
+    if (inodes == NULL || table == NULL) {
+        free(inodes);
+        free(table);
+        return -2;
+    }
+    // Names that cannot be created get no inode
+    int wanted = 0;
+    for (int i = 0; i < count; i++) {
+        if (strlen(fileNames[i]) > MAX_FILENAME) {
+            results[i] = -2;
+        } else {
+            results[i] = dir_lookup(fileNames[i]) != -1 ? -1 : 0;
+        }
+        wanted += results[i] == 0;
+    }
+    // New files start inline until they outgrow the inode
+    int allocated = allocate_inodes(wanted, inodes);
+    for (int i = 0; i < allocated; i++) {
+        table[i].flags = INODE_INLINE;
+    }
+    write_inodes(allocated, inodes, table);
+
+    // Inodes are given out in order, the ones left over are released at the end
+    int used = 0;
+    dir_defer();
+    for (int i = 0; i < count; i++) {
+        if (results[i] != 0) {
+            continue;
+        }
+        if (used == allocated || dir_lookup(fileNames[i]) != -1) {
+            // Out of inodes, or a name repeated in the batch
+            results[i] = -1;
+        } else if (dir_insert(fileNames[i], inodes[used]) != 0) {
+            results[i] = -2;
+        } else {
+            used++;
+        }
+    }
+    dir_flush();
+    free_inodes(allocated - used, inodes + used);
+    NUM_INODES_IN_USE += used;
+    save_superblock();
+    free(inodes);
+    free(table);
+    return used;
+}
+
+/*
+ * @brief	Creates several files at once, storing in results[i] what createFile would
+ * 		return for fileNames[i]. The directory, the inode bitmap and the inode table
+ * 		are updated once for the whole batch.
+ * @return	Number of files created, -2 in case of error.
+ */
+int createFiles(char **fileNames, int count, int *results)
+{
+    TRACE_BEGIN("createFiles", count);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    int ret = create_files(fileNames, count, results);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_CREATE_BATCH, start, 0);
+    TRACE_END("createFiles", ret);
+    return ret;
+}
+
+/* Body of removeFiles, timed by the public wrapper below */
+static int remove_files(char **fileNames, int count, int *results)
+{
+    if (fileNames == NULL || results == NULL || count < 0) {
+        return -2;
+    }
+    int * inodes = malloc((count + 1) * sizeof(int));
+    INode * table = malloc((count + 1) * sizeof(INode));
+    if (inodes == NULL || table == NULL) {
+        free(inodes);
+        free(table);
+        return -2;
+    }
+    int removed = 0;
+    dir_defer();
+    for (int i = 0; i < count; i++) {
+        long inode_index = dir_lookup(fileNames[i]);
+        if (inode_index == -1) {
+            results[i] = -1;
+        } else if (dir_remove(fileNames[i]) != 0) {
+            results[i] = -2;
+        } else {
+            results[i] = 0;
+            inodes[removed++] = inode_index;
+        }
+    }
+    dir_flush();
+
+    // The blocks and the inodes are released later by the reclaimer
+    qsort(inodes, removed, sizeof(int), compare_blocks);
+    for (int i = 0; i < removed; i++) {
+        read_inode(inodes[i], &table[i]);
+        table[i].flags |= INODE_ORPHAN;
+    }
+    write_inodes(removed, inodes, table);
+    NUM_INODES_IN_USE -= removed;
+    for (int i = 0; i < removed; i++) {
+        reclaim_enqueue(inodes[i]);
+    }
+    save_superblock();
+    free(inodes);
+    free(table);
+    return removed;
+}
+
+/*
+ * @brief	Deletes several files at once, storing in results[i] what removeFile would
+ * 		return for fileNames[i]. The directory and the inode table are updated once
+ * 		for the whole batch.
+ * @return	Number of files removed, -2 in case of error.
+ */
+int removeFiles(char **fileNames, int count, int *results)
+{
+    TRACE_BEGIN("removeFiles", count);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    int ret = remove_files(fileNames, count, results);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_REMOVE_BATCH, start, 0);
+    TRACE_END("removeFiles", ret);
+    return ret;
+}
+
+/* Body of cloneFile, timed by the public wrapper below */
+static int clone_file(char *srcName, char *dstName)
+{
+    long src_index = dir_lookup(srcName);
+    if (src_index == -1 || dir_lookup(dstName) != -1) {
+        return -1;
+    }
+    // Images formatted before reference counts were kept cannot share blocks
+    if (REFCOUNT_START == -1) {
+        return -2;
+    }
+    INode inode;
+    read_inode(src_index, &inode);
+    if (!(inode.flags & INODE_INLINE) && share_file_blocks(&inode) != 0) {
+        return -2;
+    }
+    int ret = new_file(dstName, &inode);
+    if (ret != 0 && !(inode.flags & INODE_INLINE)) {
+        release_file_blocks(&inode, 0);
+    }
+    return ret;
+}
+
+/*
+ * @brief	Creates dstName as a copy of srcName that shares its data blocks. Each
+ * 		block is copied only when one of the files writes it.
+ * @return	0 if success, -1 if srcName does not exist or dstName already exists, -2 in case of error.
+ */
+int cloneFile(char *srcName, char *dstName)
+{
+    TRACE_BEGIN("cloneFile", 0);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    int ret = clone_file(srcName, dstName);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_CLONE, start, 0);
+    TRACE_END("cloneFile", ret);
+    return ret;
+}
+
+/* Body of openFile, timed by the public wrapper below */
+static int open_file(char *fileName)
 {
     // TODO Check for file integrity
-    SuperBlock sblock = load_superblock();
-    int inode_index = get_inode_index(&sblock, fileName);
+    int inode_index = dir_lookup(fileName);
     if (inode_index == -1) {
         return -1;
     }
@@ -174,10 +554,23 @@ int openFile(char *fileName)
 }
 
 /*
- * @brief	Closes a file.
- * @return	0 if success, -1 otherwise.
+ * @brief	Opens an existing file.
+ * @return	The file descriptor if possible, -1 if file does not exist, -2 in case of error..
  */
-int closeFile(int fileDescriptor)
+int openFile(char *fileName)
+{
+    TRACE_BEGIN("openFile", 0);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    int ret = open_file(fileName);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_OPEN, start, 0);
+    TRACE_END("openFile", ret);
+    return ret;
+}
+
+/* Body of closeFile, timed by the public wrapper below */
+static int close_file(int fileDescriptor)
 {
     if (fileDescriptor < 0 || OPEN_FILE_TABLE[fileDescriptor] == NULL) {
         return -1;    
@@ -188,101 +581,211 @@ int closeFile(int fileDescriptor)
 }
 
 /*
- * @brief	Reads a number of bytes from a file and stores them in a buffer.
- * @return	Number of bytes properly read, -1 in case of error.
+ * @brief	Closes a file.
+ * @return	0 if success, -1 otherwise.
  */
-int readFile(int fileDescriptor, void *buffer, int numBytes)
+int closeFile(int fileDescriptor)
+{
+    TRACE_BEGIN("closeFile", fileDescriptor);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    int ret = close_file(fileDescriptor);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_CLOSE, start, 0);
+    TRACE_END("closeFile", ret);
+    return ret;
+}
+
+/* Body of readFile, timed by the public wrapper below */
+static int read_file(int fileDescriptor, void *buffer, int numBytes)
 {
     if (fileDescriptor < 0 || OPEN_FILE_TABLE[fileDescriptor] == NULL) {
         return -1;
     }
-    OFT_Entry oft = *(OPEN_FILE_TABLE[fileDescriptor]);
+    OFT_Entry * oft = OPEN_FILE_TABLE[fileDescriptor];
    
     INode inode;
-    bread(DEVICE_IMAGE, INODE_START + oft.inode, (char *) &inode);
+    read_inode(oft->inode, &inode);
 
-    int bytes_read = 0;
+    if (numBytes + oft->offset > inode.size) {
+        numBytes = inode.size - oft->offset;    
+    }
+    if (numBytes <= 0) {
+        return 0;
+    }
 
-	long current_block = oft.offset / BLOCK_SIZE;
-    
-    char temp_buffer[BLOCK_SIZE] = {0};
-    
-    if (numBytes + oft.offset > inode.size) {
-        numBytes = inode.size - oft.offset;    
+    // Inline files are served straight from the inode
+    if (inode.flags & INODE_INLINE) {
+        memcpy(buffer, inode.inline_data + oft->offset, numBytes);
+        oft->offset += numBytes;
+        return numBytes;
     }
 
+    BlockMap map;
+    map_init(&map, &inode);
+
+    // Compressed files only decompress the clusters this read touches
+    if (inode.flags & INODE_COMPRESSED) {
+        char * cluster = malloc(CLUSTER_SIZE);
+        if (cluster == NULL) {
+            return -1;
+        }
+        int bytes_read = 0;
+        while (bytes_read < numBytes) {
+            long current_cluster = (oft->offset + bytes_read) / CLUSTER_SIZE;
+            long cluster_offset = (oft->offset + bytes_read) % CLUSTER_SIZE;
+            int bytes_this_loop = numBytes - bytes_read < CLUSTER_SIZE - cluster_offset ?
+                                  numBytes - bytes_read : CLUSTER_SIZE - cluster_offset;
+            if (read_cluster(&map, current_cluster, cluster) != 0) {
+                free(cluster);
+                return -1;
+            }
+            memcpy(buffer + bytes_read, cluster + cluster_offset, bytes_this_loop);
+            bytes_read += bytes_this_loop;
+        }
+        free(cluster);
+        oft->offset += numBytes;
+        return numBytes;
+    }
+
+    // Every chunk of blocks is requested at once so that the device can serve them in parallel
+    int bytes_read = 0;
+    char * blocks = malloc((long) READ_CHUNK_BLOCKS * FS_BLOCK_SIZE);
+    if (blocks == NULL) {
+        return -1;
+    }
+    int targets[READ_CHUNK_BLOCKS];
+
     while (bytes_read < numBytes) {
-        int block_index = inode.blocks[current_block];
-        bread(DEVICE_IMAGE, DATA_BLOCK_START + block_index, temp_buffer);
-        memcpy(buffer + bytes_read, temp_buffer, numBytes - bytes_read < BLOCK_SIZE ? numBytes - bytes_read : BLOCK_SIZE);
-        bytes_read += BLOCK_SIZE;
-        current_block++;
+        long first_block = (oft->offset + bytes_read) / FS_BLOCK_SIZE;
+        long last_block = (oft->offset + numBytes - 1) / FS_BLOCK_SIZE;
+        int count = last_block - first_block + 1 < READ_CHUNK_BLOCKS ? last_block - first_block + 1 : READ_CHUNK_BLOCKS;
+        int num_targets = 0;
+        for (int i = 0; i < count; i++) {
+            long block_index = map_get(&map, first_block + i);
+            if (block_index != FS_HOLE) {
+                targets[num_targets++] = DATA_BLOCK_START + block_index;
+            }
+        }
+        if (num_targets > 0 && (fs_bread_blocks(DEVICE_IMAGE, targets, blocks, num_targets) != 0 ||
+                                verify_blocks(targets, blocks, num_targets) != 0)) {
+            free(blocks);
+            return -1;
+        }
+
+        int next_target = 0;
+        for (int i = 0; i < count; i++) {
+            long block_offset = (oft->offset + bytes_read) % FS_BLOCK_SIZE;
+            int bytes_this_loop = numBytes - bytes_read < FS_BLOCK_SIZE - block_offset ?
+                                  numBytes - bytes_read : FS_BLOCK_SIZE - block_offset;
+            if (map_get(&map, first_block + i) == FS_HOLE) {
+                // Holes read as zeros without touching the device
+                memset(buffer + bytes_read, 0, bytes_this_loop);
+            } else {
+                memcpy(buffer + bytes_read, blocks + (long) next_target++ * FS_BLOCK_SIZE + block_offset, bytes_this_loop);
+            }
+            bytes_read += bytes_this_loop;
+        }
     }
-    
-    oft.offset += numBytes;
+    free(blocks);
+
+    oft->offset += numBytes;
     return numBytes;
 }
 
 /*
- * @brief	Writes a number of bytes from a buffer and into a file.
- * @return	Number of bytes properly written, -1 in case of error.
+ * @brief	Reads a number of bytes from a file and stores them in a buffer.
+ * @return	Number of bytes properly read, -1 in case of error.
  */
-int writeFile(int fileDescriptor, void *buffer, int numBytes)
+int readFile(int fileDescriptor, void *buffer, int numBytes)
+{
+    TRACE_BEGIN("readFile", numBytes);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    int ret = read_file(fileDescriptor, buffer, numBytes);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_READ, start, ret > 0 ? ret : 0);
+    TRACE_END("readFile", ret);
+    return ret;
+}
+
+/* Body of writeFile, timed by the public wrapper below */
+static int write_file(int fileDescriptor, void *buffer, int numBytes)
 {
     // Check that file is open
     if (fileDescriptor < 0 || OPEN_FILE_TABLE[fileDescriptor] == NULL) {
         return -1;   
     }
+    if (numBytes <= 0) {
+        return 0;
+    }
     // Load entry 
     OFT_Entry * oft = OPEN_FILE_TABLE[fileDescriptor];
     INode inode;
-    bread(DEVICE_IMAGE, INODE_START + oft->inode, (char *) &inode);
-    // Determine which block to start writing to
-    long current_block = oft->offset / BLOCK_SIZE;
-    printf("Offset: %ld Current_block: %ld\n", oft->offset, current_block);
-    // Write from buffer to file numBytes. If this is past the end of the file, extend the file. Update INode and Data
-    int bytes_written = 0;
-    char temp_buffer[BLOCK_SIZE] = {0};
-    int block_index;
-    while (bytes_written < numBytes) {
-        int bytes_this_loop = numBytes - bytes_written < BLOCK_SIZE ? numBytes - bytes_written : BLOCK_SIZE;
-        if (current_block >= inode.num_blocks) {
-            // Allocate a new block
-            block_index = allocate_data_block(); 
-            inode.num_blocks++;
-            inode.blocks[current_block] = block_index;
-            inode.size += bytes_this_loop; 
-            memset(temp_buffer, 0, BLOCK_SIZE); 
-        } else {
-            block_index = inode.blocks[current_block];
-             if (numBytes - bytes_written < BLOCK_SIZE) {
-                 bread(DEVICE_IMAGE, DATA_BLOCK_START + block_index, temp_buffer);
-             }
+    read_inode(oft->inode, &inode);
+    if (oft->offset + numBytes > MAX_FILE_SIZE) {
+        numBytes = MAX_FILE_SIZE - oft->offset;
+        if (numBytes <= 0) {
+            return -1;
+        }
+    }
+    if (inode.flags & INODE_INLINE) {
+        if (oft->offset + numBytes <= INODE_INLINE_SIZE) {
+            // Still fits in the inode: a single inode table update
+            memcpy(inode.inline_data + oft->offset, buffer, numBytes);
+            if (oft->offset + numBytes > inode.size) {
+                inode.size = oft->offset + numBytes;
+            }
+            write_inode(oft->inode, &inode);
+            oft->offset += numBytes;
+            return numBytes;
+        }
+        if (promote_inline(&inode) != 0) {
+            return -1;
         }
-       
-        memcpy(temp_buffer, buffer + bytes_written, bytes_this_loop);
-        bwrite_with_crc(DEVICE_IMAGE, DATA_BLOCK_START + block_index, temp_buffer);
-        bytes_written += BLOCK_SIZE;
-        current_block++;
     }
+    BlockMap map;
+    map_init(&map, &inode);
+    int ret;
+    if (inode.flags & INODE_COMPRESSED) {
+        ret = write_compressed(&map, oft->offset, buffer, numBytes);
+    } else {
+        ret = write_blocks(&map, oft->offset, buffer, numBytes);
+    }
+    map_flush(&map);
 
     // Write INODE
-    bwrite_with_crc(DEVICE_IMAGE, INODE_START + oft->inode, (char *) &inode);
+    if (ret > 0 && oft->offset + ret > inode.size) {
+        inode.size = oft->offset + ret;
+    }
+    write_inode(oft->inode, &inode);
 
-    // Update CRC
-    // TODO
     // Return number of bytes properly written.
-    oft->offset += numBytes;
-	printf("numBytes: %d, offset: %ld\n", numBytes, oft->offset);
-    return numBytes;
+    if (ret > 0) {
+        oft->offset += ret;
+    }
+    return ret;
 }
 
-
 /*
- * @brief	Modifies the position of the seek pointer of a file.
- * @return	0 if success, -1 otherwise.
+ * @brief	Writes a number of bytes from a buffer and into a file.
+ * @return	Number of bytes properly written, -1 in case of error.
  */
-int lseekFile(int fileDescriptor, long offset, int whence)
+int writeFile(int fileDescriptor, void *buffer, int numBytes)
+{
+    TRACE_BEGIN("writeFile", numBytes);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    int ret = write_file(fileDescriptor, buffer, numBytes);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_WRITE, start, ret > 0 ? ret : 0);
+    TRACE_END("writeFile", ret);
+    return ret;
+}
+
+
+/* Body of lseekFile, timed by the public wrapper below */
+static int lseek_file(int fileDescriptor, long offset, int whence)
 {
 
     if (fileDescriptor < 0 || OPEN_FILE_TABLE[fileDescriptor] == NULL) {
@@ -301,7 +804,7 @@ int lseekFile(int fileDescriptor, long offset, int whence)
             new_seek_pos = 0; 
             break;
         case FS_SEEK_END:
-            bread(DEVICE_IMAGE, INODE_START + oft->inode, (char *) &inode);
+            read_inode(oft->inode, &inode);
             new_seek_pos = inode.size;
             break;
         default:
@@ -309,191 +812,3442 @@ int lseekFile(int fileDescriptor, long offset, int whence)
     }
     
     oft->offset = new_seek_pos + offset;
-    return oft->offset;
+    return 0;
 }
 
 /*
- * @brief 	Verifies the integrity of the file system metadata.
- * @return 	0 if the file system is correct, -1 if the file system is corrupted, -2 in case of error.
+ * @brief	Modifies the position of the seek pointer of a file.
+ * @return	0 if success, -1 otherwise.
  */
-int checkFS(void)
+int lseekFile(int fileDescriptor, long offset, int whence)
 {
-    // Check superblock
-    int ret;
-    if ((ret = check_crc(0)) != 0) {
-        return ret;    
+    TRACE_BEGIN("lseekFile", offset);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    int ret = lseek_file(fileDescriptor, offset, whence);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_LSEEK, start, 0);
+    TRACE_END("lseekFile", ret);
+    return ret;
+}
+
+/* Copies len bytes through a buffer with the bodies of readFile and
+   writeFile, moving the offsets of both descriptors.
+   Returns the number of bytes copied, -1 if the buffer cannot be allocated */
+static long copy_bytes(int srcFd, long srcOff, int dstFd, long dstOff, long len)
+{
+    if (len <= 0) {
+        return 0;
     }
-    
-    // Check Allocation blocks
-    if ((ret = check_crc(1)) != 0) {
-        return ret;    
+    long chunk = (long) WRITE_CHUNK_BLOCKS * FS_BLOCK_SIZE;
+    char * buffer = malloc(len < chunk ? len : chunk);
+    if (buffer == NULL) {
+        return -1;
     }
-    if ((ret = check_crc(2)) != 0) {
-        return ret;    
-    } 
-   
-    // Check INodes
-    for (int i = INODE_START; i < DATA_BLOCK_START; i++) {
-        if ((ret = check_crc(i)) != 0) {
-            return ret;    
-        } 
+    long copied = 0;
+    while (copied < len) {
+        int bytes_this_loop = len - copied < chunk ? len - copied : chunk;
+        OPEN_FILE_TABLE[srcFd]->offset = srcOff + copied;
+        int bytes_read = read_file(srcFd, buffer, bytes_this_loop);
+        if (bytes_read <= 0) {
+            break;
+        }
+        OPEN_FILE_TABLE[dstFd]->offset = dstOff + copied;
+        int bytes_written = write_file(dstFd, buffer, bytes_read);
+        if (bytes_written > 0) {
+            copied += bytes_written;
+        }
+        if (bytes_written != bytes_read || bytes_read < bytes_this_loop) {
+            break;
+        }
     }
-	return 0;
+    free(buffer);
+    return copied;
 }
 
-/*
- * @brief 	Verifies the integrity of a file.
- * @return 	0 if the file is correct, -1 if the file is corrupted, -2 in case of error.
- */
-int checkFile(char *fileName)
+/* Copies count whole blocks between two files with copy_blocks.
+   Returns the number of blocks copied, -1 if the files do not keep their
+   data as plain blocks or in case of error */
+static long copy_whole_blocks(long src_index, long src_block, long dst_index, long dst_block, long count)
 {
-    // Read all of the blocks, and check that the CRC matches
-    SuperBlock sblock = load_superblock();
-
-    int inode_index = get_inode_index(&sblock, fileName);
-
-    INode inode;
-    bread(DEVICE_IMAGE, INODE_START + inode_index, (char *) &inode);
-
-    int i;
+    INode src, dst;
+    read_inode(src_index, &src);
+    read_inode(dst_index, &dst);
+    if ((src.flags & (INODE_INLINE | INODE_COMPRESSED)) || (dst.flags & INODE_COMPRESSED)) {
+        return -1;
+    }
+    if ((dst.flags & INODE_INLINE) && promote_inline(&dst) != 0) {
+        return -1;
+    }
+    BlockMap map;
+    map_init(&map, &dst);
+    long copied = copy_blocks(&src, src_block, &map, dst_block, count);
+    map_flush(&map);
+    if (copied > 0 && (dst_block + copied) * FS_BLOCK_SIZE > dst.size) {
+        dst.size = (dst_block + copied) * FS_BLOCK_SIZE;
+    }
+    write_inode(dst_index, &dst);
+    return copied;
+}
+
+/* Body of copyFileRange, timed by the public wrapper below */
+static long copy_range(int srcFd, long srcOff, int dstFd, long dstOff, long len)
+{
+    if (srcFd < 0 || srcFd >= MAX_NUMBER_OF_FILES || OPEN_FILE_TABLE[srcFd] == NULL ||
+            dstFd < 0 || dstFd >= MAX_NUMBER_OF_FILES || OPEN_FILE_TABLE[dstFd] == NULL ||
+            srcOff < 0 || dstOff < 0 || len < 0) {
+        return -1;
+    }
+    OFT_Entry * src = OPEN_FILE_TABLE[srcFd];
+    OFT_Entry * dst = OPEN_FILE_TABLE[dstFd];
+    INode inode;
+    read_inode(src->inode, &inode);
+    if (srcOff + len > inode.size) {
+        len = inode.size > srcOff ? inode.size - srcOff : 0;
+    }
+    if (dstOff + len > MAX_FILE_SIZE) {
+        len = MAX_FILE_SIZE - dstOff;
+    }
+    if (len <= 0) {
+        return len == 0 ? 0 : -1;
+    }
+    // Overlapping ranges of one file would read data the copy already overwrote
+    if (src->inode == dst->inode && srcOff < dstOff + len && dstOff < srcOff + len) {
+        return -1;
+    }
+
+    long src_offset = src->offset;
+    long dst_offset = dst->offset;
+    long copied = 0;
+    /* With both offsets at the same position inside a block, the whole blocks
+       in the middle are copied as they are and only the ends need a buffer */
+    if (srcOff % FS_BLOCK_SIZE == dstOff % FS_BLOCK_SIZE) {
+        long head = (FS_BLOCK_SIZE - srcOff % FS_BLOCK_SIZE) % FS_BLOCK_SIZE;
+        head = head < len ? head : len;
+        copied = copy_bytes(srcFd, srcOff, dstFd, dstOff, head);
+        if (copied < 0) {
+            return -1;
+        }
+        if (copied == head && len - copied >= FS_BLOCK_SIZE) {
+            long blocks = copy_whole_blocks(src->inode, (srcOff + copied) / FS_BLOCK_SIZE,
+                                            dst->inode, (dstOff + copied) / FS_BLOCK_SIZE, (len - copied) / FS_BLOCK_SIZE);
+            copied += blocks > 0 ? blocks * FS_BLOCK_SIZE : 0;
+        }
+    }
+    if (copied < len) {
+        long tail = copy_bytes(srcFd, srcOff + copied, dstFd, dstOff + copied, len - copied);
+        copied += tail > 0 ? tail : 0;
+    }
+    src->offset = src_offset;
+    dst->offset = dst_offset;
+    return copied > 0 ? copied : -1;
+}
+
+/*
+ * @brief	Copies len bytes at srcOff of the file open as srcFd to dstOff of the file open
+ * 		as dstFd, inside the file system. Neither descriptor moves. Blocks copied
+ * 		unchanged keep the CRC they had.
+ * @return	Number of bytes copied, which is less than len at the end of the source,
+ * 		-1 in case of error or if the ranges overlap in the same file.
+ */
+long copyFileRange(int srcFd, long srcOff, int dstFd, long dstOff, long len)
+{
+    TRACE_BEGIN("copyFileRange", len);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    long ret = copy_range(srcFd, srcOff, dstFd, dstOff, len);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_COPY, start, ret > 0 ? ret : 0);
+    TRACE_END("copyFileRange", ret);
+    return ret;
+}
+
+/* Body of checkFS, timed by the public wrapper below */
+static int check_fs(void)
+{
+    // Check superblock
+    int ret;
+    if ((ret = check_crc(0)) != 0) {
+        return ret;    
+    }
+    
+    // Check Allocation blocks
+    for (int i = INODE_BITMAP_START; i < CRC_START; i++) {
+        if ((ret = check_crc(i)) != 0) {
+            return ret;    
+        }
+    }
    
-    for (i = 0; i < inode.num_blocks; i++) {
-        int blockNumber = DATA_BLOCK_START + inode.blocks[i];
-        int ret;
-        if ((ret = check_crc(blockNumber)) != 0) {
-            return ret; 
+    // Check the inode table blocks holding INodes in use, once each
+    char bitmap[FS_BLOCK_SIZE];
+    long checked = -1;
+    for (long i = 0; i < MAX_INODES; i++) {
+        if (i % BITS_PER_BLOCK == 0 && fs_bread(DEVICE_IMAGE, INODE_BITMAP_START + i / BITS_PER_BLOCK, bitmap) != 0) {
+            return -2;
+        }
+        if (bitmap_getbit(bitmap, i % BITS_PER_BLOCK) && i / INODES_PER_BLOCK != checked) {
+            checked = i / INODES_PER_BLOCK;
+            if ((ret = check_crc(inode_location(checked))) != 0) {
+                return ret;
+            }
+        } 
+    }
+
+    // Check the reference counts, the hash index and the inode map. Groups never used are known to be zero
+    for (int i = INODE_START + NUM_INODE_BLOCKS; i < DATA_BLOCK_START; i++) {
+        if (!lazy_pending(i) && (ret = check_crc(i)) != 0) {
+            return ret;
+        }
+    }
+
+    // The free space summary must match the bitmaps
+    long free_inodes, free_blocks, free_extents;
+    long extent_sizes[FS_EXTENT_CLASSES];
+    if (count_free_space(&free_inodes, &free_blocks, &free_extents, extent_sizes) != 0) {
+        return -2;
+    }
+    if (free_inodes != FREE_INODES || free_blocks != FREE_DATA_BLOCKS || free_extents != FREE_EXTENTS ||
+            memcmp(extent_sizes, FREE_EXTENT_SIZES, sizeof(extent_sizes)) != 0) {
+        return -1;
+    }
+
+    // Check the nodes of the directory
+    return dir_check(DIR_ROOT);
+}
+
+/*
+ * @brief 	Verifies the integrity of the file system metadata.
+ * @return 	0 if the file system is correct, -1 if the file system is corrupted, -2 in case of error.
+ */
+int checkFS(void)
+{
+    TRACE_BEGIN("checkFS", 0);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    int ret = check_fs();
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_CHECKFS, start, 0);
+    TRACE_END("checkFS", ret);
+    return ret;
+}
+
+/* Visitor used by checkFile on every block of a file */
+static int check_data_block_crc(int block, void * arg) {
+    return check_crc(DATA_BLOCK_START + block);
+}
+
+/* Body of checkFile, timed by the public wrapper below */
+static int check_file(char *fileName)
+{
+    // Read all of the blocks, and check that the CRC matches
+    int inode_index = dir_lookup(fileName);
+    if (inode_index == -1) {
+        return -2;
+    }
+
+    // The CRC of the inode table block also covers the data of inline files
+    int ret;
+    if ((ret = check_crc(inode_location(inode_index / INODES_PER_BLOCK))) != 0) {
+        return ret;
+    }
+
+    INode inode;
+    read_inode(inode_index, &inode);
+    if (inode.flags & INODE_INLINE) {
+        return 0;
+    }
+
+    // Data blocks and the indirect blocks that map them
+    return map_for_each_block(&inode, check_data_block_crc, NULL);
+}
+
+/*
+ * @brief 	Verifies the integrity of a file.
+ * @return 	0 if the file is correct, -1 if the file is corrupted, -2 in case of error.
+ */
+int checkFile(char *fileName)
+{
+    TRACE_BEGIN("checkFile", 0);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    int ret = check_file(fileName);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_CHECKFILE, start, 0);
+    TRACE_END("checkFile", ret);
+    return ret;
+}
+
+/* Body of setFileCompression, timed by the public wrapper below */
+static int set_file_compression(char *fileName, int enabled)
+{
+    int inode_index = dir_lookup(fileName);
+    if (inode_index == -1) {
+        return -1;
+    }
+    INode inode;
+    if (read_inode(inode_index, &inode) != 0) {
+        return -2;
+    }
+    if (!(inode.flags & INODE_INLINE) && inode.num_blocks > 0) {
+        return -1;
+    }
+    if (enabled) {
+        inode.flags |= INODE_COMPRESSED;
+    } else {
+        inode.flags &= ~INODE_COMPRESSED;
+    }
+    if (write_inode(inode_index, &inode) != 0) {
+        return -2;
+    }
+    return 0;
+}
+
+/*
+ * @brief	Enables or disables transparent compression of a file. It can only be changed
+ * 		while the file has no data blocks (it is empty or stored inline).
+ * @return	0 if success, -1 if the file does not exist or already has data blocks, -2 in case of error.
+ */
+int setFileCompression(char *fileName, int enabled)
+{
+    TRACE_BEGIN("setFileCompression", enabled);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    int ret = set_file_compression(fileName, enabled);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_SET_COMPRESSION, start, 0);
+    TRACE_END("setFileCompression", ret);
+    return ret;
+}
+
+/* Body of fragmentationFile, timed by the public wrapper below */
+static int fragmentation_file(char *fileName, FileFragmentation *frag)
+{
+    int inode_index = dir_lookup(fileName);
+    if (inode_index == -1) {
+        return -1;
+    }
+    INode inode;
+    if (frag == NULL || read_inode(inode_index, &inode) != 0) {
+        return -2;
+    }
+    measure_layout(&inode, frag);
+    return 0;
+}
+
+/*
+ * @brief	Fills frag with the layout of the data blocks of a file.
+ * @return	0 if success, -1 if the file does not exist, -2 in case of error.
+ */
+int fragmentationFile(char *fileName, FileFragmentation *frag)
+{
+    TRACE_BEGIN("fragmentationFile", 0);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    int ret = fragmentation_file(fileName, frag);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_FRAGMENTATION, start, 0);
+    TRACE_END("fragmentationFile", ret);
+    return ret;
+}
+
+/* Body of defragFile, timed by the public wrapper below */
+static long defrag_file(char *fileName)
+{
+    int inode_index = dir_lookup(fileName);
+    if (inode_index == -1) {
+        return -1;
+    }
+    long moved = defrag_inode(inode_index, -1);
+    return moved < 0 ? -2 : moved;
+}
+
+/*
+ * @brief	Moves the data blocks of a file into a run of consecutive free blocks.
+ * 		Blocks shared with other files stay where they are.
+ * @return	Number of blocks moved, -1 if the file does not exist, -2 in case of error.
+ */
+long defragFile(char *fileName)
+{
+    TRACE_BEGIN("defragFile", 0);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    long ret = defrag_file(fileName);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_DEFRAG, start, ret > 0 ? ret * FS_BLOCK_SIZE : 0);
+    TRACE_END("defragFile", ret);
+    return ret;
+}
+
+/* Body of defragFS, timed by the public wrapper below */
+static long defrag_fs(long maxBlocks)
+{
+    char bitmap[FS_BLOCK_SIZE];
+    long loaded = -1;
+    long moved = 0;
+    for (long n = 0; n < MAX_INODES; n++) {
+        long inode_index = (DEFRAG_CURSOR + n) % MAX_INODES;
+        if (inode_index / BITS_PER_BLOCK != loaded) {
+            loaded = inode_index / BITS_PER_BLOCK;
+            if (fs_bread(DEVICE_IMAGE, INODE_BITMAP_START + loaded, bitmap) != 0) {
+                return -2;
+            }
+        }
+        if (bitmap_getbit(bitmap, inode_index % BITS_PER_BLOCK)) {
+            // The first file is always moved so that every call makes progress
+            long budget = maxBlocks <= 0 || moved == 0 ? -1 : maxBlocks - moved;
+            long ret = defrag_inode(inode_index, budget);
+            if (ret == -2) {
+                break; // Resume from this file on the next call
+            }
+            if (ret < 0) {
+                return -2;
+            }
+            moved += ret;
+        }
+        DEFRAG_CURSOR = (inode_index + 1) % MAX_INODES;
+        if (maxBlocks > 0 && moved >= maxBlocks) {
+            break;
+        }
+    }
+    return moved;
+}
+
+/*
+ * @brief	Runs one step of the defragmentation of every file, moving at most
+ * 		maxBlocks blocks unless the first file needs more, or no limit if it is 0.
+ * 		Each call resumes where the previous one stopped.
+ * @return	Number of blocks moved, 0 once no file can be improved, -2 in case of error.
+ */
+long defragFS(long maxBlocks)
+{
+    TRACE_BEGIN("defragFS", maxBlocks);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    long ret = defrag_fs(maxBlocks);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_DEFRAG, start, ret > 0 ? ret * FS_BLOCK_SIZE : 0);
+    TRACE_END("defragFS", ret);
+    return ret;
+}
+
+/* Body of reclaimFS, timed by the public wrapper below */
+static int reclaim_fs(void)
+{
+    if (INODE_START == -1) {
+        return -1;
+    }
+    reclaim_all();
+    return 0;
+}
+
+/*
+ * @brief	Releases the space of every removed file now, instead of waiting for the
+ * 		background reclaimer.
+ * @return	0 if success, -1 if no file system is mounted.
+ */
+int reclaimFS(void)
+{
+    TRACE_BEGIN("reclaimFS", 0);
+    long start = stats_now();
+    int ret = reclaim_fs();
+    stats_record(STAT_RECLAIM, start, 0);
+    TRACE_END("reclaimFS", ret);
+    return ret;
+}
+
+/* Body of cleanFS, timed by the public wrapper below */
+static long clean_fs(void)
+{
+    if (INODE_MAP == NULL) {
+        return -1;
+    }
+    long moved = clean_log();
+    return moved < 0 ? -2 : moved;
+}
+
+/*
+ * @brief	Runs the segment cleaner of a log-structured file system now, instead of
+ * 		waiting for the log tail to wrap around: the blocks in use of every segment
+ * 		that is less than half full are moved to the log tail.
+ * @return	Number of blocks moved, -1 if no log-structured file system is mounted,
+ * 		-2 in case of error.
+ */
+long cleanFS(void)
+{
+    TRACE_BEGIN("cleanFS", 0);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    long ret = clean_fs();
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_CLEAN, start, ret > 0 ? ret * FS_BLOCK_SIZE : 0);
+    TRACE_END("cleanFS", ret);
+    return ret;
+}
+
+/*
+ * @brief	Fills usage with the capacity and free space of the mounted file system,
+ * 		without reading the device.
+ * @return	0 if success, -1 if no file system is mounted.
+ */
+int statFS(FSUsage *usage)
+{
+    TRACE_BEGIN("statFS", 0);
+    if (usage == NULL || INODE_START == -1) {
+        TRACE_END("statFS", -1);
+        return -1;
+    }
+    pthread_mutex_lock(&FS_LOCK);
+    usage->block_size = FS_BLOCK_SIZE;
+    usage->total_inodes = MAX_INODES;
+    usage->free_inodes = FREE_INODES;
+    usage->num_files = NUM_INODES_IN_USE;
+    usage->total_blocks = MAX_DATA_BLOCKS;
+    usage->free_blocks = FREE_DATA_BLOCKS;
+    usage->free_extents = FREE_EXTENTS;
+    memcpy(usage->free_extent_sizes, FREE_EXTENT_SIZES, sizeof(FREE_EXTENT_SIZES));
+    pthread_mutex_unlock(&FS_LOCK);
+    TRACE_END("statFS", 0);
+    return 0;
+}
+
+/*
+ * @brief	Fills stats with the counters of every public call and block layer primitive
+ * 		since the last fsStatsReset, merged over all the threads.
+ * @return	0 if success, -1 otherwise.
+ */
+int fsStats(FSStats *stats)
+{
+    TRACE_BEGIN("fsStats", 0);
+    if (stats == NULL) {
+        TRACE_END("fsStats", -1);
+        return -1;
+    }
+    stats_collect(stats);
+    TRACE_END("fsStats", 0);
+    return 0;
+}
+
+/*
+ * @brief	Restarts the counters reported by fsStats from zero.
+ * @return	0 if success, -1 otherwise.
+ */
+int fsStatsReset(void)
+{
+    TRACE_BEGIN("fsStatsReset", 0);
+    stats_reset();
+    TRACE_END("fsStatsReset", 0);
+    return 0;
+}
+
+/*
+ * @brief	Writes the trace events recorded by every thread to path, in the Chrome trace
+ * 		format. Tracing is only available when the library is built with FS_TRACE.
+ * @return	0 if success, -1 otherwise.
+ */
+int fsTraceDump(char *path)
+{
+#ifdef FS_TRACE
+    return trace_dump(path);
+#else
+    return -1;
+#endif
+}
+
+/*
+ * @brief	Chooses the device used by the following mkFS and mountFS calls, instead of
+ * 		the DEVICE_IMAGE file. NULL goes back to DEVICE_IMAGE. The backend is still
+ * 		owned by the caller and cannot be changed while a file system is mounted.
+ * @return	0 if success, -1 otherwise.
+ */
+int fsSetBackend(BlockBackend *backend)
+{
+    TRACE_BEGIN("fsSetBackend", 0);
+    int ret = -1;
+    pthread_mutex_lock(&FS_LOCK);
+    // The mounted file system keeps using the device it was mounted from
+    if (!MOUNTED) {
+        backend_set(backend);
+        ret = 0;
+    }
+    pthread_mutex_unlock(&FS_LOCK);
+    TRACE_END("fsSetBackend", ret);
+    return ret;
+}
+
+/* Calculates how many files can fit in  given disk_size,
+   and initializes the superblock with the corresponding values.
+   The number of inodes only depends on the size of the disk, and every
+   block that is left becomes a data block */
+void init_superblock(SuperBlock * sblock, long disk_size, int flags) {
+    long num_blocks_on_disk = disk_size / FS_BLOCK_SIZE; 
+    long crcs_per_block = FS_BLOCK_SIZE / sizeof(uint16_t); // Assuming using CRC16
+    long num_crc_blocks = (num_blocks_on_disk + crcs_per_block - 1) / crcs_per_block;
+    long max_number_of_files = num_blocks_on_disk / INODE_RATIO;
+    if (max_number_of_files < 1) {
+        max_number_of_files = 1;
+    }
+    long num_inode_bitmap_blocks = (max_number_of_files + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    long num_inode_blocks = (max_number_of_files + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    long num_imap_blocks = 0;
+    if (flags & FS_FLAG_LOG) {
+        num_imap_blocks = (num_inode_blocks + IMAP_ENTRIES_PER_BLOCK - 1) / IMAP_ENTRIES_PER_BLOCK;
+    }
+    long available = num_blocks_on_disk - 1 - num_inode_bitmap_blocks - num_crc_blocks - num_inode_blocks -
+                     num_imap_blocks;
+
+    /* Every data block needs a bit in the data bitmap and a reference count,
+       as clones share blocks, and with deduplication at most one hash index entry */
+    double overhead = 1.0 / BITS_PER_BLOCK + 1.0 / REFCOUNTS_PER_BLOCK;
+    if (flags & FS_FLAG_DEDUP) {
+        overhead += 1.0 / DEDUP_ENTRIES_PER_BLOCK;
+    }
+    long max_data_blocks = available / (1.0 + overhead) + 1;
+    long num_data_bitmap_blocks, num_refcount_blocks, num_dedup_blocks;
+    do {
+        max_data_blocks--;
+        num_data_bitmap_blocks = (max_data_blocks + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+        num_refcount_blocks = (max_data_blocks + REFCOUNTS_PER_BLOCK - 1) / REFCOUNTS_PER_BLOCK;
+        num_dedup_blocks = 0;
+        if (flags & FS_FLAG_DEDUP) {
+            num_dedup_blocks = (max_data_blocks + DEDUP_ENTRIES_PER_BLOCK - 1) / DEDUP_ENTRIES_PER_BLOCK;
+        }
+    } while (max_data_blocks > 0 &&
+             max_data_blocks + num_data_bitmap_blocks + num_refcount_blocks + num_dedup_blocks > available);
+
+    memset(sblock, 0, sizeof(SuperBlock));
+    sblock->num_crc_blocks = num_crc_blocks;
+    sblock->max_inodes= max_number_of_files;
+    sblock->max_data_blocks = max_data_blocks;
+    sblock->flags = flags;
+    sblock->num_refcount_blocks = num_refcount_blocks;
+    sblock->num_dedup_blocks = num_dedup_blocks;
+    sblock->num_imap_blocks = num_imap_blocks;
+    sblock->num_inode_bitmap_blocks = num_inode_bitmap_blocks;
+    sblock->num_data_bitmap_blocks = num_data_bitmap_blocks;
+    sblock->dir_root = -1;
+    sblock->free_inodes = max_number_of_files;
+    sblock->free_data_blocks = max_data_blocks;
+    sblock->free_extents = max_data_blocks > 0;
+    if (max_data_blocks > 0) {
+        sblock->free_extent_sizes[extent_class(max_data_blocks)] = 1;
+    }
+    sblock->block_size = FS_BLOCK_SIZE;
+
+    /* Every group of the regions after the bitmaps starts uninitialized */
+    long lazy_blocks = num_crc_blocks + num_inode_blocks + num_refcount_blocks + num_dedup_blocks + num_imap_blocks;
+    long group_blocks = (lazy_blocks + LAZY_MAX_GROUPS - 1) / LAZY_MAX_GROUPS;
+    if (group_blocks < LAZY_MIN_GROUP_BLOCKS) {
+        group_blocks = LAZY_MIN_GROUP_BLOCKS;
+    }
+    sblock->lazy_group_blocks = group_blocks;
+    sblock->num_lazy_groups = (lazy_blocks + group_blocks - 1) / group_blocks;
+    for (long group = 0; group < sblock->num_lazy_groups; group++) {
+        bitmap_setbit(sblock->uninit_groups, group, 1);
+    }
+}
+
+/* Computes the position of every region of the disk from the superblock:
+   superblock, inode bitmap, data bitmap, CRCs, inode table, reference counts,
+   hash index, inode map and data blocks */
+void set_layout(SuperBlock * sblock) {
+    INODE_BITMAP_START = 1;
+    DATA_BITMAP_START = INODE_BITMAP_START + sblock->num_inode_bitmap_blocks;
+    CRC_START = DATA_BITMAP_START + sblock->num_data_bitmap_blocks;
+    INODE_START = CRC_START + sblock->num_crc_blocks;
+    NUM_INODE_BLOCKS = (sblock->max_inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    REFCOUNT_START = sblock->num_refcount_blocks > 0 ? INODE_START + NUM_INODE_BLOCKS : -1;
+    DEDUP_START = INODE_START + NUM_INODE_BLOCKS + sblock->num_refcount_blocks;
+    NUM_DEDUP_BLOCKS = sblock->num_dedup_blocks;
+    IMAP_START = DEDUP_START + sblock->num_dedup_blocks;
+    NUM_IMAP_BLOCKS = sblock->num_imap_blocks;
+    DATA_BLOCK_START = IMAP_START + sblock->num_imap_blocks;
+    MAX_INODES = sblock->max_inodes;
+    MAX_DATA_BLOCKS = sblock->max_data_blocks;
+    FS_FLAGS = sblock->flags;
+    LOG_TAIL = sblock->log_tail;
+    DIR_ROOT = sblock->dir_root;
+    NUM_INODES_IN_USE = sblock->num_inodes_in_use;
+    FREE_INODES = sblock->free_inodes;
+    FREE_DATA_BLOCKS = sblock->free_data_blocks;
+    FREE_EXTENTS = sblock->free_extents;
+    memcpy(FREE_EXTENT_SIZES, sblock->free_extent_sizes, sizeof(FREE_EXTENT_SIZES));
+    FREE_HINT = sblock->free_hint;
+    NUM_LAZY_GROUPS = sblock->num_lazy_groups;
+    LAZY_GROUP_BLOCKS = sblock->lazy_group_blocks;
+    memcpy(UNINIT_GROUPS, sblock->uninit_groups, sizeof(UNINIT_GROUPS));
+    dir_cache_reset();
+    stats_set_data_start((long) DATA_BLOCK_START * FS_DEVICE_BLOCKS);
+}
+
+/* Zeroes the blocks of a group of the metadata regions unless it was done
+   before, and records it in the superblock. The CRC blocks of the group are
+   written first so that the rest can be checksummed right away.
+   Returns 0 on success, -1 otherwise */
+int lazy_init_group(long group) {
+    pthread_mutex_lock(&FS_LOCK);
+    if (!bitmap_getbit(UNINIT_GROUPS, group)) {
+        pthread_mutex_unlock(&FS_LOCK);
+        return 0;
+    }
+    long first = CRC_START + group * LAZY_GROUP_BLOCKS;
+    long last = first + LAZY_GROUP_BLOCKS < DATA_BLOCK_START ? first + LAZY_GROUP_BLOCKS : DATA_BLOCK_START;
+    char * zeros = calloc(LAZY_GROUP_BLOCKS, FS_BLOCK_SIZE);
+    int * blocks = malloc(LAZY_GROUP_BLOCKS * sizeof(int));
+    if (zeros == NULL || blocks == NULL) {
+        free(zeros);
+        free(blocks);
+        pthread_mutex_unlock(&FS_LOCK);
+        return -1;
+    }
+    int count = 0;
+    int ret = 0;
+    for (long block = first; block < last; block++) {
+        if (block < INODE_START) {
+            ret |= fs_bwrite(DEVICE_IMAGE, block, zeros);
+        } else {
+            blocks[count++] = block;
+        }
+    }
+    bitmap_setbit(UNINIT_GROUPS, group, 0);
+    if (count > 0) {
+        ret |= bwrite_blocks_with_crc(DEVICE_IMAGE, blocks, zeros, count);
+    }
+    free(zeros);
+    free(blocks);
+    ret |= save_superblock();
+    pthread_mutex_unlock(&FS_LOCK);
+    return ret == 0 ? 0 : -1;
+}
+
+/* Returns whether block belongs to a group that was not initialized yet */
+int lazy_pending(long block) {
+    if (block < CRC_START || block >= DATA_BLOCK_START) {
+        return 0;
+    }
+    pthread_mutex_lock(&FS_LOCK);
+    int pending = bitmap_getbit(UNINIT_GROUPS, (block - CRC_START) / LAZY_GROUP_BLOCKS) != 0;
+    pthread_mutex_unlock(&FS_LOCK);
+    return pending;
+}
+
+/* Initializes the group of block, if any, before it is read or written */
+int lazy_ensure(long block) {
+    if (block < CRC_START || block >= DATA_BLOCK_START) {
+        return 0;
+    }
+    return lazy_init_group((block - CRC_START) / LAZY_GROUP_BLOCKS);
+}
+
+/* Background thread that initializes the groups nobody has used yet */
+static void * lazy_init_worker(void * arg) {
+    for (long group = 0; group < NUM_LAZY_GROUPS && !LAZY_THREAD_STOP; group++) {
+        lazy_init_group(group);
+    }
+    return NULL;
+}
+
+/* Starts initializing the pending groups in the background */
+void lazy_start() {
+    LAZY_THREAD_STOP = 0;
+    if (pthread_create(&LAZY_THREAD, NULL, lazy_init_worker, NULL) == 0) {
+        LAZY_THREAD_RUNNING = 1;
+    }
+}
+
+/* Waits for the background initialization to stop, leaving the remaining
+   groups for their first use or the next mount */
+void lazy_stop() {
+    if (LAZY_THREAD_RUNNING) {
+        LAZY_THREAD_STOP = 1;
+        pthread_join(LAZY_THREAD, NULL);
+        LAZY_THREAD_RUNNING = 0;
+    }
+}
+
+/* Releases the data blocks and the inode of a removed file, discarding the
+   blocks from the device. Returns 0 on success, -1 if the inode does not
+   belong to a removed file, which happens when it was queued twice */
+int reclaim_inode(long inode_index) {
+    char bitmap[FS_BLOCK_SIZE];
+    int bitmap_block = INODE_BITMAP_START + inode_index / BITS_PER_BLOCK;
+    INode inode;
+    int ret = -1;
+    pthread_mutex_lock(&FS_LOCK);
+    if (fs_bread(DEVICE_IMAGE, bitmap_block, bitmap) == 0 && bitmap_getbit(bitmap, inode_index % BITS_PER_BLOCK) &&
+            read_inode(inode_index, &inode) == 0 && (inode.flags & INODE_ORPHAN)) {
+        if (!(inode.flags & INODE_INLINE)) {
+            release_file_blocks(&inode, 1);
+        }
+        bitmap_setbit(bitmap, inode_index % BITS_PER_BLOCK, 0);
+        ret = bwrite_with_crc(DEVICE_IMAGE, bitmap_block, bitmap);
+        FREE_INODES++;
+    }
+    pthread_mutex_unlock(&FS_LOCK);
+    return ret;
+}
+
+/* Queues a removed file for the reclaimer */
+void reclaim_enqueue(long inode_index) {
+    ReclaimEntry * entry = malloc(sizeof(ReclaimEntry));
+    if (entry == NULL) {
+        reclaim_inode(inode_index);
+        return;
+    }
+    entry->inode = inode_index;
+    entry->next = NULL;
+    pthread_mutex_lock(&RECLAIM_LOCK);
+    if (RECLAIM_TAIL != NULL) {
+        RECLAIM_TAIL->next = entry;
+    } else {
+        RECLAIM_HEAD = entry;
+    }
+    RECLAIM_TAIL = entry;
+    pthread_cond_signal(&RECLAIM_READY);
+    pthread_mutex_unlock(&RECLAIM_LOCK);
+}
+
+/* Takes the oldest entry of the queue. Returns its inode, -1 if it is empty */
+static long reclaim_pop() {
+    pthread_mutex_lock(&RECLAIM_LOCK);
+    ReclaimEntry * entry = RECLAIM_HEAD;
+    long inode_index = -1;
+    if (entry != NULL) {
+        RECLAIM_HEAD = entry->next;
+        if (RECLAIM_HEAD == NULL) {
+            RECLAIM_TAIL = NULL;
+        }
+        inode_index = entry->inode;
+        free(entry);
+    }
+    pthread_mutex_unlock(&RECLAIM_LOCK);
+    return inode_index;
+}
+
+/* Queues the files that were removed but not reclaimed before the last unmount */
+static void reclaim_scan() {
+    char bitmap[FS_BLOCK_SIZE];
+    INode inode;
+    for (long first = 0; first < MAX_INODES; first += BITS_PER_BLOCK) {
+        pthread_mutex_lock(&FS_LOCK);
+        if (fs_bread(DEVICE_IMAGE, INODE_BITMAP_START + first / BITS_PER_BLOCK, bitmap) == 0) {
+            for (long i = 0; i < BITS_PER_BLOCK && first + i < MAX_INODES; i++) {
+                if (bitmap_getbit(bitmap, i) && read_inode(first + i, &inode) == 0 &&
+                        (inode.flags & INODE_ORPHAN)) {
+                    reclaim_enqueue(first + i);
+                }
+            }
+        }
+        pthread_mutex_unlock(&FS_LOCK);
+    }
+    RECLAIM_SCANNED = 1;
+}
+
+/* Reclaims every queued file in the calling thread, scanning first for the
+   removed files the reclaimer has not queued yet.
+   Returns the number of files whose space was released */
+long reclaim_all() {
+    long reclaimed = 0;
+    long inode_index;
+    // Entries are only taken with FS_LOCK held, so none is left half done
+    pthread_mutex_lock(&FS_LOCK);
+    if (!RECLAIM_SCANNED) {
+        reclaim_scan();
+    }
+    while ((inode_index = reclaim_pop()) != -1) {
+        reclaimed += reclaim_inode(inode_index) == 0;
+    }
+    pthread_mutex_unlock(&FS_LOCK);
+    return reclaimed;
+}
+
+/* Background thread that releases the space of removed files, up to
+   RECLAIM_BATCH_FILES of them every time it takes FS_LOCK */
+static void * reclaim_worker(void * arg) {
+    reclaim_scan();
+    pthread_mutex_lock(&RECLAIM_LOCK);
+    while (1) {
+        while (RECLAIM_HEAD == NULL && !RECLAIM_THREAD_STOP) {
+            pthread_cond_wait(&RECLAIM_READY, &RECLAIM_LOCK);
+        }
+        // Queued files are still reclaimed after stop
+        if (RECLAIM_HEAD == NULL) {
+            break;
+        }
+        pthread_mutex_unlock(&RECLAIM_LOCK);
+
+        long inode_index;
+        pthread_mutex_lock(&FS_LOCK);
+        for (int n = 0; n < RECLAIM_BATCH_FILES && (inode_index = reclaim_pop()) != -1; n++) {
+            reclaim_inode(inode_index);
+        }
+        pthread_mutex_unlock(&FS_LOCK);
+
+        pthread_mutex_lock(&RECLAIM_LOCK);
+    }
+    pthread_mutex_unlock(&RECLAIM_LOCK);
+    return NULL;
+}
+
+/* Starts releasing the space of removed files in the background */
+void reclaim_start() {
+    RECLAIM_THREAD_STOP = 0;
+    RECLAIM_SCANNED = 0;
+    if (pthread_create(&RECLAIM_THREAD, NULL, reclaim_worker, NULL) == 0) {
+        RECLAIM_THREAD_RUNNING = 1;
+    }
+}
+
+/* Stops the reclaimer. With drain every queued file is reclaimed first,
+   otherwise the queue is dropped, as mkFS does */
+void reclaim_stop(int drain) {
+    if (!drain) {
+        while (reclaim_pop() != -1);
+    }
+    pthread_mutex_lock(&RECLAIM_LOCK);
+    RECLAIM_THREAD_STOP = 1;
+    pthread_cond_signal(&RECLAIM_READY);
+    pthread_mutex_unlock(&RECLAIM_LOCK);
+    if (RECLAIM_THREAD_RUNNING) {
+        pthread_join(RECLAIM_THREAD, NULL);
+        RECLAIM_THREAD_RUNNING = 0;
+    }
+    // Files removed without a reclaimer running
+    if (drain && INODE_START != -1) {
+        reclaim_all();
+    }
+    while (reclaim_pop() != -1);
+}
+
+/* Background thread of log-structured file systems that runs a pass of the
+   cleaner every time the log tail wraps around, so that the tail finds
+   empty segments ahead of it */
+static void * clean_worker(void * arg) {
+    pthread_mutex_lock(&CLEAN_LOCK);
+    while (1) {
+        while (!CLEAN_PENDING && !CLEAN_THREAD_STOP) {
+            pthread_cond_wait(&CLEAN_READY, &CLEAN_LOCK);
+        }
+        if (CLEAN_THREAD_STOP) {
+            break;
+        }
+        CLEAN_PENDING = 0;
+        pthread_mutex_unlock(&CLEAN_LOCK);
+
+        pthread_mutex_lock(&FS_LOCK);
+        clean_log();
+        pthread_mutex_unlock(&FS_LOCK);
+
+        pthread_mutex_lock(&CLEAN_LOCK);
+    }
+    pthread_mutex_unlock(&CLEAN_LOCK);
+    return NULL;
+}
+
+/* Starts the cleaner of a log-structured file system in the background */
+void clean_start() {
+    CLEAN_THREAD_STOP = 0;
+    CLEAN_PENDING = 0;
+    if (pthread_create(&CLEAN_THREAD, NULL, clean_worker, NULL) == 0) {
+        CLEAN_THREAD_RUNNING = 1;
+    }
+}
+
+/* Wakes the cleaner up for a pass, unless it is the cleaner that wrapped
+   the log tail around */
+void clean_wake() {
+    if (CLEANING) {
+        return;
+    }
+    pthread_mutex_lock(&CLEAN_LOCK);
+    CLEAN_PENDING = 1;
+    pthread_cond_signal(&CLEAN_READY);
+    pthread_mutex_unlock(&CLEAN_LOCK);
+}
+
+/* Stops the cleaner, waiting for the pass in progress to finish */
+void clean_stop() {
+    pthread_mutex_lock(&CLEAN_LOCK);
+    CLEAN_THREAD_STOP = 1;
+    pthread_cond_signal(&CLEAN_READY);
+    pthread_mutex_unlock(&CLEAN_LOCK);
+    if (CLEAN_THREAD_RUNNING) {
+        pthread_join(CLEAN_THREAD, NULL);
+        CLEAN_THREAD_RUNNING = 0;
+    }
+}
+
+/* Orders block or inode indexes for qsort */
+int compare_blocks(const void * a, const void * b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+/* Finds the First zero in a bitmap. Used by both allocate_ functions */
+int first_zero(char * bitmap, int length) {
+    int i;
+    for (i = 0; i < length; i++) {
+        if(bitmap_getbit(bitmap, i) == 0) {
+            break;
+        }
+    }
+    if (i == length) {
+        return -1;
+    }
+    return i;
+}
+
+/* Updates the inode allocation bitmap on the disk
+   Returns the index of the first free inode block */
+int allocate_inode() {
+    int inode_index;
+    if (allocate_inodes(1, &inode_index) != 1) {
+        return -1;
+    }
+    return inode_index;
+}
+
+/* Allocates up to count inodes, rewriting each bitmap block once, and stores
+   their indexes in ascending order in inodes. Returns the number allocated */
+int allocate_inodes(int count, int * inodes) {
+    char bitmap[FS_BLOCK_SIZE];
+    int found = 0;
+    for (long first = 0; first < MAX_INODES && found < count && FREE_INODES > 0; first += BITS_PER_BLOCK) {
+        int bitmap_block = INODE_BITMAP_START + first / BITS_PER_BLOCK;
+        int length = MAX_INODES - first < BITS_PER_BLOCK ? MAX_INODES - first : BITS_PER_BLOCK;
+        int changed = 0;
+        fs_bread(DEVICE_IMAGE, bitmap_block, bitmap);
+        for (int i = 0; i < length && found < count && FREE_INODES > 0; i++) {
+            if (bitmap_getbit(bitmap, i) == 0) {
+                bitmap_setbit(bitmap, i, 1);
+                inodes[found++] = first + i;
+                FREE_INODES--;
+                changed = 1;
+            }
+        }
+        if (changed) {
+            bwrite_with_crc(DEVICE_IMAGE, bitmap_block, bitmap);
+        }
+    }
+    // Take back the inodes of removed files before giving up
+    if (found < count && reclaim_all() > 0) {
+        int more = allocate_inodes(count - found, inodes + found);
+        qsort(inodes, found + more, sizeof(int), compare_blocks);
+        return found + more;
+    }
+    return found;
+}
+
+/* Releases count inodes given in ascending order, rewriting each bitmap block once */
+int free_inodes(int count, int * inodes) {
+    char bitmap[FS_BLOCK_SIZE];
+    long loaded = -1;
+    for (int i = 0; i < count; i++) {
+        long bitmap_block = INODE_BITMAP_START + inodes[i] / BITS_PER_BLOCK;
+        if (bitmap_block != loaded) {
+            if (loaded != -1) {
+                bwrite_with_crc(DEVICE_IMAGE, loaded, bitmap);
+            }
+            if (fs_bread(DEVICE_IMAGE, bitmap_block, bitmap) != 0) {
+                return -1;
+            }
+            loaded = bitmap_block;
+        }
+        bitmap_setbit(bitmap, inodes[i] % BITS_PER_BLOCK, 0);
+        FREE_INODES++;
+    }
+    if (loaded != -1) {
+        return bwrite_with_crc(DEVICE_IMAGE, loaded, bitmap);
+    }
+    return 0;
+}
+
+/* Updates the data block allocation bitmap on the disk
+   Returns the index of the first free data block */
+int allocate_data_block() {
+    int block_index;
+    if (allocate_data_blocks(1, &block_index) != 0) {
+        return -1;
+    }
+    return block_index;
+}
+
+/* Allocates count data blocks with a single bitmap update, storing their
+   indexes in blocks. Returns 0 on success, -1 if there is not enough space.
+   In log-structured mode the search starts at the log tail and wraps around,
+   so consecutive writes land on consecutive blocks of the device. Otherwise
+   it starts at the free hint, skipping the allocated blocks before it */
+int allocate_data_blocks(int count, int * blocks) {
+    char bitmap[FS_BLOCK_SIZE];
+    long loaded = -1;
+    long start = (FS_FLAGS & FS_FLAG_LOG) ? LOG_TAIL : FREE_HINT % MAX_DATA_BLOCKS;
+    int found = 0;
+    // The free count tells without a scan when the blocks are not there
+    if (count > FREE_DATA_BLOCKS) {
+        return reclaim_all() > 0 ? allocate_data_blocks(count, blocks) : -1;
+    }
+    for (long n = 0; n < MAX_DATA_BLOCKS && found < count; n++) {
+        long i = (start + n) % MAX_DATA_BLOCKS;
+        if (i / BITS_PER_BLOCK != loaded) {
+            loaded = i / BITS_PER_BLOCK;
+            fs_bread(DEVICE_IMAGE, DATA_BITMAP_START + loaded, bitmap);
+        }
+        if (bitmap_getbit(bitmap, i % BITS_PER_BLOCK) == 0) {
+            blocks[found++] = i;
+        }
+    }
+    if (found < count) {
+        // Take back the blocks of removed files before giving up
+        return reclaim_all() > 0 ? allocate_data_blocks(count, blocks) : -1;
+    }
+    if (FS_FLAGS & FS_FLAG_LOG) {
+        long tail = (blocks[count - 1] + 1) % MAX_DATA_BLOCKS;
+        if (tail < LOG_TAIL) {
+            clean_wake();
+        }
+        LOG_TAIL = tail;
+    } else {
+        // The blocks found were the first free ones after the hint
+        FREE_HINT = blocks[count - 1] + 1;
+    }
+    update_data_bitmap(count, blocks, 1);
+    if (REFCOUNT_START != -1) {
+        adjust_refcounts(count, blocks, 1, NULL);
+    }
+    return 0;
+}
+
+/* Releases count data blocks with a single bitmap update.
+   Shared blocks are only released by their last reference */
+int free_data_blocks(int count, int * blocks) {
+    return release_data_blocks(count, blocks, 0);
+}
+
+/* Like free_data_blocks, also discarding the blocks released from the
+   device when discard is set */
+int release_data_blocks(int count, int * blocks, int discard) {
+    if (count <= 0) {
+        return 0;
+    }
+    int unused[count];
+    int num_unused = 0;
+    if (REFCOUNT_START == -1) {
+        memcpy(unused, blocks, count * sizeof(int));
+        num_unused = count;
+    } else {
+        int refcounts[count];
+        adjust_refcounts(count, blocks, -1, refcounts);
+        for (int i = 0; i < count; i++) {
+            if (refcounts[i] == 0) {
+                unused[num_unused++] = blocks[i];
+            }
+        }
+    }
+    int ret = update_data_bitmap(num_unused, unused, 0);
+    if (discard) {
+        discard_data_blocks(num_unused, unused);
+    }
+    return ret;
+}
+
+/* Discards count unused data blocks from the device, one request for every
+   run of consecutive blocks. Devices that cannot discard are left as they are */
+void discard_data_blocks(int count, int * blocks) {
+    qsort(blocks, count, sizeof(int), compare_blocks);
+    for (int i = 0; i < count;) {
+        int length = 1;
+        while (i + length < count && blocks[i + length] == blocks[i] + length) {
+            length++;
+        }
+        if (fs_bdiscard(DEVICE_IMAGE, DATA_BLOCK_START + blocks[i], length) != 0) {
+            return;
+        }
+        i += length;
+    }
+}
+
+/* Returns the size class of a run of length free data blocks */
+int extent_class(long length) {
+    int class = 0;
+    while (class < FS_EXTENT_CLASSES - 1 && length >= 2L << class) {
+        class++;
+    }
+    return class;
+}
+
+/* Returns how many free data blocks follow block i in direction step (1 or
+   -1), looking them up in bitmap while they are covered by the bitmap block
+   loaded. Past the first block of the last size class the length no longer
+   changes the class, so the count stops there. Blocks past either end count as used */
+static long free_run(char * bitmap, long loaded, long i, int step) {
+    char other[FS_BLOCK_SIZE];
+    long other_loaded = -1;
+    long length = 0;
+    for (long j = i + step; j >= 0 && j < MAX_DATA_BLOCKS && length < 1L << (FS_EXTENT_CLASSES - 1); j += step) {
+        char * bits = bitmap;
+        if (j / BITS_PER_BLOCK != loaded) {
+            if (j / BITS_PER_BLOCK != other_loaded) {
+                if (fs_bread(DEVICE_IMAGE, DATA_BITMAP_START + j / BITS_PER_BLOCK, other) != 0) {
+                    break;
+                }
+                other_loaded = j / BITS_PER_BLOCK;
+            }
+            bits = other;
+        }
+        if (bitmap_getbit(bits, j % BITS_PER_BLOCK)) {
+            break;
+        }
+        length++;
+    }
+    return length;
+}
+
+/* Sets the allocation bit of count data blocks to value, rewriting each
+   bitmap block once for every run of blocks it covers. The free space
+   summary follows every change: a block taken from or given back to the
+   free space splits or joins the runs next to it, moving them between
+   size classes */
+int update_data_bitmap(int count, int * blocks, int value) {
+    char bitmap[FS_BLOCK_SIZE];
+    long loaded = -1;
+    for (int i = 0; i < count; i++) {
+        long bitmap_block = blocks[i] / BITS_PER_BLOCK;
+        if (bitmap_block != loaded) {
+            if (loaded != -1) {
+                bwrite_with_crc(DEVICE_IMAGE, DATA_BITMAP_START + loaded, bitmap);
+            }
+            if (fs_bread(DEVICE_IMAGE, DATA_BITMAP_START + bitmap_block, bitmap) != 0) {
+                return -1;
+            }
+            loaded = bitmap_block;
+        }
+        if ((bitmap_getbit(bitmap, blocks[i] % BITS_PER_BLOCK) != 0) == value) {
+            continue;
+        }
+        bitmap_setbit(bitmap, blocks[i] % BITS_PER_BLOCK, value);
+        long left = free_run(bitmap, loaded, blocks[i], -1);
+        long right = free_run(bitmap, loaded, blocks[i], 1);
+        int delta = value ? -1 : 1; // Change of the run holding the block
+        FREE_DATA_BLOCKS += delta;
+        FREE_EXTENTS += delta * (1 - (left > 0) - (right > 0));
+        FREE_EXTENT_SIZES[extent_class(left + 1 + right)] += delta;
+        if (left > 0) {
+            FREE_EXTENT_SIZES[extent_class(left)] -= delta;
+        }
+        if (right > 0) {
+            FREE_EXTENT_SIZES[extent_class(right)] -= delta;
+        }
+        if (!value && blocks[i] < FREE_HINT) {
+            FREE_HINT = blocks[i];
+        }
+    }
+    if (loaded != -1) {
+        return bwrite_with_crc(DEVICE_IMAGE, DATA_BITMAP_START + loaded, bitmap);
+    }
+    return 0;
+}
+
+/* Counts the free inodes, the free data blocks and the runs these form by
+   scanning both bitmaps, and the runs of every size class in extent_sizes.
+   Returns 0 on success, -1 otherwise */
+int count_free_space(long * free_inodes, long * free_blocks, long * free_extents, long * extent_sizes) {
+    char bitmap[FS_BLOCK_SIZE];
+    *free_inodes = *free_blocks = *free_extents = 0;
+    memset(extent_sizes, 0, FS_EXTENT_CLASSES * sizeof(long));
+    for (long i = 0; i < MAX_INODES; i++) {
+        if (i % BITS_PER_BLOCK == 0 && fs_bread(DEVICE_IMAGE, INODE_BITMAP_START + i / BITS_PER_BLOCK, bitmap) != 0) {
+            return -1;
+        }
+        *free_inodes += !bitmap_getbit(bitmap, i % BITS_PER_BLOCK);
+    }
+    long run = 0;
+    for (long i = 0; i < MAX_DATA_BLOCKS; i++) {
+        if (i % BITS_PER_BLOCK == 0 && fs_bread(DEVICE_IMAGE, DATA_BITMAP_START + i / BITS_PER_BLOCK, bitmap) != 0) {
+            return -1;
+        }
+        int is_free = !bitmap_getbit(bitmap, i % BITS_PER_BLOCK);
+        *free_blocks += is_free;
+        *free_extents += is_free && run == 0;
+        if (!is_free && run > 0) {
+            extent_sizes[extent_class(run)]++;
+        }
+        run = is_free ? run + 1 : 0;
+    }
+    if (run > 0) {
+        extent_sizes[extent_class(run)]++;
+    }
+    return 0;
+}
+
+/* Counts the files by scanning the inode bitmap, leaving out the inodes of
+   removed files. Returns 0 on success, -1 otherwise */
+int count_files(long * num_files) {
+    char bitmap[FS_BLOCK_SIZE];
+    INode inode;
+    *num_files = 0;
+    for (long i = 0; i < MAX_INODES; i++) {
+        if (i % BITS_PER_BLOCK == 0 && fs_bread(DEVICE_IMAGE, INODE_BITMAP_START + i / BITS_PER_BLOCK, bitmap) != 0) {
+            return -1;
+        }
+        if (bitmap_getbit(bitmap, i % BITS_PER_BLOCK)) {
+            if (read_inode(i, &inode) != 0) {
+                return -1;
+            }
+            *num_files += !(inode.flags & INODE_ORPHAN);
+        }
+    }
+    return 0;
+}
+
+/* Prepares a cursor over the block map of inode */
+void map_init(BlockMap * map, INode * inode) {
+    map->inode = inode;
+    for (int depth = 0; depth < INODE_INDIRECT_LEVELS; depth++) {
+        map->loaded[depth] = -1;
+        map->dirty[depth] = 0;
+    }
+}
+
+/* Makes block the cached indirect block at the given depth, writing back the
+   one it replaces if needed. Returns its entries, NULL in case of error */
+static int32_t * map_load(BlockMap * map, int depth, long block) {
+    if (map->loaded[depth] != block) {
+        if (map->dirty[depth]) {
+            bwrite_with_crc(DEVICE_IMAGE, DATA_BLOCK_START + map->loaded[depth], (char *) map->entries[depth]);
+            map->dirty[depth] = 0;
+        }
+        map->loaded[depth] = -1;
+        if (fs_bread(DEVICE_IMAGE, DATA_BLOCK_START + block, (char *) map->entries[depth]) != 0) {
+            return NULL;
+        }
+        map->loaded[depth] = block;
+    }
+    return map->entries[depth];
+}
+
+/* Finds which indirect tree holds a logical block past the direct entries.
+   Returns the tree (0 for single indirect) and leaves in position the index
+   of the block inside the tree, -1 if the block cannot be mapped */
+static int map_tree(long logical, long * position) {
+    long span = MAP_ENTRIES_PER_BLOCK;
+    logical -= INODE_DIRECT_BLOCKS;
+    for (int tree = 0; tree < INODE_INDIRECT_LEVELS; tree++) {
+        if (logical < span) {
+            *position = logical;
+            return tree;
+        }
+        logical -= span;
+        span *= MAP_ENTRIES_PER_BLOCK;
+    }
+    return -1;
+}
+
+/* Returns the block map entry of a logical block, FS_HOLE if it is unmapped */
+long map_get(BlockMap * map, long logical) {
+    INode * inode = map->inode;
+    if (logical >= inode->num_blocks) {
+        return FS_HOLE;
+    }
+    if (logical < INODE_DIRECT_BLOCKS) {
+        return inode->blocks[logical];
+    }
+    long position;
+    int tree = map_tree(logical, &position);
+    if (tree == -1) {
+        return FS_HOLE;
+    }
+    long node = inode->indirect[tree];
+    long span = 1;
+    for (int depth = 0; depth < tree; depth++) {
+        span *= MAP_ENTRIES_PER_BLOCK;
+    }
+    // Walk down from the root of the tree: depth 'tree' holds the entries themselves
+    for (int depth = 0; node != FS_HOLE; depth++) {
+        int32_t * entries = map_load(map, depth, node);
+        if (entries == NULL) {
+            return FS_HOLE;
+        }
+        node = entries[position / span];
+        if (depth == tree) {
+            return node;
+        }
+        position %= span;
+        span /= MAP_ENTRIES_PER_BLOCK;
+    }
+    return FS_HOLE;
+}
+
+/* Allocates an indirect block with every entry set to FS_HOLE and caches it
+   at the given depth. Returns its index, -1 if there is no space left */
+static long map_new_node(BlockMap * map, int depth) {
+    int block;
+    if (allocate_data_blocks(1, &block) != 0) {
+        return -1;
+    }
+    if (map->dirty[depth]) {
+        bwrite_with_crc(DEVICE_IMAGE, DATA_BLOCK_START + map->loaded[depth], (char *) map->entries[depth]);
+    }
+    memset(map->entries[depth], 0xFF, FS_BLOCK_SIZE); // Every entry becomes FS_HOLE
+    map->loaded[depth] = block;
+    map->dirty[depth] = 1;
+    return block;
+}
+
+/* Sets the block map entry of a logical block, allocating the indirect blocks
+   needed to reach it. Returns 0 on success, -1 if there is no space left */
+int map_set(BlockMap * map, long logical, long value) {
+    INode * inode = map->inode;
+    if (logical >= inode->num_blocks) {
+        map_extend(map, logical + 1);
+    }
+    if (logical < INODE_DIRECT_BLOCKS) {
+        inode->blocks[logical] = value;
+        return 0;
+    }
+    long position;
+    int tree = map_tree(logical, &position);
+    if (tree == -1) {
+        return -1;
+    }
+    if (inode->indirect[tree] == FS_HOLE) {
+        long root = map_new_node(map, 0);
+        if (root == -1) {
+            return -1;
+        }
+        inode->indirect[tree] = root;
+    }
+    long node = inode->indirect[tree];
+    long span = 1;
+    for (int depth = 0; depth < tree; depth++) {
+        span *= MAP_ENTRIES_PER_BLOCK;
+    }
+    for (int depth = 0; ; depth++) {
+        int32_t * entries = map_load(map, depth, node);
+        if (entries == NULL) {
+            return -1;
+        }
+        long index = position / span;
+        if (depth == tree) {
+            entries[index] = value;
+            map->dirty[depth] = 1;
+            return 0;
+        }
+        if (entries[index] == FS_HOLE) {
+            long child = map_new_node(map, depth + 1);
+            if (child == -1) {
+                return -1;
+            }
+            entries[index] = child;
+            map->dirty[depth] = 1;
+        }
+        node = entries[index];
+        position %= span;
+        span /= MAP_ENTRIES_PER_BLOCK;
+    }
+}
+
+/* Grows the block map to num_blocks entries, the new ones being holes.
+   Entries past the direct ones are holes until an indirect block maps them */
+void map_extend(BlockMap * map, long num_blocks) {
+    INode * inode = map->inode;
+    for (long i = inode->num_blocks; i < num_blocks && i < INODE_DIRECT_BLOCKS; i++) {
+        inode->blocks[i] = FS_HOLE;
+    }
+    if (num_blocks > inode->num_blocks) {
+        inode->num_blocks = num_blocks;
+    }
+}
+
+/* Writes back the indirect blocks modified through the map */
+int map_flush(BlockMap * map) {
+    int ret = 0;
+    for (int depth = 0; depth < INODE_INDIRECT_LEVELS; depth++) {
+        if (map->dirty[depth]) {
+            if (bwrite_with_crc(DEVICE_IMAGE, DATA_BLOCK_START + map->loaded[depth], (char *) map->entries[depth]) != 0) {
+                ret = -1;
+            }
+            map->dirty[depth] = 0;
+        }
+    }
+    return ret;
+}
+
+/* Visits the blocks below an indirect block: level 0 blocks hold block map
+   entries, higher levels hold indirect blocks of the level below */
+static int map_visit_node(long node, int level, int (*visit)(int block, void * arg), void * arg) {
+    int32_t entries[MAP_ENTRIES_PER_BLOCK];
+    if (fs_bread(DEVICE_IMAGE, DATA_BLOCK_START + node, (char *) entries) != 0) {
+        return -2;
+    }
+    for (int i = 0; i < MAP_ENTRIES_PER_BLOCK; i++) {
+        if (entries[i] < 0) {
+            continue; // Holes and compressed cluster lengths
+        }
+        int ret = level == 0 ? visit(entries[i], arg) : map_visit_node(entries[i], level - 1, visit, arg);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return visit(node, arg);
+}
+
+/* Calls visit for every data block and indirect block referenced by the block
+   map of inode, stopping at the first non-zero return value */
+int map_for_each_block(INode * inode, int (*visit)(int block, void * arg), void * arg) {
+    for (long i = 0; i < inode->num_blocks && i < INODE_DIRECT_BLOCKS; i++) {
+        if (inode->blocks[i] < 0) {
+            continue; // Holes and compressed cluster lengths
+        }
+        int ret = visit(inode->blocks[i], arg);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    if (inode->num_blocks <= INODE_DIRECT_BLOCKS) {
+        return 0;
+    }
+    for (int tree = 0; tree < INODE_INDIRECT_LEVELS; tree++) {
+        if (inode->indirect[tree] == FS_HOLE) {
+            continue;
+        }
+        int ret = map_visit_node(inode->indirect[tree], tree, visit, arg);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Blocks waiting to be released together by release_file_blocks */
+typedef struct BlockBatch {
+    int count;
+    int discard;
+    int blocks[MAP_ENTRIES_PER_BLOCK];
+} BlockBatch;
+
+static int batch_release(int block, void * arg) {
+    BlockBatch * batch = arg;
+    batch->blocks[batch->count++] = block;
+    if (batch->count == MAP_ENTRIES_PER_BLOCK) {
+        release_data_blocks(batch->count, batch->blocks, batch->discard);
+        batch->count = 0;
+    }
+    return 0;
+}
+
+/* Releases every data block and indirect block of a file, discarding the
+   ones left unused from the device when discard is set */
+int release_file_blocks(INode * inode, int discard) {
+    BlockBatch batch;
+    batch.count = 0;
+    batch.discard = discard;
+    int ret = map_for_each_block(inode, batch_release, &batch);
+    release_data_blocks(batch.count, batch.blocks, discard);
+    return ret;
+}
+
+/* Fails with -1 when a block cannot take one more reference */
+static int batch_check_shareable(int block, void * arg) {
+    BlockBatch * batch = arg;
+    batch->blocks[batch->count++] = block;
+    if (batch->count == MAP_ENTRIES_PER_BLOCK) {
+        int refcounts[MAP_ENTRIES_PER_BLOCK];
+        batch->count = 0;
+        if (read_refcounts(MAP_ENTRIES_PER_BLOCK, batch->blocks, refcounts) != 0) {
+            return -2;
+        }
+        for (int i = 0; i < MAP_ENTRIES_PER_BLOCK; i++) {
+            if (refcounts[i] >= MAX_REFCOUNT) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Blocks collected while a clone copies the block map */
+typedef struct ShareList {
+    int * blocks;
+    long count;
+    long capacity;
+} ShareList;
+
+/* Appends block to list. Returns 0 on success, -1 if the list cannot grow */
+static int share_list_add(ShareList * list, int block) {
+    if (list->count == list->capacity) {
+        long capacity = list->capacity > 0 ? 2 * list->capacity : MAP_ENTRIES_PER_BLOCK;
+        int * blocks = realloc(list->blocks, capacity * sizeof(int));
+        if (blocks == NULL) {
+            return -1;
+        }
+        list->blocks = blocks;
+        list->capacity = capacity;
+    }
+    list->blocks[list->count++] = block;
+    return 0;
+}
+
+/* Copies an indirect block and the ones below it, level 0 blocks holding
+   block map entries, adding the data blocks they map to shared and the
+   copies made to copies. Returns the copy, -1 in case of error */
+static long copy_map_node(long node, int level, ShareList * shared, ShareList * copies) {
+    int32_t entries[MAP_ENTRIES_PER_BLOCK];
+    if (fs_bread(DEVICE_IMAGE, DATA_BLOCK_START + node, (char *) entries) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < MAP_ENTRIES_PER_BLOCK; i++) {
+        if (entries[i] < 0) {
+            continue; // Holes and compressed cluster lengths
+        }
+        if (level == 0) {
+            if (share_list_add(shared, entries[i]) != 0) {
+                return -1;
+            }
+        } else if ((entries[i] = copy_map_node(entries[i], level - 1, shared, copies)) == -1) {
+            return -1;
+        }
+    }
+    int copy;
+    if (allocate_data_blocks(1, &copy) != 0) {
+        return -1;
+    }
+    if (share_list_add(copies, copy) != 0) {
+        free_data_blocks(1, &copy);
+        return -1;
+    }
+    if (bwrite_with_crc(DEVICE_IMAGE, DATA_BLOCK_START + copy, (char *) entries) != 0) {
+        return -1;
+    }
+    return copy;
+}
+
+/* Makes the block map of inode a copy that shares every data block with the
+   original, adding one reference to each. Indirect blocks are copied, so that
+   every file owns the entries it rewrites on copy-on-write.
+   Returns 0 on success, -1 otherwise */
+int share_file_blocks(INode * inode) {
+    BlockBatch batch;
+    int refcounts[MAP_ENTRIES_PER_BLOCK];
+
+    // Check first so that a failed clone leaves every count untouched
+    batch.count = 0;
+    if (map_for_each_block(inode, batch_check_shareable, &batch) != 0 ||
+            read_refcounts(batch.count, batch.blocks, refcounts) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < batch.count; i++) {
+        if (refcounts[i] >= MAX_REFCOUNT) {
+            return -1;
+        }
+    }
+
+    /* The references are only added once the whole map is copied. Until then
+       a failure just releases the indirect blocks copied so far */
+    ShareList shared = {NULL, 0, 0};
+    ShareList copies = {NULL, 0, 0};
+    long roots[INODE_INDIRECT_LEVELS];
+    int ret = 0;
+    for (long i = 0; i < inode->num_blocks && i < INODE_DIRECT_BLOCKS && ret == 0; i++) {
+        if (inode->blocks[i] >= 0) {
+            ret = share_list_add(&shared, inode->blocks[i]);
+        }
+    }
+    for (int tree = 0; tree < INODE_INDIRECT_LEVELS && ret == 0; tree++) {
+        roots[tree] = inode->indirect[tree];
+        if (inode->num_blocks > INODE_DIRECT_BLOCKS && roots[tree] != FS_HOLE &&
+                (roots[tree] = copy_map_node(roots[tree], tree, &shared, &copies)) == -1) {
+            ret = -1;
+        }
+    }
+    if (ret == 0 && adjust_refcounts(shared.count, shared.blocks, 1, NULL) != 0) {
+        ret = -1;
+    }
+    if (ret == 0) {
+        for (int tree = 0; tree < INODE_INDIRECT_LEVELS; tree++) {
+            inode->indirect[tree] = roots[tree];
+        }
+    } else {
+        free_data_blocks(copies.count, copies.blocks);
+    }
+    free(shared.blocks);
+    free(copies.blocks);
+    return ret;
+}
+
+/* Reads the reference counts of count data blocks into refcounts */
+int read_refcounts(int count, int * blocks, int * refcounts) {
+    refcount_t table[REFCOUNTS_PER_BLOCK];
+    long loaded = -1;
+    for (int i = 0; i < count; i++) {
+        long table_block = blocks[i] / REFCOUNTS_PER_BLOCK;
+        if (table_block != loaded) {
+            lazy_ensure(REFCOUNT_START + table_block);
+            if (fs_bread(DEVICE_IMAGE, REFCOUNT_START + table_block, (char *) table) != 0) {
+                return -1;
+            }
+            loaded = table_block;
+        }
+        refcounts[i] = table[blocks[i] % REFCOUNTS_PER_BLOCK];
+    }
+    return 0;
+}
+
+/* Adds delta to the reference counts of count data blocks, storing the
+   resulting counts in refcounts unless it is NULL. Each table block is
+   rewritten once for every run of blocks it covers */
+int adjust_refcounts(int count, int * blocks, int delta, int * refcounts) {
+    refcount_t table[REFCOUNTS_PER_BLOCK];
+    long loaded = -1;
+    for (int i = 0; i < count; i++) {
+        long table_block = blocks[i] / REFCOUNTS_PER_BLOCK;
+        if (table_block != loaded) {
+            if (loaded != -1) {
+                bwrite_with_crc(DEVICE_IMAGE, REFCOUNT_START + loaded, (char *) table);
+            }
+            lazy_ensure(REFCOUNT_START + table_block);
+            if (fs_bread(DEVICE_IMAGE, REFCOUNT_START + table_block, (char *) table) != 0) {
+                return -1;
+            }
+            loaded = table_block;
+        }
+        refcount_t * refcount = &table[blocks[i] % REFCOUNTS_PER_BLOCK];
+        if (delta < 0 && *refcount < -delta) {
+            *refcount = 0;
+        } else {
+            *refcount += delta;
+        }
+        if (refcounts != NULL) {
+            refcounts[i] = *refcount;
+        }
+    }
+    if (loaded != -1) {
+        return bwrite_with_crc(DEVICE_IMAGE, REFCOUNT_START + loaded, (char *) table);
+    }
+    return 0;
+}
+
+/* Returns a data block whose content equals buffer, -1 if there is none.
+   Candidates with the same CRC16 and CRC32 are confirmed byte by byte */
+int dedup_lookup(char * buffer) {
+    uint16_t crc = CRC16((unsigned char *) buffer, FS_BLOCK_SIZE, 0);
+    uint32_t hash = CRC32((unsigned char *) buffer, FS_BLOCK_SIZE, 0);
+    DedupBlock index;
+    DedupEntry * entries = index.entries;
+    long index_block = DEDUP_START + (hash ^ crc) % NUM_DEDUP_BLOCKS;
+    lazy_ensure(index_block);
+    if (fs_bread(DEVICE_IMAGE, index_block, index.raw) != 0) {
+        return -1;
+    }
+    char candidate[FS_BLOCK_SIZE];
+    for (int i = 0; i < DEDUP_ENTRIES_PER_BLOCK; i++) {
+        DedupEntry * entry = &entries[(hash + i) % DEDUP_ENTRIES_PER_BLOCK];
+        if (!entry->used) {
+            break;
+        }
+        if (entry->crc != crc || entry->hash != hash) {
+            continue;
+        }
+        int block = entry->block;
+        int refcount;
+        if (read_refcounts(1, &block, &refcount) != 0 || refcount == 0 || refcount >= MAX_REFCOUNT) {
+            continue;
+        }
+        if (fs_bread(DEVICE_IMAGE, DATA_BLOCK_START + block, candidate) == 0 &&
+                memcmp(candidate, buffer, FS_BLOCK_SIZE) == 0) {
+            return block;
+        }
+    }
+    return -1;
+}
+
+/* Records in the content hash index that block holds the data in buffer.
+   When the bucket is full the entry at the preferred slot is replaced */
+int dedup_insert(char * buffer, int block) {
+    uint16_t crc = CRC16((unsigned char *) buffer, FS_BLOCK_SIZE, 0);
+    uint32_t hash = CRC32((unsigned char *) buffer, FS_BLOCK_SIZE, 0);
+    long index_block = DEDUP_START + (hash ^ crc) % NUM_DEDUP_BLOCKS;
+    DedupBlock index;
+    DedupEntry * entries = index.entries;
+    lazy_ensure(index_block);
+    if (fs_bread(DEVICE_IMAGE, index_block, index.raw) != 0) {
+        return -1;
+    }
+    DedupEntry * slot = &entries[hash % DEDUP_ENTRIES_PER_BLOCK];
+    for (int i = 0; i < DEDUP_ENTRIES_PER_BLOCK; i++) {
+        DedupEntry * entry = &entries[(hash + i) % DEDUP_ENTRIES_PER_BLOCK];
+        if (!entry->used || (entry->crc == crc && entry->hash == hash)) {
+            slot = entry;
+            break;
+        }
+    }
+    slot->hash = hash;
+    slot->crc = crc;
+    slot->used = 1;
+    slot->block = block;
+    return bwrite_with_crc(DEVICE_IMAGE, index_block, index.raw);
+}
+
+/* Moves the data of an inline file into a regular data block.
+   The caller is responsible for writing the updated inode back.
+   Returns 0 on success, -1 if there is no space left */
+int promote_inline(INode * inode) {
+    char buffer[FS_BLOCK_SIZE] = {0};
+    memcpy(buffer, inode->inline_data, inode->size);
+    memset(inode->inline_data, 0xFF, INODE_INLINE_SIZE); // Every map entry becomes FS_HOLE
+    inode->num_blocks = 0;
+    if (inode->size > 0) {
+        int block_index;
+        if (allocate_data_blocks(1, &block_index) != 0) {
+            return -1;
+        }
+        bwrite_with_crc(DEVICE_IMAGE, DATA_BLOCK_START + block_index, buffer);
+        inode->blocks[0] = block_index;
+        inode->num_blocks = 1;
+    }
+    inode->flags &= ~INODE_INLINE;
+    return 0;
+}
+
+/* Counts the data blocks of inode and the runs of consecutive blocks they form */
+void measure_layout(INode * inode, FileFragmentation * frag) {
+    frag->num_blocks = 0;
+    frag->num_extents = 0;
+    frag->fragmentation = 0;
+    if (inode->flags & INODE_INLINE) {
+        return;
+    }
+    BlockMap map;
+    map_init(&map, inode);
+    long previous = -2;
+    for (long i = 0; i < inode->num_blocks; i++) {
+        long block = map_get(&map, i);
+        if (block < 0) {
+            continue; // Holes and compressed cluster lengths
+        }
+        frag->num_blocks++;
+        if (block != previous + 1) {
+            frag->num_extents++;
+        }
+        previous = block;
+    }
+    if (frag->num_blocks > 1) {
+        frag->fragmentation = (double) (frag->num_extents - 1) / (frag->num_blocks - 1);
+    }
+}
+
+/* Returns the first of count consecutive free data blocks, -1 if there are none */
+static long find_free_run(long count) {
+    char bitmap[FS_BLOCK_SIZE];
+    long loaded = -1;
+    long run = 0;
+    for (long i = 0; i < MAX_DATA_BLOCKS; i++) {
+        if (i / BITS_PER_BLOCK != loaded) {
+            loaded = i / BITS_PER_BLOCK;
+            if (fs_bread(DEVICE_IMAGE, DATA_BITMAP_START + loaded, bitmap) != 0) {
+                return -1;
+            }
+        }
+        run = bitmap_getbit(bitmap, i % BITS_PER_BLOCK) ? 0 : run + 1;
+        if (run == count) {
+            return i - count + 1;
+        }
+    }
+    return -1;
+}
+
+/* Copies count data blocks to targets a chunk at a time. The stored CRCs
+   move with the data, so a damaged block stays detectable.
+   Returns the number of blocks copied */
+static long relocate_data_blocks(long count, int * sources, int * targets) {
+    char * images = malloc((long) WRITE_CHUNK_BLOCKS * FS_BLOCK_SIZE);
+    if (images == NULL) {
+        return 0;
+    }
+    long moved = 0;
+    while (moved < count) {
+        int chunk = count - moved < WRITE_CHUNK_BLOCKS ? count - moved : WRITE_CHUNK_BLOCKS;
+        int from[chunk], to[chunk];
+        uint16_t crcs[chunk];
+        for (int k = 0; k < chunk; k++) {
+            from[k] = DATA_BLOCK_START + sources[moved + k];
+            to[k] = DATA_BLOCK_START + targets[moved + k];
+        }
+        if (fs_bread_blocks(DEVICE_IMAGE, from, images, chunk) != 0 || read_crcs(from, crcs, chunk) != 0 ||
+                bwrite_blocks_with_crcs(DEVICE_IMAGE, to, images, crcs, chunk) != 0) {
+            break;
+        }
+        moved += chunk;
+    }
+    free(images);
+    return moved;
+}
+
+/* Moves the data blocks of a file, in logical order, into the first run of
+   free blocks that holds them all. Blocks shared with other files are left in
+   place, and so is the file when no run is large enough. Files needing more
+   than budget blocks are not moved, unless budget is negative.
+   Returns the number of blocks moved, -2 if over budget, -1 in case of error */
+long defrag_inode(long inode_index, long budget) {
+    INode inode;
+    FileFragmentation frag;
+    if (read_inode(inode_index, &inode) != 0) {
+        return -1;
+    }
+    measure_layout(&inode, &frag);
+    if (frag.num_extents <= 1) {
+        return 0;
+    }
+
+    BlockMap map;
+    map_init(&map, &inode);
+    long * logical = malloc(frag.num_blocks * sizeof(long));
+    int * blocks = malloc(frag.num_blocks * sizeof(int));
+    int * refcounts = malloc(frag.num_blocks * sizeof(int));
+    if (logical == NULL || blocks == NULL || refcounts == NULL) {
+        free(logical);
+        free(blocks);
+        free(refcounts);
+        return -1;
+    }
+    long count = 0;
+    for (long i = 0; i < inode.num_blocks; i++) {
+        long block = map_get(&map, i);
+        if (block >= 0) {
+            logical[count] = i;
+            blocks[count++] = block;
+        }
+    }
+    if (REFCOUNT_START != -1 && read_refcounts(count, blocks, refcounts) == 0) {
+        long movable = 0;
+        for (long i = 0; i < count; i++) {
+            if (refcounts[i] <= 1) {
+                logical[movable] = logical[i];
+                blocks[movable++] = blocks[i];
+            }
+        }
+        count = movable;
+    }
+    free(refcounts);
+    int contiguous = 1;
+    for (long i = 1; i < count && contiguous; i++) {
+        contiguous = blocks[i] == blocks[i - 1] + 1;
+    }
+    if (budget >= 0 && count > budget) {
+        free(logical);
+        free(blocks);
+        return -2;
+    }
+    long first = count > 0 && !contiguous ? find_free_run(count) : -1;
+    if (first == -1) {
+        free(logical);
+        free(blocks);
+        return 0;
+    }
+
+    // Claim the whole run, then copy the blocks
+    int * targets = malloc(count * sizeof(int));
+    if (targets == NULL) {
+        free(logical);
+        free(blocks);
+        return -1;
+    }
+    for (long i = 0; i < count; i++) {
+        targets[i] = first + i;
+    }
+    update_data_bitmap(count, targets, 1);
+    if (REFCOUNT_START != -1) {
+        adjust_refcounts(count, targets, 1, NULL);
+    }
+    long moved = relocate_data_blocks(count, blocks, targets);
+    for (long i = 0; i < moved; i++) {
+        map_set(&map, logical[i], targets[i]);
+    }
+
+    // The map points at the copies of the moved blocks only
+    int ret = map_flush(&map) | write_inode(inode_index, &inode);
+    free_data_blocks(moved, blocks);
+    free_data_blocks(count - moved, targets + moved);
+    free(logical);
+    free(blocks);
+    free(targets);
+    return ret != 0 || moved < count ? -1 : moved;
+}
+
+/* Moves to the log tail the data blocks a file keeps in the segments marked
+   in victims, a chunk at a time. Blocks shared with other files stay.
+   Returns the number of blocks moved, -1 in case of error */
+static long clean_inode(long inode_index, char * victims) {
+    INode inode;
+    if (read_inode(inode_index, &inode) != 0) {
+        return -1;
+    }
+    if (inode.flags & (INODE_INLINE | INODE_ORPHAN)) {
+        return 0;
+    }
+    BlockMap map;
+    map_init(&map, &inode);
+    long logical[WRITE_CHUNK_BLOCKS];
+    int sources[WRITE_CHUNK_BLOCKS], targets[WRITE_CHUNK_BLOCKS], refcounts[WRITE_CHUNK_BLOCKS];
+    int count = 0;
+    long moved = 0;
+    int ret = 0;
+    for (long i = 0; i <= inode.num_blocks && ret == 0; i++) {
+        long block = i < inode.num_blocks ? map_get(&map, i) : FS_HOLE;
+        if (block >= 0 && victims[block / LOG_SEGMENT_BLOCKS]) {
+            logical[count] = i;
+            sources[count++] = block;
+        }
+        if (count < WRITE_CHUNK_BLOCKS && (i < inode.num_blocks || count == 0)) {
+            continue;
+        }
+        if (REFCOUNT_START != -1 && read_refcounts(count, sources, refcounts) == 0) {
+            int movable = 0;
+            for (int k = 0; k < count; k++) {
+                if (refcounts[k] <= 1) {
+                    logical[movable] = logical[k];
+                    sources[movable++] = sources[k];
+                }
+            }
+            count = movable;
+        }
+        if (count > 0 && allocate_data_blocks(count, targets) != 0) {
+            ret = -1;
+            break;
+        }
+        long copied = relocate_data_blocks(count, sources, targets);
+        for (long k = 0; k < copied; k++) {
+            map_set(&map, logical[k], targets[k]);
+        }
+        free_data_blocks(copied, sources);
+        free_data_blocks(count - copied, targets + copied);
+        moved += copied;
+        ret = copied < count ? -1 : 0;
+        count = 0;
+    }
+    if (moved > 0 && (map_flush(&map) | write_inode(inode_index, &inode)) != 0) {
+        ret = -1;
+    }
+    return ret != 0 ? -1 : moved;
+}
+
+/* Runs a pass of the cleaner of a log-structured file system: the segments
+   with fewer than LOG_CLEAN_THRESHOLD blocks in use, other than the one of
+   the log tail, are emptied by moving the data blocks of the files and the
+   inode table blocks they hold to the tail. Indirect blocks and directory
+   nodes stay where they are. Returns the number of blocks moved, -1 in case of error */
+long clean_log() {
+    long num_segments = (MAX_DATA_BLOCKS + LOG_SEGMENT_BLOCKS - 1) / LOG_SEGMENT_BLOCKS;
+    char * victims = calloc(num_segments, 1);
+    if (victims == NULL) {
+        return -1;
+    }
+
+    // The blocks in use of every segment are counted in the data bitmap
+    char bitmap[FS_BLOCK_SIZE];
+    long loaded = -1;
+    long used = 0;
+    int found = 0;
+    for (long i = 0; i < MAX_DATA_BLOCKS; i++) {
+        if (i / BITS_PER_BLOCK != loaded) {
+            loaded = i / BITS_PER_BLOCK;
+            if (fs_bread(DEVICE_IMAGE, DATA_BITMAP_START + loaded, bitmap) != 0) {
+                free(victims);
+                return -1;
+            }
+        }
+        used += bitmap_getbit(bitmap, i % BITS_PER_BLOCK) != 0;
+        if ((i + 1) % LOG_SEGMENT_BLOCKS == 0 || i + 1 == MAX_DATA_BLOCKS) {
+            long segment = i / LOG_SEGMENT_BLOCKS;
+            victims[segment] = used > 0 && used < LOG_CLEAN_THRESHOLD && segment != LOG_TAIL / LOG_SEGMENT_BLOCKS;
+            found |= victims[segment];
+            used = 0;
+        }
+    }
+    if (!found) {
+        free(victims);
+        return 0;
+    }
+
+    CLEANING = 1;
+    long moved = 0;
+    loaded = -1;
+    for (long inode_index = 0; inode_index < MAX_INODES && moved >= 0; inode_index++) {
+        if (inode_index / BITS_PER_BLOCK != loaded) {
+            loaded = inode_index / BITS_PER_BLOCK;
+            if (fs_bread(DEVICE_IMAGE, INODE_BITMAP_START + loaded, bitmap) != 0) {
+                moved = -1;
+                break;
+            }
+        }
+        if (bitmap_getbit(bitmap, inode_index % BITS_PER_BLOCK)) {
+            long ret = clean_inode(inode_index, victims);
+            moved = ret < 0 ? -1 : moved + ret;
+        }
+    }
+
+    // Inode table blocks whose latest copy is in a victim are logged again
+    int table_blocks[LOG_SEGMENT_BLOCKS];
+    int count = 0;
+    for (long t = 0; t < NUM_INODE_BLOCKS && moved >= 0; t++) {
+        if (INODE_MAP[t] != 0 && victims[(INODE_MAP[t] - 1) / LOG_SEGMENT_BLOCKS]) {
+            table_blocks[count++] = t;
+        }
+        if (count == LOG_SEGMENT_BLOCKS || (t == NUM_INODE_BLOCKS - 1 && count > 0)) {
+            moved = relog_inode_blocks(count, table_blocks) != 0 ? -1 : moved + count;
+            count = 0;
+        }
+    }
+    CLEANING = 0;
+    free(victims);
+    return moved;
+}
+
+/* Fills data with the CLUSTER_SIZE bytes of a cluster of a compressed file,
+   decompressing it if needed. Returns 0 on success, -1 otherwise */
+int read_cluster(BlockMap * map, long cluster, char * data) {
+    memset(data, 0, CLUSTER_SIZE);
+    long first = cluster * CLUSTER_BLOCKS;
+    long entries[CLUSTER_BLOCKS];
+    for (int k = 0; k < CLUSTER_BLOCKS; k++) {
+        entries[k] = map_get(map, first + k);
+    }
+    if (entries[CLUSTER_BLOCKS - 1] < FS_HOLE) {
+        // Compressed cluster: gather the stream and inflate it
+        long length = CLUSTER_ENTRY_TO_LENGTH(entries[CLUSTER_BLOCKS - 1]);
+        int count = (length + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+        char packed[(CLUSTER_BLOCKS - 1) * FS_BLOCK_SIZE];
+        int targets[CLUSTER_BLOCKS];
+        for (int k = 0; k < count; k++) {
+            targets[k] = DATA_BLOCK_START + entries[k];
+        }
+        if (fs_bread_blocks(DEVICE_IMAGE, targets, packed, count) != 0 || verify_blocks(targets, packed, count) != 0) {
+            return -1;
+        }
+        uLongf data_length = CLUSTER_SIZE;
+        if (uncompress((Bytef *) data, &data_length, (Bytef *) packed, length) != Z_OK) {
+            return -1;
+        }
+        return 0;
+    }
+    // Raw cluster: one block per entry, holes read as zeros
+    char blocks[CLUSTER_SIZE];
+    int targets[CLUSTER_BLOCKS];
+    int num_targets = 0;
+    for (int k = 0; k < CLUSTER_BLOCKS; k++) {
+        if (entries[k] >= 0) {
+            targets[num_targets++] = DATA_BLOCK_START + entries[k];
+        }
+    }
+    if (num_targets > 0 && (fs_bread_blocks(DEVICE_IMAGE, targets, blocks, num_targets) != 0 ||
+                            verify_blocks(targets, blocks, num_targets) != 0)) {
+        return -1;
+    }
+    for (int k = 0, next = 0; k < CLUSTER_BLOCKS; k++) {
+        if (entries[k] >= 0) {
+            memcpy(data + k * FS_BLOCK_SIZE, blocks + next++ * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+        }
+    }
+    return 0;
+}
+
+/* Compresses the first valid_bytes of data and stores them as the given cluster,
+   replacing its previous blocks. The cluster is kept raw when compressing it does
+   not save at least one block. Returns 0 on success, -1 otherwise */
+int write_cluster(BlockMap * map, long cluster, char * data, long valid_bytes) {
+    long first = cluster * CLUSTER_BLOCKS;
+    uLongf length = compressBound(valid_bytes);
+    char * packed = malloc(length + FS_BLOCK_SIZE);
+    if (packed == NULL) {
+        return -1;
+    }
+    int compressed = compress2((Bytef *) packed, &length, (Bytef *) data, valid_bytes, Z_DEFAULT_COMPRESSION) == Z_OK
+                     && length <= (CLUSTER_BLOCKS - 1) * FS_BLOCK_SIZE;
+    char * source = data;
+    int count = (valid_bytes + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    if (compressed) {
+        count = (length + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+        memset(packed + length, 0, (long) count * FS_BLOCK_SIZE - length);
+        source = packed;
+    }
+
+    int new_blocks[CLUSTER_BLOCKS];
+    int targets[CLUSTER_BLOCKS];
+    if (count > 0 && allocate_data_blocks(count, new_blocks) != 0) {
+        free(packed);
+        return -1;
+    }
+    for (int k = 0; k < count; k++) {
+        targets[k] = DATA_BLOCK_START + new_blocks[k];
+    }
+    // The map keeps the previous copy until the new one is on the device
+    if (bwrite_blocks_with_crc(DEVICE_IMAGE, targets, source, count) != 0) {
+        free_data_blocks(count, new_blocks);
+        free(packed);
+        return -1;
+    }
+    free(packed);
+
+    // Release the previous copy of the cluster
+    int old_blocks[CLUSTER_BLOCKS];
+    int num_old = 0;
+    for (int k = 0; k < CLUSTER_BLOCKS; k++) {
+        long entry = map_get(map, first + k);
+        if (entry >= 0) {
+            old_blocks[num_old++] = entry;
+        }
+    }
+    if (num_old > 0) {
+        free_data_blocks(num_old, old_blocks);
+    }
+
+    for (int k = 0; k < CLUSTER_BLOCKS; k++) {
+        long entry = k < count ? new_blocks[k] : FS_HOLE;
+        if (compressed && k == CLUSTER_BLOCKS - 1) {
+            entry = CLUSTER_LENGTH_TO_ENTRY(length);
+        }
+        if (map_set(map, first + k, entry) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Writes numBytes at offset of a compressed file, recompressing every cluster
+   it touches. Returns the number of bytes written, -1 in case of error */
+int write_compressed(BlockMap * map, long offset, char * buffer, int numBytes) {
+    INode * inode = map->inode;
+    long new_size = offset + numBytes > inode->size ? offset + numBytes : inode->size;
+    long last_cluster = (offset + numBytes - 1) / CLUSTER_SIZE;
+    // Cover the touched clusters with whole map entries, leaving holes in between
+    map_extend(map, (last_cluster + 1) * CLUSTER_BLOCKS);
+
+    char * cluster = malloc(CLUSTER_SIZE);
+    if (cluster == NULL) {
+        return -1;
+    }
+    int bytes_written = 0;
+    while (bytes_written < numBytes) {
+        long current_cluster = (offset + bytes_written) / CLUSTER_SIZE;
+        long cluster_offset = (offset + bytes_written) % CLUSTER_SIZE;
+        int bytes_this_loop = numBytes - bytes_written < CLUSTER_SIZE - cluster_offset ?
+                              numBytes - bytes_written : CLUSTER_SIZE - cluster_offset;
+        // Partially overwritten clusters are read back first
+        if (bytes_this_loop < CLUSTER_SIZE && read_cluster(map, current_cluster, cluster) != 0) {
+            break;
+        }
+        memcpy(cluster + cluster_offset, buffer + bytes_written, bytes_this_loop);
+        long valid_bytes = new_size - current_cluster * CLUSTER_SIZE;
+        if (valid_bytes > CLUSTER_SIZE) {
+            valid_bytes = CLUSTER_SIZE;
+        }
+        if (write_cluster(map, current_cluster, cluster, valid_bytes) != 0) {
+            break;
+        }
+        bytes_written += bytes_this_loop;
+        if (offset + bytes_written > inode->size) {
+            inode->size = offset + bytes_written;
+        }
+    }
+    free(cluster);
+    return bytes_written > 0 ? bytes_written : -1;
+}
+
+/* Marks in cloned which of the count blocks in entries are shared with other
+   files and so must be copied before being written. Blocks written out of
+   place are always copied and need no check */
+static void find_cloned_blocks(int count, long * entries, int out_of_place, int * cloned) {
+    int blocks[count];
+    int refcounts[count];
+    int num_blocks = 0;
+    for (int i = 0; i < count; i++) {
+        cloned[i] = 0;
+        if (!out_of_place && REFCOUNT_START != -1 && entries[i] != FS_HOLE) {
+            blocks[num_blocks++] = entries[i];
+        }
+    }
+    if (num_blocks == 0 || read_refcounts(num_blocks, blocks, refcounts) != 0) {
+        return;
+    }
+    for (int i = 0, next = 0; i < count; i++) {
+        if (!out_of_place && REFCOUNT_START != -1 && entries[i] != FS_HOLE) {
+            cloned[i] = refcounts[next++] > 1;
+        }
+    }
+}
+
+/* Writes one chunk of at most WRITE_CHUNK_BLOCKS blocks for write_blocks.
+   crcs, unless it is NULL, holds the CRC of every block of a chunk made of
+   whole blocks, so that they are not computed again */
+static int write_chunk(BlockMap * map, long offset, char * buffer, int numBytes, uint16_t * crcs) {
+    long first_block = offset / FS_BLOCK_SIZE;
+    long last_block = (offset + numBytes - 1) / FS_BLOCK_SIZE;
+    int count = last_block - first_block + 1;
+
+    // Build the image of every touched block
+    char * images = malloc((long) count * FS_BLOCK_SIZE);
+    if (images == NULL) {
+        return -1;
+    }
+    long old_entries[count];
+    int bytes_written = 0;
+    for (int i = 0; i < count; i++) {
+        long block_offset = (offset + bytes_written) % FS_BLOCK_SIZE;
+        int bytes_this_loop = numBytes - bytes_written < FS_BLOCK_SIZE - block_offset ?
+                              numBytes - bytes_written : FS_BLOCK_SIZE - block_offset;
+        char * image = images + (long) i * FS_BLOCK_SIZE;
+        old_entries[i] = map_get(map, first_block + i);
+        if (bytes_this_loop < FS_BLOCK_SIZE) {
+            if (old_entries[i] == FS_HOLE) {
+                memset(image, 0, FS_BLOCK_SIZE);
+            } else if (fs_bread(DEVICE_IMAGE, DATA_BLOCK_START + old_entries[i], image) != 0) {
+                free(images);
+                return -1;
+            }
+        }
+        memcpy(image + block_offset, buffer + bytes_written, bytes_this_loop);
+        bytes_written += bytes_this_loop;
+    }
+
+    /* Holes need a new data block. In log-structured mode every touched block
+       is appended at the log tail instead of updated in place, and so it is with
+       deduplication, where images already on the device are shared instead */
+    int out_of_place = FS_FLAGS & (FS_FLAG_LOG | FS_FLAG_DEDUP);
+    int shared[count];
+    int cloned[count];
+    find_cloned_blocks(count, old_entries, out_of_place, cloned);
+    int num_new = 0;
+    for (int i = 0; i < count; i++) {
+        shared[i] = (FS_FLAGS & FS_FLAG_DEDUP) ? dedup_lookup(images + (long) i * FS_BLOCK_SIZE) : -1;
+        if (shared[i] == -1 && (out_of_place || old_entries[i] == FS_HOLE || cloned[i])) {
+            num_new++;
+        }
+    }
+    int new_blocks[count];
+    if (num_new > 0 && allocate_data_blocks(num_new, new_blocks) != 0) {
+        free(images);
+        return -1;
+    }
+
+    // Choose the block of every image, packing the images that must be written at the front
+    int targets[count];
+    uint16_t target_crcs[count];
+    int num_targets = 0;
+    long new_entries[count];
+    int old_blocks[count];
+    int num_old = 0;
+    int reused[count];
+    int num_reused = 0;
+    int next_new = 0;
+    for (int i = 0; i < count; i++) {
+        long old_block = old_entries[i];
+        long block_index = old_block;
+        if (shared[i] != -1) {
+            block_index = shared[i];
+            if (block_index != old_block) {
+                reused[num_reused++] = block_index;
+            }
+        } else {
+            if (out_of_place || old_block == FS_HOLE || cloned[i]) {
+                block_index = new_blocks[next_new++];
+            }
+            if (num_targets != i) {
+                memcpy(images + (long) num_targets * FS_BLOCK_SIZE, images + (long) i * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+            }
+            if (crcs != NULL) {
+                target_crcs[num_targets] = crcs[i];
+            }
+            targets[num_targets++] = DATA_BLOCK_START + block_index;
+        }
+        if (old_block != FS_HOLE && block_index != old_block) {
+            old_blocks[num_old++] = old_block;
+        }
+        new_entries[i] = block_index;
+    }
+
+    /* The map only points at the new blocks once they are on disk. When either
+       step fails the map keeps the old blocks and the new ones are released */
+    int failed = bwrite_blocks_with_crcs(DEVICE_IMAGE, targets, images, crcs != NULL ? target_crcs : NULL,
+                                         num_targets) != 0;
+    for (int i = 0; i < count && !failed; i++) {
+        if (new_entries[i] != old_entries[i] && map_set(map, first_block + i, new_entries[i]) != 0) {
+            while (--i >= 0) {
+                if (new_entries[i] != old_entries[i]) {
+                    map_set(map, first_block + i, old_entries[i]);
+                }
+            }
+            failed = 1;
+        }
+    }
+    if (failed) {
+        free_data_blocks(num_new, new_blocks);
+        free(images);
+        return -1;
+    }
+    if (FS_FLAGS & FS_FLAG_DEDUP) {
+        for (int i = 0; i < num_targets; i++) {
+            dedup_insert(images + (long) i * FS_BLOCK_SIZE, targets[i] - DATA_BLOCK_START);
+        }
+    }
+    free(images);
+
+    // The previous copies of rewritten blocks are dead once the new ones are on disk
+    if (num_reused > 0) {
+        adjust_refcounts(num_reused, reused, 1, NULL);
+    }
+    if (num_old > 0) {
+        free_data_blocks(num_old, old_blocks);
+    }
+    return numBytes;
+}
+
+/* Writes numBytes at offset of a regular file through its block map, staging
+   at most WRITE_CHUNK_BLOCKS blocks in memory at a time.
+   Returns the number of bytes written, -1 in case of error */
+int write_blocks(BlockMap * map, long offset, char * buffer, int numBytes) {
+    // Writing past the end of the file leaves a hole over the blocks it skips
+    map_extend(map, (offset + numBytes - 1) / FS_BLOCK_SIZE + 1);
+    int bytes_written = 0;
+    while (bytes_written < numBytes) {
+        long position = offset + bytes_written;
+        long chunk_end = (position / FS_BLOCK_SIZE + WRITE_CHUNK_BLOCKS) * FS_BLOCK_SIZE;
+        int bytes_this_loop = numBytes - bytes_written < chunk_end - position ?
+                              numBytes - bytes_written : chunk_end - position;
+        if (write_chunk(map, position, buffer + bytes_written, bytes_this_loop, NULL) < 0) {
+            break;
+        }
+        bytes_written += bytes_this_loop;
+    }
+    return bytes_written > 0 ? bytes_written : -1;
+}
+
+/* Copies count whole blocks from block src_block of src to block dst_block
+   of the file behind dst, reading and writing WRITE_CHUNK_BLOCKS blocks at a
+   time. The CRCs of the source blocks are carried over instead of computed,
+   and holes of the source stay holes where the destination has no data.
+   Returns the number of blocks copied, -1 in case of error */
+long copy_blocks(INode * src, long src_block, BlockMap * dst, long dst_block, long count) {
+    BlockMap src_map;
+    map_init(&src_map, src);
+    map_extend(dst, dst_block + count);
+    char * images = malloc((long) WRITE_CHUNK_BLOCKS * FS_BLOCK_SIZE);
+    if (images == NULL) {
+        return -1;
+    }
+    uint16_t zero_crc = 0;
+    int have_zero_crc = 0;
+    long copied = 0;
+    while (copied < count) {
+        int n = count - copied < WRITE_CHUNK_BLOCKS ? count - copied : WRITE_CHUNK_BLOCKS;
+        long entries[n];
+        int targets[n];
+        uint16_t crcs[n];
+        int num_targets = 0;
+        for (int i = 0; i < n; i++) {
+            entries[i] = map_get(&src_map, src_block + copied + i);
+            if (entries[i] != FS_HOLE) {
+                targets[num_targets++] = DATA_BLOCK_START + entries[i];
+            }
+        }
+        if (num_targets > 0 && (fs_bread_blocks(DEVICE_IMAGE, targets, images, num_targets) != 0 ||
+                                read_crcs(targets, crcs, num_targets) != 0)) {
+            break;
+        }
+        // Spread the blocks read over their positions, from the last one, leaving zeros in the holes
+        for (int i = n - 1, next = num_targets - 1; i >= 0; i--) {
+            if (entries[i] == FS_HOLE) {
+                memset(images + (long) i * FS_BLOCK_SIZE, 0, FS_BLOCK_SIZE);
+                if (!have_zero_crc) {
+                    zero_crc = CRC16((unsigned char *) images + (long) i * FS_BLOCK_SIZE, FS_BLOCK_SIZE, 0);
+                    have_zero_crc = 1;
+                }
+                crcs[i] = zero_crc;
+            } else {
+                if (next != i) {
+                    memmove(images + (long) i * FS_BLOCK_SIZE, images + (long) next * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+                    crcs[i] = crcs[next];
+                }
+                next--;
+            }
+        }
+        // Write every run of blocks that is not a hole on both sides
+        int ret = 0;
+        for (int i = 0; i < n && ret >= 0;) {
+            int skip = entries[i] == FS_HOLE && map_get(dst, dst_block + copied + i) == FS_HOLE;
+            int j = i + 1;
+            while (j < n && skip == (entries[j] == FS_HOLE && map_get(dst, dst_block + copied + j) == FS_HOLE)) {
+                j++;
+            }
+            if (!skip) {
+                ret = write_chunk(dst, (dst_block + copied + i) * FS_BLOCK_SIZE, images + (long) i * FS_BLOCK_SIZE,
+                                  (j - i) * FS_BLOCK_SIZE, crcs + i);
+            }
+            i = j;
+        }
+        if (ret < 0) {
+            break;
+        }
+        copied += n;
+    }
+    free(images);
+    return copied > 0 || count == 0 ? copied : -1;
+}
+
+/* 
+ * Helper function to load the superblock.
+ * This could be used to cache the superblock in memory
+ */
+SuperBlock load_superblock() {
+    char buffer[FS_BLOCK_SIZE] = {0};
+    fs_bread(DEVICE_IMAGE, 0, buffer);
+    SuperBlock sblock = *(SuperBlock *) buffer;
+    return sblock;
+}
+
+/* Copies an inode out of the inode table. Returns 0 on success, -1 otherwise */
+int read_inode(long inode_index, INode * inode) {
+    INode table[INODES_PER_BLOCK];
+    long block = inode_location(inode_index / INODES_PER_BLOCK);
+    lazy_ensure(block);
+    if (fs_bread(DEVICE_IMAGE, block, (char *) table) != 0) {
+        return -1;
+    }
+    *inode = table[inode_index % INODES_PER_BLOCK];
+    return 0;
+}
+
+/* Stores an inode in the inode table, rewriting the block it shares with
+   its neighbours. Returns 0 on success, -1 otherwise */
+int write_inode(long inode_index, INode * inode) {
+    INode table[INODES_PER_BLOCK];
+    int table_block = inode_index / INODES_PER_BLOCK;
+    long block = inode_location(table_block);
+    lazy_ensure(block);
+    if (fs_bread(DEVICE_IMAGE, block, (char *) table) != 0) {
+        return -1;
+    }
+    table[inode_index % INODES_PER_BLOCK] = *inode;
+    return store_inode_blocks(1, &table_block, (char *) table);
+}
+
+/* Stores count inodes whose indexes are given in ascending order, reading
+   each inode table block they fall in once and writing all of them in a
+   single batch. Returns 0 on success, -1 otherwise */
+int write_inodes(int count, int * indexes, INode * inodes) {
+    int * blocks = malloc(count * sizeof(int));
+    char * tables = malloc((long) count * FS_BLOCK_SIZE);
+    int num_blocks = 0;
+    int ret = blocks != NULL && tables != NULL ? 0 : -1;
+    for (int i = 0; i < count && ret == 0; i++) {
+        int table_block = indexes[i] / INODES_PER_BLOCK;
+        if (num_blocks == 0 || blocks[num_blocks - 1] != table_block) {
+            long block = inode_location(table_block);
+            lazy_ensure(block);
+            ret = fs_bread(DEVICE_IMAGE, block, tables + (long) num_blocks * FS_BLOCK_SIZE) == 0 ? 0 : -1;
+            blocks[num_blocks++] = table_block;
         }
-    } 
-	return 0;
+        INode * table = (INode *) (tables + (long) (num_blocks - 1) * FS_BLOCK_SIZE);
+        table[indexes[i] % INODES_PER_BLOCK] = inodes[i];
+    }
+    if (ret == 0 && store_inode_blocks(num_blocks, blocks, tables) != 0) {
+        ret = -1;
+    }
+    free(blocks);
+    free(tables);
+    return ret;
 }
 
-/* Calculates how many files can fit in  given disk_size,
-   and initializes the superblock with the corresponding values */
-void init_superblock(SuperBlock * sblock, long disk_size) {
-    long max_file_blocks = MAX_FILE_SIZE / BLOCK_SIZE;
-    long num_blocks_on_disk = disk_size / BLOCK_SIZE; 
-    long num_crc_blocks = (2 * num_blocks_on_disk) / (BLOCK_SIZE + 2); // Assuming using CRC16
-    long max_number_of_files = (num_blocks_on_disk - num_crc_blocks - 3) / (max_file_blocks + 1);
-    sblock->num_crc_blocks = num_crc_blocks;
-    sblock->max_inodes= max_number_of_files;
-    sblock->max_data_blocks = num_blocks_on_disk - 3 - max_number_of_files;
+/* Returns the device block holding the latest copy of a block of the inode table */
+long inode_location(long table_block) {
+    if (INODE_MAP != NULL && INODE_MAP[table_block] != 0) {
+        return DATA_BLOCK_START + INODE_MAP[table_block] - 1;
+    }
+    return INODE_START + table_block;
 }
 
-/* Finds the First zero in a bitmap. Used by both allocate_ functions */
-int first_zero(char * bitmap, int length) {
-    int i;
-    for (i = 0; i < length; i++) {
-        if(bitmap_getbit(bitmap, i) == 0) {
-            break;
+/* Writes count blocks of the inode table, given by their position in the
+   table. In log-structured mode they are appended to the log instead of
+   rewritten in place, and the copies they replace are released.
+   Returns 0 on success, -1 otherwise */
+int store_inode_blocks(int count, int * table_blocks, char * tables) {
+    if (count <= 0) {
+        return 0;
+    }
+    int * blocks = malloc(2 * count * sizeof(int));
+    if (blocks == NULL) {
+        return -1;
+    }
+    int * logged = blocks + count;
+    int num_old = 0;
+    int ret = 0;
+    if (INODE_MAP == NULL) {
+        for (int i = 0; i < count; i++) {
+            blocks[i] = INODE_START + table_blocks[i];
+        }
+        ret = bwrite_blocks_with_crc(DEVICE_IMAGE, blocks, tables, count);
+    } else if (allocate_data_blocks(count, logged) == 0) {
+        for (int i = 0; i < count; i++) {
+            blocks[i] = DATA_BLOCK_START + logged[i];
+        }
+        if (bwrite_blocks_with_crc(DEVICE_IMAGE, blocks, tables, count) != 0) {
+            free_data_blocks(count, logged);
+            ret = -1;
+        } else {
+            // The map points at the new copies, the old ones are reused as free space
+            for (int i = 0; i < count; i++) {
+                int32_t * entry = &INODE_MAP[table_blocks[i]];
+                if (*entry != 0) {
+                    blocks[num_old++] = *entry - 1;
+                }
+                *entry = logged[i] + 1;
+                IMAP_DIRTY[table_blocks[i] / IMAP_ENTRIES_PER_BLOCK] = 1;
+            }
+            free_data_blocks(num_old, blocks);
         }
+    } else {
+        ret = -1;
     }
-    if (i == length) {
+    free(blocks);
+    return ret;
+}
+
+/* Reads count blocks of the inode table and stores them again, which moves
+   them to the log tail in log-structured mode. Returns 0 on success, -1 otherwise */
+int relog_inode_blocks(int count, int * table_blocks) {
+    char * tables = malloc((long) count * FS_BLOCK_SIZE);
+    int ret = tables != NULL ? 0 : -1;
+    for (int i = 0; i < count && ret == 0; i++) {
+        long block = inode_location(table_blocks[i]);
+        lazy_ensure(block);
+        ret = fs_bread(DEVICE_IMAGE, block, tables + (long) i * FS_BLOCK_SIZE) == 0 ? 0 : -1;
+    }
+    if (ret == 0) {
+        ret = store_inode_blocks(count, table_blocks, tables);
+    }
+    free(tables);
+    return ret;
+}
+
+/* Loads the inode map of a log-structured file system, which is kept in
+   memory while it is mounted. Returns 0 on success, -1 otherwise */
+int imap_load() {
+    INODE_MAP = malloc(NUM_IMAP_BLOCKS * FS_BLOCK_SIZE);
+    IMAP_DIRTY = calloc(NUM_IMAP_BLOCKS, 1);
+    if (INODE_MAP == NULL || IMAP_DIRTY == NULL) {
+        imap_drop();
         return -1;
     }
-    return i;
+    for (long i = 0; i < NUM_IMAP_BLOCKS; i++) {
+        char * block = (char *) INODE_MAP + i * FS_BLOCK_SIZE;
+        // Groups never used are known to be zero
+        if (lazy_pending(IMAP_START + i)) {
+            memset(block, 0, FS_BLOCK_SIZE);
+        } else if (fs_bread(DEVICE_IMAGE, IMAP_START + i, block) != 0) {
+            imap_drop();
+            return -1;
+        }
+    }
+    return 0;
 }
 
-/* Updates the inode allocation bitmap on the disk
-   Returns the index of the first free inode block */
-int allocate_inode() {
-    char bitmap[BLOCK_SIZE];
-    bread(DEVICE_IMAGE, 1, bitmap);
-    int i = first_zero(bitmap, BLOCK_SIZE);
-    bitmap_setbit(bitmap, i, 1);
-    bwrite_with_crc(DEVICE_IMAGE, 1, bitmap);
-    return i;
+/* Writes the blocks of the inode map changed since the last call.
+   Returns 0 on success, -1 otherwise */
+int imap_flush() {
+    int ret = 0;
+    for (long i = 0; INODE_MAP != NULL && i < NUM_IMAP_BLOCKS; i++) {
+        if (IMAP_DIRTY[i]) {
+            IMAP_DIRTY[i] = 0;
+            lazy_ensure(IMAP_START + i);
+            ret |= bwrite_with_crc(DEVICE_IMAGE, IMAP_START + i, (char *) INODE_MAP + i * FS_BLOCK_SIZE);
+        }
+    }
+    return ret == 0 ? 0 : -1;
 }
 
-/* Updates the data block allocation bitmap on the disk
-   Returns the index of the first free data block */
-int allocate_data_block() {
-    char bitmap[BLOCK_SIZE];
-    bread(DEVICE_IMAGE, 2, bitmap);
-    int i = first_zero(bitmap, BLOCK_SIZE);
-    bitmap_setbit(bitmap, i, 1);
-    bwrite_with_crc(DEVICE_IMAGE, 2, bitmap);
-    return i;
+/* Forgets the inode map loaded by imap_load */
+void imap_drop() {
+    free(INODE_MAP);
+    free(IMAP_DIRTY);
+    INODE_MAP = NULL;
+    IMAP_DIRTY = NULL;
 }
 
-/* 
- * Helper function to load the superblock.
- * This could be used to cache the superblock in memory
- */
-SuperBlock load_superblock() {
-    char buffer[BLOCK_SIZE] = {0};
-    bread(DEVICE_IMAGE, 0, buffer);
-    SuperBlock sblock = *(SuperBlock *) buffer;
-    return sblock;
+/* Writes the counters kept in memory while mounted (log tail, directory
+   root, number of files and free space) and whether the file system is
+   mounted to the superblock, along with the blocks of the inode map changed
+   since the last time */
+int save_superblock() {
+    pthread_mutex_lock(&FS_LOCK);
+    imap_flush();
+    SuperBlock sblock = load_superblock();
+    sblock.log_tail = LOG_TAIL;
+    sblock.dir_root = DIR_ROOT;
+    sblock.num_inodes_in_use = NUM_INODES_IN_USE;
+    sblock.free_inodes = FREE_INODES;
+    sblock.free_data_blocks = FREE_DATA_BLOCKS;
+    sblock.free_extents = FREE_EXTENTS;
+    memcpy(sblock.free_extent_sizes, FREE_EXTENT_SIZES, sizeof(FREE_EXTENT_SIZES));
+    sblock.free_hint = FREE_HINT;
+    sblock.mounted = MOUNTED;
+    memcpy(sblock.uninit_groups, UNINIT_GROUPS, sizeof(UNINIT_GROUPS));
+    int ret = bwrite_with_crc(DEVICE_IMAGE, 0, (char *) &sblock);
+    pthread_mutex_unlock(&FS_LOCK);
+    return ret;
 }
 
 /* Returns index of file if it exists, -1 otherwise */
 int get_inode_index(SuperBlock * sblock, char * fileName) {
-    int i, count;
-    while (count < sblock->num_inodes_in_use) {
-        if (sblock->filenames[i].index == -1) {
-            i++;
-            continue; // Skip deleted files
-        } else if (strcmp(fileName, (char *) &(sblock->filenames[i].name)) == 0) {
-            return sblock->filenames[i].index;
+    return dir_search(sblock->dir_root, fileName);
+}
+
+/* Forgets every cached directory node */
+void dir_cache_reset() {
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        DIR_CACHE[i].block = -1;
+        DIR_CACHE[i].dirty = 0;
+    }
+    DIR_WRITE_BACK = 0;
+}
+
+/* Keeps the directory nodes written in the cache until dir_flush */
+void dir_defer() {
+    DIR_WRITE_BACK = 1;
+}
+
+/* Writes every directory node modified since dir_defer in a single batch
+   and makes the cache write-through again. Returns 0 on success, -1 otherwise */
+int dir_flush() {
+    int blocks[DIR_CACHE_SIZE];
+    static char buffers[DIR_CACHE_SIZE * FS_BLOCK_SIZE];
+    int count = 0;
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (DIR_CACHE[i].dirty) {
+            blocks[count] = DATA_BLOCK_START + DIR_CACHE[i].block;
+            memcpy(buffers + (long) count * FS_BLOCK_SIZE, &DIR_CACHE[i].node, sizeof(DirNode));
+            count++;
+            DIR_CACHE[i].dirty = 0;
+        }
+    }
+    DIR_WRITE_BACK = 0;
+    return bwrite_blocks_with_crc(DEVICE_IMAGE, blocks, buffers, count) == 0 ? 0 : -1;
+}
+
+/* Makes a slot ready to hold another node, writing back its node if needed */
+static void dir_cache_evict(int slot) {
+    if (DIR_CACHE[slot].dirty) {
+        bwrite_with_crc(DEVICE_IMAGE, DATA_BLOCK_START + DIR_CACHE[slot].block, (char *) &DIR_CACHE[slot].node);
+        DIR_CACHE[slot].dirty = 0;
+    }
+}
+
+/* Returns the cache slot of block, or the slot to reuse for it when it is
+   not cached */
+static int dir_cache_slot(long block) {
+    int victim = 0;
+    for (int i = 0; i < DIR_CACHE_SIZE; i++) {
+        if (DIR_CACHE[i].block == block) {
+            return i;
+        }
+        if (DIR_CACHE[i].block == -1) {
+            victim = i;
+        } else if (DIR_CACHE[victim].block != -1 && DIR_CACHE[i].last_used < DIR_CACHE[victim].last_used) {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+/* Reads a directory node through the cache */
+static int dir_read(long block, DirNode * node) {
+    int slot = dir_cache_slot(block);
+    stats_count_dir_cache(DIR_CACHE[slot].block == block);
+    if (DIR_CACHE[slot].block != block) {
+        dir_cache_evict(slot);
+        if (fs_bread(DEVICE_IMAGE, DATA_BLOCK_START + block, (char *) &DIR_CACHE[slot].node) != 0) {
+            DIR_CACHE[slot].block = -1;
+            return -1;
+        }
+        DIR_CACHE[slot].block = block;
+    }
+    DIR_CACHE[slot].last_used = ++DIR_CACHE_CLOCK;
+    memcpy(node, &DIR_CACHE[slot].node, sizeof(DirNode));
+    return 0;
+}
+
+/* Writes a directory node to the cache and, unless writes are deferred, to the disk */
+static int dir_write(long block, DirNode * node) {
+    int slot = dir_cache_slot(block);
+    if (DIR_CACHE[slot].block != block) {
+        dir_cache_evict(slot);
+    }
+    memcpy(&DIR_CACHE[slot].node, node, sizeof(DirNode));
+    DIR_CACHE[slot].block = block;
+    DIR_CACHE[slot].last_used = ++DIR_CACHE_CLOCK;
+    if (DIR_WRITE_BACK) {
+        DIR_CACHE[slot].dirty = 1;
+        return 0;
+    }
+    return bwrite_with_crc(DEVICE_IMAGE, DATA_BLOCK_START + block, (char *) node);
+}
+
+/* Releases the data block of a directory node */
+static void dir_free(long block) {
+    int slot = dir_cache_slot(block);
+    if (DIR_CACHE[slot].block == block) {
+        DIR_CACHE[slot].block = -1;
+        DIR_CACHE[slot].dirty = 0;
+    }
+    int b = block;
+    free_data_blocks(1, &b);
+}
+
+/* Copies a name into a MAX_FILENAME key, which is not null-terminated when
+   the name takes all of it */
+static void dir_copy_name(char * key, char * name) {
+    memset(key, 0, MAX_FILENAME);
+    memcpy(key, name, strnlen(name, MAX_FILENAME));
+}
+
+/* Returns the position of the first key of node that is not smaller than name */
+static int dir_find(DirNode * node, char * name) {
+    int low = 0, high = node->num_keys;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (strncmp(node->keys[mid].name, name, MAX_FILENAME) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+static int dir_key_equals(DirNode * node, int i, char * name) {
+    return i < node->num_keys && strncmp(node->keys[i].name, name, MAX_FILENAME) == 0;
+}
+
+/* Returns the inode of name in the directory tree rooted at block, -1 if it is not there */
+int dir_search(long block, char * name) {
+    DirNode node;
+    while (block != -1) {
+        if (dir_read(block, &node) != 0) {
+            return -1;
+        }
+        int i = dir_find(&node, name);
+        if (dir_key_equals(&node, i, name)) {
+            return node.keys[i].index;
+        }
+        if (node.leaf) {
+            return -1;
         }
-        count++;
-        i++;
+        block = node.children[i];
     }
     return -1;
 }
 
+/* Returns the inode of a file, -1 if it does not exist */
+int dir_lookup(char * name) {
+    return dir_search(DIR_ROOT, name);
+}
+
+/* Splits the full child i of parent, moving its middle key up into parent.
+   Returns 0 on success, -1 if there is no space left */
+static int dir_split_child(long parent_block, DirNode * parent, int i) {
+    int right_block;
+    if (allocate_data_blocks(1, &right_block) != 0) {
+        return -1;
+    }
+    long left_block = parent->children[i];
+    DirNode left, right;
+    dir_read(left_block, &left);
+    memset(&right, 0, sizeof(DirNode));
+    right.leaf = left.leaf;
+    right.num_keys = DIR_MIN_DEGREE - 1;
+    memcpy(right.keys, &left.keys[DIR_MIN_DEGREE], (DIR_MIN_DEGREE - 1) * sizeof(filename_t));
+    if (!left.leaf) {
+        memcpy(right.children, &left.children[DIR_MIN_DEGREE], DIR_MIN_DEGREE * sizeof(int32_t));
+    }
+    left.num_keys = DIR_MIN_DEGREE - 1;
+
+    memmove(&parent->children[i + 2], &parent->children[i + 1], (parent->num_keys - i) * sizeof(int32_t));
+    memmove(&parent->keys[i + 1], &parent->keys[i], (parent->num_keys - i) * sizeof(filename_t));
+    parent->children[i + 1] = right_block;
+    parent->keys[i] = left.keys[DIR_MIN_DEGREE - 1];
+    parent->num_keys++;
+
+    dir_write(right_block, &right);
+    dir_write(left_block, &left);
+    return dir_write(parent_block, parent);
+}
+
+/* Adds name to the directory, splitting the full nodes found on the way
+   down so that a single pass is enough. The name must not be present.
+   Returns 0 on success, -1 if there is no space left */
+int dir_insert(char * name, int inode_index) {
+    DirNode node;
+    filename_t entry;
+    memset(&entry, 0, sizeof(filename_t));
+    dir_copy_name(entry.name, name);
+    entry.index = inode_index;
+
+    if (DIR_ROOT == -1) {
+        int root;
+        if (allocate_data_blocks(1, &root) != 0) {
+            return -1;
+        }
+        memset(&node, 0, sizeof(DirNode));
+        node.leaf = 1;
+        node.num_keys = 1;
+        node.keys[0] = entry;
+        dir_write(root, &node);
+        DIR_ROOT = root;
+        return save_superblock();
+    }
+
+    long block = DIR_ROOT;
+    dir_read(block, &node);
+    if (node.num_keys == DIR_MAX_KEYS) {
+        // The tree grows in height at the root
+        int root;
+        if (allocate_data_blocks(1, &root) != 0) {
+            return -1;
+        }
+        memset(&node, 0, sizeof(DirNode));
+        node.children[0] = DIR_ROOT;
+        if (dir_split_child(root, &node, 0) != 0) {
+            free_data_blocks(1, &root);
+            return -1;
+        }
+        DIR_ROOT = root;
+        save_superblock();
+        block = root;
+    }
+
+    while (!node.leaf) {
+        int i = dir_find(&node, name);
+        DirNode child;
+        dir_read(node.children[i], &child);
+        if (child.num_keys == DIR_MAX_KEYS) {
+            if (dir_split_child(block, &node, i) != 0) {
+                return -1;
+            }
+            if (strncmp(name, node.keys[i].name, MAX_FILENAME) > 0) {
+                i++;
+            }
+            dir_read(node.children[i], &child);
+        }
+        block = node.children[i];
+        node = child;
+    }
+
+    int i = dir_find(&node, name);
+    memmove(&node.keys[i + 1], &node.keys[i], (node.num_keys - i) * sizeof(filename_t));
+    node.keys[i] = entry;
+    node.num_keys++;
+    return dir_write(block, &node);
+}
+
+/* Merges child i + 1 of parent and the key between them into child i */
+static void dir_merge_children(long parent_block, DirNode * parent, int i, DirNode * left) {
+    long right_block = parent->children[i + 1];
+    DirNode right;
+    dir_read(right_block, &right);
+    left->keys[left->num_keys] = parent->keys[i];
+    memcpy(&left->keys[left->num_keys + 1], right.keys, right.num_keys * sizeof(filename_t));
+    if (!left->leaf) {
+        memcpy(&left->children[left->num_keys + 1], right.children, (right.num_keys + 1) * sizeof(int32_t));
+    }
+    left->num_keys += right.num_keys + 1;
+
+    memmove(&parent->keys[i], &parent->keys[i + 1], (parent->num_keys - i - 1) * sizeof(filename_t));
+    memmove(&parent->children[i + 1], &parent->children[i + 2], (parent->num_keys - i - 1) * sizeof(int32_t));
+    parent->num_keys--;
+
+    dir_write(parent->children[i], left);
+    dir_write(parent_block, parent);
+    dir_free(right_block);
+}
+
+/* Makes sure child i of parent has at least DIR_MIN_DEGREE keys before
+   descending into it, borrowing a key from a sibling or merging with one.
+   Returns the position of the child afterwards, stored in child */
+static int dir_fill_child(long parent_block, DirNode * parent, int i, DirNode * child) {
+    DirNode sibling;
+    if (i > 0) {
+        dir_read(parent->children[i - 1], &sibling);
+        if (sibling.num_keys >= DIR_MIN_DEGREE) {
+            // Rotate the last key of the left sibling through the parent
+            memmove(&child->keys[1], child->keys, child->num_keys * sizeof(filename_t));
+            if (!child->leaf) {
+                memmove(&child->children[1], child->children, (child->num_keys + 1) * sizeof(int32_t));
+                child->children[0] = sibling.children[sibling.num_keys];
+            }
+            child->keys[0] = parent->keys[i - 1];
+            parent->keys[i - 1] = sibling.keys[sibling.num_keys - 1];
+            child->num_keys++;
+            sibling.num_keys--;
+            dir_write(parent->children[i - 1], &sibling);
+            dir_write(parent->children[i], child);
+            dir_write(parent_block, parent);
+            return i;
+        }
+    }
+    if (i < parent->num_keys) {
+        dir_read(parent->children[i + 1], &sibling);
+        if (sibling.num_keys >= DIR_MIN_DEGREE) {
+            // Rotate the first key of the right sibling through the parent
+            child->keys[child->num_keys] = parent->keys[i];
+            if (!child->leaf) {
+                child->children[child->num_keys + 1] = sibling.children[0];
+                memmove(sibling.children, &sibling.children[1], sibling.num_keys * sizeof(int32_t));
+            }
+            parent->keys[i] = sibling.keys[0];
+            memmove(sibling.keys, &sibling.keys[1], (sibling.num_keys - 1) * sizeof(filename_t));
+            child->num_keys++;
+            sibling.num_keys--;
+            dir_write(parent->children[i + 1], &sibling);
+            dir_write(parent->children[i], child);
+            dir_write(parent_block, parent);
+            return i;
+        }
+        dir_merge_children(parent_block, parent, i, child);
+        return i;
+    }
+    // The last child merges into its left sibling, read above
+    dir_merge_children(parent_block, parent, i - 1, &sibling);
+    *child = sibling;
+    return i - 1;
+}
+
+/* Removes name from the directory in a single pass down the tree, making
+   sure every node entered can lose a key. Returns 0 on success, -1 if the
+   name is not in the directory */
+int dir_remove(char * name) {
+    char key[MAX_FILENAME];
+    dir_copy_name(key, name);
+    long block = DIR_ROOT;
+    DirNode node;
+    int ret = -1;
+    while (block != -1) {
+        dir_read(block, &node);
+        int i = dir_find(&node, key);
+        if (dir_key_equals(&node, i, key)) {
+            if (node.leaf) {
+                memmove(&node.keys[i], &node.keys[i + 1], (node.num_keys - i - 1) * sizeof(filename_t));
+                node.num_keys--;
+                dir_write(block, &node);
+                ret = 0;
+                break;
+            }
+            DirNode left, right;
+            dir_read(node.children[i], &left);
+            dir_read(node.children[i + 1], &right);
+            if (left.num_keys >= DIR_MIN_DEGREE || right.num_keys >= DIR_MIN_DEGREE) {
+                // Replace the key by its predecessor or successor, then remove that one instead
+                int from_left = left.num_keys >= DIR_MIN_DEGREE;
+                DirNode leaf = from_left ? left : right;
+                while (!leaf.leaf) {
+                    dir_read(leaf.children[from_left ? leaf.num_keys : 0], &leaf);
+                }
+                node.keys[i] = leaf.keys[from_left ? leaf.num_keys - 1 : 0];
+                dir_write(block, &node);
+                dir_copy_name(key, node.keys[i].name);
+                block = node.children[from_left ? i : i + 1];
+            } else {
+                // Both neighbours are minimal: merge them around the key and go down
+                dir_merge_children(block, &node, i, &left);
+                block = node.children[i];
+            }
+            continue;
+        }
+        if (node.leaf) {
+            break;
+        }
+        DirNode child;
+        dir_read(node.children[i], &child);
+        if (child.num_keys < DIR_MIN_DEGREE) {
+            i = dir_fill_child(block, &node, i, &child);
+        }
+        block = node.children[i];
+    }
+
+    // The root shrinks when it runs out of keys
+    if (DIR_ROOT != -1) {
+        dir_read(DIR_ROOT, &node);
+        if (node.num_keys == 0) {
+            long old_root = DIR_ROOT;
+            DIR_ROOT = node.leaf ? -1 : node.children[0];
+            dir_free(old_root);
+            save_superblock();
+        }
+    }
+    return ret;
+}
+
+/* Checks the integrity of every node of the directory tree rooted at block */
+int dir_check(long block) {
+    if (block == -1) {
+        return 0;
+    }
+    int ret;
+    if ((ret = check_crc(DATA_BLOCK_START + block)) != 0) {
+        return ret;
+    }
+    DirNode node;
+    if (dir_read(block, &node) != 0) {
+        return -2;
+    }
+    for (int i = 0; !node.leaf && i <= node.num_keys; i++) {
+        if ((ret = dir_check(node.children[i])) != 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Lists in device_blocks the device blocks of count file system blocks */
+static void device_blocks_of(int *blockNumbers, int count, int *device_blocks) {
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < FS_DEVICE_BLOCKS; j++) {
+            device_blocks[(long) i * FS_DEVICE_BLOCKS + j] = blockNumbers[i] * FS_DEVICE_BLOCKS + j;
+        }
+    }
+}
+
+/* Reads count file system blocks as one batch of device blocks */
+int fs_bread_blocks(char *deviceName, int *blockNumbers, char *buffers, int count) {
+    if (FS_DEVICE_BLOCKS == 1) {
+        return bread_blocks(deviceName, blockNumbers, buffers, count);
+    }
+    int * device_blocks = malloc((long) count * FS_DEVICE_BLOCKS * sizeof(int));
+    if (device_blocks == NULL) {
+        return -1;
+    }
+    device_blocks_of(blockNumbers, count, device_blocks);
+    int ret = bread_blocks(deviceName, device_blocks, buffers, count * FS_DEVICE_BLOCKS);
+    free(device_blocks);
+    return ret;
+}
+
+/* Writes count file system blocks as one batch of device blocks */
+int fs_bwrite_blocks(char *deviceName, int *blockNumbers, char *buffers, int count) {
+    if (FS_DEVICE_BLOCKS == 1) {
+        return bwrite_blocks(deviceName, blockNumbers, buffers, count);
+    }
+    int * device_blocks = malloc((long) count * FS_DEVICE_BLOCKS * sizeof(int));
+    if (device_blocks == NULL) {
+        return -1;
+    }
+    device_blocks_of(blockNumbers, count, device_blocks);
+    int ret = bwrite_blocks(deviceName, device_blocks, buffers, count * FS_DEVICE_BLOCKS);
+    free(device_blocks);
+    return ret;
+}
+
+/* Reads one file system block */
+int fs_bread(char *deviceName, int blockNumber, char *buffer) {
+    if (FS_DEVICE_BLOCKS == 1) {
+        return bread(deviceName, blockNumber, buffer);
+    }
+    return fs_bread_blocks(deviceName, &blockNumber, buffer, 1);
+}
+
+/* Writes one file system block */
+int fs_bwrite(char *deviceName, int blockNumber, char *buffer) {
+    if (FS_DEVICE_BLOCKS == 1) {
+        return bwrite(deviceName, blockNumber, buffer);
+    }
+    return fs_bwrite_blocks(deviceName, &blockNumber, buffer, 1);
+}
+
+/* Reads one copy of a file system block, which exists when every device block has it */
+int fs_bread_replica(char *deviceName, int blockNumber, int replica, char *buffer) {
+    for (int j = 0; j < FS_DEVICE_BLOCKS; j++) {
+        if (bread_replica(deviceName, blockNumber * FS_DEVICE_BLOCKS + j, replica,
+                          buffer + (long) j * BLOCK_SIZE) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Rewrites one copy of a file system block from buffer */
+int fs_brepair(char *deviceName, int blockNumber, int replica, char *buffer) {
+    int ret = 0;
+    for (int j = 0; j < FS_DEVICE_BLOCKS; j++) {
+        ret |= brepair(deviceName, blockNumber * FS_DEVICE_BLOCKS + j, replica, buffer + (long) j * BLOCK_SIZE);
+    }
+    return ret;
+}
+
+/* Discards count file system blocks from blockNumber on */
+int fs_bdiscard(char *deviceName, int blockNumber, int count) {
+    return bdiscard(deviceName, blockNumber * FS_DEVICE_BLOCKS, count * FS_DEVICE_BLOCKS);
+}
+
 /* Returns 0 on success and -1 for failed write and -2 for failed CRC */
 int bwrite_with_crc(char *deviceName, int blockNumber, char *buffer) {
+    // Locate CRC hash
+    long crc_block = ((long) blockNumber * 2)/ FS_BLOCK_SIZE;
+    long index = ((long) blockNumber * 2) % FS_BLOCK_SIZE;
+
+    TRACE_BEGIN("bwrite_with_crc", blockNumber);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    lazy_ensure(blockNumber);
+    lazy_ensure(CRC_START + crc_block);
     // Perform the write operation
-    if (bwrite(deviceName, blockNumber, buffer) != 0) {
+    if (fs_bwrite(deviceName, blockNumber, buffer) != 0) {
+        pthread_mutex_unlock(&FS_LOCK);
+        TRACE_END("bwrite_with_crc", -1);
         return -1;
     }
-    // Locate CRC hash
-    long crc_block = (blockNumber * 2)/ BLOCK_SIZE;
-    long index = (blockNumber * 2) % BLOCK_SIZE;
 
     // Read previous CRC hash
-    uint16_t crc_buffer[BLOCK_SIZE / 2];
-    bread(DEVICE_IMAGE, 3 + crc_block, (char *) crc_buffer);
+    uint16_t crc_buffer[FS_BLOCK_SIZE / 2];
+    fs_bread(DEVICE_IMAGE, CRC_START + crc_block, (char *) crc_buffer);
     // Compute CRC hash
-    uint16_t new_crc = CRC16((unsigned char *) buffer, BLOCK_SIZE, 0);
-    
-    printf("Writing block: %d\n", blockNumber);
+    uint16_t new_crc = CRC16((unsigned char *) buffer, FS_BLOCK_SIZE, 0);
 
     // Write CRC hash
     crc_buffer[index / 2] = new_crc;
-    if (bwrite(DEVICE_IMAGE, 3 + crc_block, (char *) crc_buffer) != 0) {
-        return -2;
+    crc_table_set(blockNumber, new_crc, 1);
+    int ret = fs_bwrite(DEVICE_IMAGE, CRC_START + crc_block, (char *) crc_buffer) != 0 ? -2 : 0;
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_BWRITE_CRC, start, FS_BLOCK_SIZE);
+    TRACE_END("bwrite_with_crc", ret);
+    return ret;
+}
+
+/* Writes count consecutive buffers to the given blocks in a single batch, then
+   updates each CRC block only once for all the blocks it covers.
+   Returns 0 on success and -1 for failed write and -2 for failed CRC */
+int bwrite_blocks_with_crc(char *deviceName, int *blockNumbers, char *buffers, int count) {
+    return bwrite_blocks_with_crcs(deviceName, blockNumbers, buffers, NULL, count);
+}
+
+/* Like bwrite_blocks_with_crc, storing the CRCs given in crcs for data that
+   is known to be unchanged, or computing them when it is NULL */
+int bwrite_blocks_with_crcs(char *deviceName, int *blockNumbers, char *buffers, uint16_t *crcs, int count) {
+    uint16_t crc_buffer[FS_BLOCK_SIZE / 2];
+    long loaded_crc = -1;
+    int ret = 0;
+    TRACE_BEGIN("bwrite_blocks_with_crc", count);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    for (int i = 0; i < count; i++) {
+        lazy_ensure(blockNumbers[i]);
     }
-    return 0;
+    if (count > 0 && fs_bwrite_blocks(deviceName, blockNumbers, buffers, count) != 0) {
+        pthread_mutex_unlock(&FS_LOCK);
+        TRACE_END("bwrite_blocks_with_crc", -1);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        char * buffer = buffers + (long) i * FS_BLOCK_SIZE;
+        // Locate CRC hash, flushing the previous CRC block when moving to another one
+        long crc_block = ((long) blockNumbers[i] * 2) / FS_BLOCK_SIZE;
+        long index = ((long) blockNumbers[i] * 2) % FS_BLOCK_SIZE;
+        if (crc_block != loaded_crc) {
+            if (loaded_crc != -1 && fs_bwrite(deviceName, CRC_START + loaded_crc, (char *) crc_buffer) != 0) {
+                pthread_mutex_unlock(&FS_LOCK);
+                TRACE_END("bwrite_blocks_with_crc", -2);
+                return -2;
+            }
+            lazy_ensure(CRC_START + crc_block);
+            fs_bread(deviceName, CRC_START + crc_block, (char *) crc_buffer);
+            loaded_crc = crc_block;
+        }
+        crc_buffer[index / 2] = crcs != NULL ? crcs[i] : CRC16((unsigned char *) buffer, FS_BLOCK_SIZE, 0);
+        // Carried CRCs may not match the data, which is checked when read
+        crc_table_set(blockNumbers[i], crc_buffer[index / 2], crcs == NULL);
+    }
+    if (loaded_crc != -1 && fs_bwrite(deviceName, CRC_START + loaded_crc, (char *) crc_buffer) != 0) {
+        ret = -2;
+    }
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_BWRITE_CRC, start, (long) count * FS_BLOCK_SIZE);
+    TRACE_END("bwrite_blocks_with_crc", ret);
+    return ret;
 }
 
-/* Returns 0 if data is ok, -1 if it is corrupt, -2 otherwise */
-int check_crc(int blockNumber) {
-    char data_buffer[BLOCK_SIZE];
-    int loaded_crc = -1;
-    uint16_t crc_buffer[BLOCK_SIZE / 2];
-    if (bread(DEVICE_IMAGE, blockNumber, data_buffer) == -1) {
-        return -2;   
+/* Reads the CRCs stored for count blocks, each CRC block once for every run
+   of blocks it covers. Returns 0 on success, -1 otherwise */
+int read_crcs(int *blockNumbers, uint16_t *crcs, int count) {
+    uint16_t crc_buffer[FS_BLOCK_SIZE / 2];
+    long loaded_crc = -1;
+    for (int i = 0; i < count; i++) {
+        long crc_block = ((long) blockNumbers[i] * 2) / FS_BLOCK_SIZE;
+        if (crc_block != loaded_crc) {
+            lazy_ensure(CRC_START + crc_block);
+            if (fs_bread(DEVICE_IMAGE, CRC_START + crc_block, (char *) crc_buffer) != 0) {
+                return -1;
+            }
+            loaded_crc = crc_block;
+        }
+        crcs[i] = crc_buffer[(((long) blockNumbers[i] * 2) % FS_BLOCK_SIZE) / 2];
     }
+    return 0;
+}
 
-    uint16_t new_crc = CRC16((unsigned char *) data_buffer, BLOCK_SIZE, 0);
+/* Looks for a copy of a block that matches its CRC among the copies kept by
+   the device, trying every copy of the CRC block too, and queues the rewrite of
+   the copies that do not match. Returns 0 if one matched, -1 otherwise */
+static int heal_block(int blockNumber) {
+    long crc_block = CRC_START + ((long) blockNumber * 2) / FS_BLOCK_SIZE;
+    long index = ((long) blockNumber * 2) % FS_BLOCK_SIZE / 2;
+    uint16_t crc_buffer[FS_BLOCK_SIZE / 2];
+    char good[FS_BLOCK_SIZE], copy[FS_BLOCK_SIZE];
+    int found = 0;
 
-    long crc_block = (blockNumber * 2)/ BLOCK_SIZE;
-    long index = (blockNumber * 2) % BLOCK_SIZE;
-    if (crc_block != loaded_crc) {
-        if (bread(DEVICE_IMAGE, 3 + crc_block, (char *) crc_buffer) == -1) {
-            return -2;    
+    pthread_mutex_lock(&FS_LOCK);
+    for (int c = 0; !found && fs_bread_replica(DEVICE_IMAGE, crc_block, c, (char *) crc_buffer) == 0; c++) {
+        for (int d = 0; !found && fs_bread_replica(DEVICE_IMAGE, blockNumber, d, good) == 0; d++) {
+            found = CRC16((unsigned char *) good, FS_BLOCK_SIZE, 0) == crc_buffer[index];
+        }
+    }
+    if (found) {
+        uint16_t good_crc = crc_buffer[index];
+        for (int d = 0; fs_bread_replica(DEVICE_IMAGE, blockNumber, d, copy) == 0; d++) {
+            if (memcmp(copy, good, FS_BLOCK_SIZE) != 0) {
+                fs_brepair(DEVICE_IMAGE, blockNumber, d, good);
+            }
+        }
+        // Only the entry of this block is known to be right in the CRC blocks
+        for (int c = 0; fs_bread_replica(DEVICE_IMAGE, crc_block, c, (char *) crc_buffer) == 0; c++) {
+            if (crc_buffer[index] != good_crc) {
+                crc_buffer[index] = good_crc;
+                fs_brepair(DEVICE_IMAGE, crc_block, c, (char *) crc_buffer);
+            }
         }
-        loaded_crc = crc_block;
     }
+    pthread_mutex_unlock(&FS_LOCK);
+    return found ? 0 : -1;
+}
+
+/* Returns 0 if data is ok, -1 if it is corrupt, -2 otherwise.
+   Every copy kept by the device is checked, not just the one reads would use */
+int check_crc(int blockNumber) {
+    char data_buffer[FS_BLOCK_SIZE];
+    uint16_t crc_buffer[FS_BLOCK_SIZE / 2];
+    long crc_block = ((long) blockNumber * 2)/ FS_BLOCK_SIZE;
+    long index = ((long) blockNumber * 2) % FS_BLOCK_SIZE;
 
+    TRACE_BEGIN("check_crc", blockNumber);
+    long start = stats_now();
+    pthread_mutex_lock(&FS_LOCK);
+    lazy_ensure(blockNumber);
+    lazy_ensure(CRC_START + crc_block);
+    if (fs_bread(DEVICE_IMAGE, CRC_START + crc_block, (char *) crc_buffer) == -1 ||
+            fs_bread_replica(DEVICE_IMAGE, blockNumber, 0, data_buffer) == -1) {
+        pthread_mutex_unlock(&FS_LOCK);
+        TRACE_END("check_crc", -2);
+        return -2;   
+    }
     uint16_t prev_crc = crc_buffer[index / 2];
+    int damaged = 0;
+    int replica = 0;
+    do {
+        damaged |= CRC16((unsigned char *) data_buffer, FS_BLOCK_SIZE, 0) != prev_crc;
+    } while (fs_bread_replica(DEVICE_IMAGE, blockNumber, ++replica, data_buffer) == 0);
+    pthread_mutex_unlock(&FS_LOCK);
+    stats_record(STAT_CHECK_CRC, start, FS_BLOCK_SIZE);
 
-    if (prev_crc != new_crc) {
+    // A damaged copy is fine as long as another one can take its place
+    if (damaged && heal_block(blockNumber) != 0) {
+        TRACE_END("check_crc", -1);
         return -1;    
     }
 
+    TRACE_END("check_crc", 0);
     return 0;
 
 }
+
+/* Loads the CRCs of the data region for FS_FLAG_VERIFY, with no block
+   verified yet. Returns 0 on success, -1 otherwise */
+int crc_table_load() {
+    long first = (long) DATA_BLOCK_START * 2 / FS_BLOCK_SIZE;
+    long last = ((long) DATA_BLOCK_START + MAX_DATA_BLOCKS - 1) * 2 / FS_BLOCK_SIZE;
+    long count = last - first + 1;
+    char * image = calloc(count, FS_BLOCK_SIZE);
+    char * loaded = malloc(count * FS_BLOCK_SIZE);
+    int * targets = malloc(count * sizeof(int));
+    CRC_TABLE = malloc(MAX_DATA_BLOCKS * sizeof(uint16_t));
+    VERIFIED = calloc(MAX_DATA_BLOCKS / 8 + 1, 1);
+    int ret = image != NULL && loaded != NULL && targets != NULL && CRC_TABLE != NULL && VERIFIED != NULL ? 0 : -1;
+
+    // CRC blocks of groups not initialized yet hold no CRC but zeros
+    int num_targets = 0;
+    for (long b = first; b <= last && ret == 0; b++) {
+        if (!lazy_pending(CRC_START + b)) {
+            targets[num_targets++] = CRC_START + b;
+        }
+    }
+    if (ret == 0 && num_targets > 0 && fs_bread_blocks(DEVICE_IMAGE, targets, loaded, num_targets) != 0) {
+        ret = -1;
+    }
+    for (long b = first, next = 0; b <= last && ret == 0; b++) {
+        if (next < num_targets && targets[next] == CRC_START + b) {
+            memcpy(image + (b - first) * FS_BLOCK_SIZE, loaded + next++ * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+        }
+    }
+    if (ret == 0) {
+        memcpy(CRC_TABLE, (uint16_t *) image + (DATA_BLOCK_START - first * FS_BLOCK_SIZE / 2),
+               MAX_DATA_BLOCKS * sizeof(uint16_t));
+    }
+    free(image);
+    free(loaded);
+    free(targets);
+    if (ret != 0) {
+        crc_table_drop();
+    }
+    return ret;
+}
+
+/* Forgets the CRCs loaded by crc_table_load */
+void crc_table_drop() {
+    free(CRC_TABLE);
+    free(VERIFIED);
+    CRC_TABLE = NULL;
+    VERIFIED = NULL;
+}
+
+/* Records the CRC just written for a block, which counts as verified when
+   it was computed from the data written */
+void crc_table_set(long blockNumber, uint16_t crc, int verified) {
+    long i = blockNumber - DATA_BLOCK_START;
+    if (CRC_TABLE != NULL && i >= 0 && i < MAX_DATA_BLOCKS) {
+        CRC_TABLE[i] = crc;
+        bitmap_setbit(VERIFIED, i, verified);
+    }
+}
+
+/* Checks count data blocks just read into buffers against the CRCs in
+   memory, skipping the ones verified before. A damaged block is replaced by
+   a good copy when the device keeps one, and checked again on its next read
+   until the copy is repaired. Returns 0 if every buffer is good, -1 otherwise */
+int verify_blocks(int *blockNumbers, char *buffers, int count) {
+    if (CRC_TABLE == NULL) {
+        return 0;
+    }
+    for (int k = 0; k < count; k++) {
+        long i = blockNumbers[k] - DATA_BLOCK_START;
+        char * buffer = buffers + (long) k * FS_BLOCK_SIZE;
+        int skipped = bitmap_getbit(VERIFIED, i) != 0;
+        stats_count_verify(skipped);
+        if (skipped) {
+            continue;
+        }
+        if (CRC16((unsigned char *) buffer, FS_BLOCK_SIZE, 0) == CRC_TABLE[i]) {
+            bitmap_setbit(VERIFIED, i, 1);
+            continue;
+        }
+        int found = 0;
+        for (int r = 0; !found && fs_bread_replica(DEVICE_IMAGE, blockNumbers[k], r, buffer) == 0; r++) {
+            found = CRC16((unsigned char *) buffer, FS_BLOCK_SIZE, 0) == CRC_TABLE[i];
+        }
+        if (!found) {
+            return -1;
+        }
+        heal_block(blockNumbers[k]);
+    }
+    return 0;
+}
@@ -0,0 +1,18 @@
+/*
+ * OPERATING SYSTEMS DESING - 16/17
+ *
+ * @file 	async.h
+ * @brief 	Worker pool serving the asynchronous file system calls.
+ * @date	01/03/2017
+ */
+
+#ifndef _ASYNC_H_
+#define _ASYNC_H_
+
+#define ASYNC_WORKERS 4 // Threads serving the queued requests
+
+/* Waits for every queued request to be served and stops the workers. The
+   next request starts them again */
+void async_stop(void);
+
+#endif
@@ -8,24 +8,286 @@
 
 /* Calculates how many files can fit in  given disk_size,
    and initializes the superblock with the corresponding values */
-void init_superblock(SuperBlock * sblock, long disk_size);
+void init_superblock(SuperBlock * sblock, long disk_size, int flags);
+
+/* Computes the position of every region of the disk from the superblock */
+void set_layout(SuperBlock * sblock);
+
+/* Zeroes a group of the metadata regions unless it was done before.
+   Returns 0 on success, -1 otherwise */
+int lazy_init_group(long group);
+
+/* Returns whether block belongs to a group that was not initialized yet */
+int lazy_pending(long block);
+
+/* Initializes the group of block, if any, before it is read or written */
+int lazy_ensure(long block);
+
+/* Starts initializing the pending groups in the background */
+void lazy_start();
+
+/* Waits for the background initialization to stop */
+void lazy_stop();
+
+/* Releases the data blocks and the inode of a removed file, discarding the
+   blocks from the device. Returns 0 on success, -1 if it was not removed */
+int reclaim_inode(long inode_index);
+
+/* Queues a removed file for the reclaimer */
+void reclaim_enqueue(long inode_index);
+
+/* Reclaims every queued file in the calling thread.
+   Returns the number of files whose space was released */
+long reclaim_all();
+
+/* Starts releasing the space of removed files in the background */
+void reclaim_start();
+
+/* Stops the reclaimer, reclaiming the queued files first if drain is set */
+void reclaim_stop(int drain);
+
+/* Starts the cleaner of a log-structured file system in the background */
+void clean_start();
+
+/* Wakes the cleaner up for a pass */
+void clean_wake();
+
+/* Stops the cleaner, waiting for the pass in progress to finish */
+void clean_stop();
+
+/* Runs a pass of the cleaner, emptying the segments of the log that are
+   less than half full. Returns the number of blocks moved, -1 in case of error */
+long clean_log();
+
+/* Orders block or inode indexes for qsort */
+int compare_blocks(const void * a, const void * b);
 
 /* Updates the inode allocation bitmap on the disk
    Returns the index of the first free inode block */
 int allocate_inode(); // Returns the index
 
+/* Allocates up to count inodes, rewriting each bitmap block once, and stores
+   their indexes in ascending order in inodes. Returns the number allocated */
+int allocate_inodes(int count, int * inodes);
+
+/* Releases count inodes given in ascending order, rewriting each bitmap block once */
+int free_inodes(int count, int * inodes);
+
 /* Updates the data block allocation bitmap on the disk
    Returns the index of the first free data block */
 int allocate_data_block(); // Returns the index
 
+/* Allocates count data blocks with a single bitmap update, storing their
+   indexes in blocks. Returns 0 on success, -1 if there is not enough space */
+int allocate_data_blocks(int count, int * blocks);
+
+/* Releases count data blocks with a single bitmap update */
+int free_data_blocks(int count, int * blocks);
+
+/* Like free_data_blocks, also discarding the blocks released from the
+   device when discard is set */
+int release_data_blocks(int count, int * blocks, int discard);
+
+/* Discards count unused data blocks from the device, one request for every
+   run of consecutive blocks */
+void discard_data_blocks(int count, int * blocks);
+
+/* Sets the allocation bit of count data blocks to value, rewriting each
+   bitmap block once for every run of blocks it covers */
+int update_data_bitmap(int count, int * blocks, int value);
+
+/* Returns the size class of a run of length free data blocks */
+int extent_class(long length);
+
+/* Counts the free inodes, the free data blocks and the runs these form by
+   scanning both bitmaps, and the runs of every size class in extent_sizes.
+   Returns 0 on success, -1 otherwise */
+int count_free_space(long * free_inodes, long * free_blocks, long * free_extents, long * extent_sizes);
+
+/* Counts the files by scanning the inode bitmap, leaving out the inodes of
+   removed files. Returns 0 on success, -1 otherwise */
+int count_files(long * num_files);
+
+/* Prepares a cursor over the block map of inode */
+void map_init(BlockMap * map, INode * inode);
+
+/* Returns the block map entry of a logical block, FS_HOLE if it is unmapped */
+long map_get(BlockMap * map, long logical);
+
+/* Sets the block map entry of a logical block, allocating the indirect blocks
+   needed to reach it. Returns 0 on success, -1 if there is no space left */
+int map_set(BlockMap * map, long logical, long value);
+
+/* Grows the block map to num_blocks entries, the new ones being holes */
+void map_extend(BlockMap * map, long num_blocks);
+
+/* Writes back the indirect blocks modified through the map */
+int map_flush(BlockMap * map);
+
+/* Calls visit for every data block and indirect block referenced by the block
+   map of inode, stopping at the first non-zero return value */
+int map_for_each_block(INode * inode, int (*visit)(int block, void * arg), void * arg);
+
+/* Releases every data block and indirect block of a file, discarding the
+   ones left unused from the device when discard is set */
+int release_file_blocks(INode * inode, int discard);
+
+/* Counts the data blocks of inode and the runs of consecutive blocks they form */
+void measure_layout(INode * inode, FileFragmentation * frag);
+
+/* Moves the data blocks of a file into a run of consecutive free blocks,
+   unless it needs more than budget blocks and budget is not negative.
+   Returns the number of blocks moved, -2 if over budget, -1 in case of error */
+long defrag_inode(long inode_index, long budget);
+
+/* Makes the block map of inode a copy sharing every data block with the
+   original, which gain one reference each. Returns 0 on success, -1 otherwise */
+int share_file_blocks(INode * inode);
+
+/* Writes numBytes at offset of a regular file through its block map.
+   Returns the number of bytes written, -1 in case of error */
+int write_blocks(BlockMap * map, long offset, char * buffer, int numBytes);
+
+/* Copies count whole blocks from block src_block of src to block dst_block of
+   the file behind dst, carrying the CRCs over.
+   Returns the number of blocks copied, -1 in case of error */
+long copy_blocks(INode * src, long src_block, BlockMap * dst, long dst_block, long count);
+
+/* Reads the reference counts of count data blocks into refcounts */
+int read_refcounts(int count, int * blocks, int * refcounts);
+
+/* Adds delta to the reference counts of count data blocks, storing the
+   resulting counts in refcounts unless it is NULL */
+int adjust_refcounts(int count, int * blocks, int delta, int * refcounts);
+
+/* Returns a data block whose content equals buffer, -1 if there is none */
+int dedup_lookup(char * buffer);
+
+/* Records in the content hash index that block holds the data in buffer */
+int dedup_insert(char * buffer, int block);
+
+/* Moves the data of an inline file into a regular data block.
+   Returns 0 on success, -1 if there is no space left */
+int promote_inline(INode * inode);
+
+/* Fills data with the CLUSTER_SIZE bytes of a cluster of a compressed file,
+   decompressing it if needed. Returns 0 on success, -1 otherwise */
+int read_cluster(BlockMap * map, long cluster, char * data);
+
+/* Compresses the first valid_bytes of data and stores them as the given cluster,
+   replacing its previous blocks. Returns 0 on success, -1 otherwise */
+int write_cluster(BlockMap * map, long cluster, char * data, long valid_bytes);
+
+/* Writes numBytes at offset of a compressed file, recompressing every cluster
+   it touches. Returns the number of bytes written, -1 in case of error */
+int write_compressed(BlockMap * map, long offset, char * buffer, int numBytes);
+
 /* Helper function to load the superblock. */
 SuperBlock load_superblock();
 
+/* Copies an inode out of the inode table. Returns 0 on success, -1 otherwise */
+int read_inode(long inode_index, INode * inode);
+
+/* Stores an inode in the inode table. Returns 0 on success, -1 otherwise */
+int write_inode(long inode_index, INode * inode);
+
+/* Stores count inodes whose indexes are given in ascending order, writing
+   every inode table block touched once. Returns 0 on success, -1 otherwise */
+int write_inodes(int count, int * indexes, INode * inodes);
+
+/* Returns the device block holding the latest copy of a block of the inode table */
+long inode_location(long table_block);
+
+/* Writes count blocks of the inode table, appending them to the log in
+   log-structured mode. Returns 0 on success, -1 otherwise */
+int store_inode_blocks(int count, int * table_blocks, char * tables);
+
+/* Reads count blocks of the inode table and stores them again.
+   Returns 0 on success, -1 otherwise */
+int relog_inode_blocks(int count, int * table_blocks);
+
+/* Loads the inode map of a log-structured file system.
+   Returns 0 on success, -1 otherwise */
+int imap_load();
+
+/* Writes the blocks of the inode map changed since the last call.
+   Returns 0 on success, -1 otherwise */
+int imap_flush();
+
+/* Forgets the inode map loaded by imap_load */
+void imap_drop();
+
+/* Writes the counters kept in memory while mounted to the superblock, and
+   the inode map blocks changed since the last time */
+int save_superblock();
+
 /* Returns index of file if it exists, -1 otherwise */
 int get_inode_index(SuperBlock * sblock, char * fileName);
 
+/* Forgets every cached directory node */
+void dir_cache_reset();
+
+/* Keeps the directory nodes written in the cache until dir_flush */
+void dir_defer();
+
+/* Writes every directory node modified since dir_defer in a single batch */
+int dir_flush();
+
+/* Returns the inode of name in the directory tree rooted at block, -1 if it is not there */
+int dir_search(long block, char * name);
+
+/* Returns the inode of a file, -1 if it does not exist */
+int dir_lookup(char * name);
+
+/* Adds name to the directory. Returns 0 on success, -1 if there is no space left */
+int dir_insert(char * name, int inode_index);
+
+/* Removes name from the directory. Returns 0 on success, -1 if it is not there */
+int dir_remove(char * name);
+
+/* Checks the integrity of every node of the directory tree rooted at block */
+int dir_check(long block);
+
+/* Device calls on file system blocks, each covering FS_DEVICE_BLOCKS device
+   blocks. With blocks of the device size they are the device calls */
+int fs_bread(char *deviceName, int blockNumber, char *buffer);
+int fs_bwrite(char *deviceName, int blockNumber, char *buffer);
+int fs_bread_blocks(char *deviceName, int *blockNumbers, char *buffers, int count);
+int fs_bwrite_blocks(char *deviceName, int *blockNumbers, char *buffers, int count);
+int fs_bread_replica(char *deviceName, int blockNumber, int replica, char *buffer);
+int fs_brepair(char *deviceName, int blockNumber, int replica, char *buffer);
+int fs_bdiscard(char *deviceName, int blockNumber, int count);
+
 /* Wrapper function that hashes every written block to check file integrity */
 int bwrite_with_crc(char *deviceName, int blockNumber, char *buffer);
 
+/* Writes count consecutive buffers to the given blocks, updating each CRC
+   block only once for all the blocks it covers */
+int bwrite_blocks_with_crc(char *deviceName, int *blockNumbers, char *buffers, int count);
+
+/* Like bwrite_blocks_with_crc, storing the CRCs given in crcs for data that
+   is known to be unchanged, or computing them when it is NULL */
+int bwrite_blocks_with_crcs(char *deviceName, int *blockNumbers, char *buffers, uint16_t *crcs, int count);
+
+/* Reads the CRCs stored for count blocks. Returns 0 on success, -1 otherwise */
+int read_crcs(int *blockNumbers, uint16_t *crcs, int count);
+
 /* Checks the integrity of the given block */
 int check_crc(int blockNumber);
+
+/* Loads the CRCs of the data region for FS_FLAG_VERIFY.
+   Returns 0 on success, -1 otherwise */
+int crc_table_load();
+
+/* Forgets the CRCs loaded by crc_table_load */
+void crc_table_drop();
+
+/* Records the CRC just written for a block, which counts as verified when
+   it was computed from the data written */
+void crc_table_set(long blockNumber, uint16_t crc, int verified);
+
+/* Checks count data blocks just read into buffers against their CRCs, unless
+   they were verified before, with FS_FLAG_VERIFY. Damaged blocks are replaced
+   by a good copy when the device keeps one.
+   Returns 0 if every buffer is good, -1 otherwise */
+int verify_blocks(int *blockNumbers, char *buffers, int count);
@@ -0,0 +1,97 @@
+/*
+ * OPERATING SYSTEMS DESING - 16/17
+ *
+ * @file 	backend.h
+ * @brief 	Block device backends behind bread and bwrite.
+ * @date	01/03/2017
+ */
+
+#ifndef _BACKEND_H_
+#define _BACKEND_H_
+
+/* A block device. Every operation transfers one BLOCK_SIZE block and returns
+   0 on success or -1 in case of error, including blocks past the end */
+typedef struct BlockBackend {
+    const char * name;
+    int (*read)(struct BlockBackend * self, int block, char * buffer);
+    int (*write)(struct BlockBackend * self, int block, char * buffer);
+    // Optional, NULL to loop over read and write: count blocks from or to consecutive buffers
+    int (*read_blocks)(struct BlockBackend * self, int * blocks, char * buffers, int count);
+    int (*write_blocks)(struct BlockBackend * self, int * blocks, char * buffers, int count);
+    // Optional, for backends keeping several copies: reads one copy, -1 past the last one,
+    // and queues rewriting one copy with buffer in the background
+    int (*read_replica)(struct BlockBackend * self, int block, int replica, char * buffer);
+    int (*repair)(struct BlockBackend * self, int block, int replica, char * buffer);
+    // Optional, NULL when the device cannot give space back: drops count blocks
+    // from block on, which read as zeros afterwards
+    int (*discard)(struct BlockBackend * self, int block, int count);
+    long (*num_blocks)(struct BlockBackend * self);
+    void (*close)(struct BlockBackend * self); // Releases the backend and everything it owns
+    void * state;
+} BlockBackend;
+
+/* Opens an existing image file, which stays open until the backend is closed.
+   Returns NULL if it cannot be opened */
+BlockBackend * backend_file_open(const char * path);
+
+/* Creates a zeroed device of num_blocks blocks held in memory */
+BlockBackend * backend_ram_create(long num_blocks);
+
+/* Creates an in-memory device with the contents of an image file.
+   Returns NULL if it cannot be read */
+BlockBackend * backend_ram_load(const char * path);
+
+/* Writes the contents of an in-memory device to an image file.
+   Returns 0 on success, -1 otherwise */
+int backend_ram_save(BlockBackend * ram, const char * path);
+
+/* Wraps inner, delaying every read and write by a fixed time plus a random
+   jitter, all in microseconds. Closing the wrapper also closes inner */
+BlockBackend * backend_latency_wrap(BlockBackend * inner, long read_us, long write_us, long jitter_us);
+
+/* Spreads blocks over num_members backends in chunks of stripe_blocks blocks,
+   RAID-0 style. Batches are split by member and served in parallel by one
+   worker thread per member. Closing the stripe also closes the members.
+   Returns NULL, leaving the members to the caller, if they cannot be used */
+BlockBackend * backend_stripe_create(BlockBackend ** members, int num_members, int stripe_blocks);
+
+/* Stripes the image files named by pattern, a printf format taking the member
+   number, such as "disk%d.dat" for disk0.dat to diskN.dat */
+BlockBackend * backend_stripe_open(const char * pattern, int num_members, int stripe_blocks);
+
+/* Keeps a copy of every block in each of num_members backends, RAID-1 style.
+   Writes go to every member in parallel and reads to the one with the fewest
+   blocks in flight. Closing the mirror also closes the members.
+   Returns NULL, leaving the members to the caller, if they cannot be used */
+BlockBackend * backend_mirror_create(BlockBackend ** members, int num_members);
+
+/* Mirrors the image files named by pattern, as backend_stripe_open does */
+BlockBackend * backend_mirror_open(const char * pattern, int num_members);
+
+/* Makes bread and bwrite use backend, or an image file named after their
+   deviceName argument when it is NULL. The caller keeps ownership */
+void backend_set(BlockBackend * backend);
+
+/* Returns the backend serving deviceName, NULL if there is none */
+BlockBackend * backend_get(const char * deviceName);
+
+/* Like bread and bwrite, for count blocks stored in consecutive buffers. The
+   backend may serve them in any order and in parallel.
+   Return 0 or -1 in case of error in any of the blocks */
+int bread_blocks(char * deviceName, int * blockNumbers, char * buffers, int count);
+int bwrite_blocks(char * deviceName, int * blockNumbers, char * buffers, int count);
+
+/* Reads one of the copies kept by the device, the only one being 0 for
+   devices without replicas. Returns 0 or -1 in case of error or past the last copy */
+int bread_replica(char * deviceName, int blockNumber, int replica, char * buffer);
+
+/* Queues rewriting one copy of a block with buffer, in the background.
+   Returns 0 or -1 in case of error or when the device keeps no copies */
+int brepair(char * deviceName, int blockNumber, int replica, char * buffer);
+
+/* Tells the device that count blocks from blockNumber on are no longer used,
+   so that it can release the space they take. They read as zeros afterwards.
+   Returns 0 or -1 in case of error or when the device cannot discard blocks */
+int bdiscard(char * deviceName, int blockNumber, int count);
+
+#endif
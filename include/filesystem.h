@@ -12,13 +12,70 @@
 #define _USER_H_
 
 #include "blocks_cache.h"	// Headers for block managing (read/write)
+#include "stats.h"		// FSStats, filled by fsStats
+#include "backend.h"		// BlockBackend, chosen with fsSetBackend
 
 #define DEVICE_IMAGE "disk.dat"		// Device name
-#define MAX_FILE_SIZE 1048576       // Maximum file size, in bytes
+#define MAX_FILE_SIZE (1L << 38)     // Maximum file size, in bytes (reachable by the indirect block map)
+
+/* File system blocks are made of FS_DEVICE_BLOCKS consecutive device blocks.
+   Each library is built for one size: libfs.a for the device block size,
+   libfs_4k.a, libfs_16k.a and libfs_64k.a for larger blocks. An image only
+   mounts with a library of the size it was formatted with */
+#ifndef FS_BLOCK_SIZE
+#define FS_BLOCK_SIZE BLOCK_SIZE
+#endif
+#if FS_BLOCK_SIZE % BLOCK_SIZE != 0
+#error "FS_BLOCK_SIZE must be a multiple of BLOCK_SIZE"
+#endif
+#define FS_DEVICE_BLOCKS (FS_BLOCK_SIZE / BLOCK_SIZE)
 #define FS_SEEK_CUR 0
 #define FS_SEEK_END 1
 #define FS_SEEK_BEGIN 2
 
+#define FS_FLAG_LOG 0x1             // Log-structured layout: data and inodes are appended at the log tail
+#define FS_FLAG_DEDUP 0x2           // Identical data blocks are stored once and shared
+#define FS_FLAG_LAZY_INIT 0x4       // Metadata regions are zeroed on first use instead of by mkFS
+#define FS_FLAG_VERIFY 0x8          // Data blocks are checked against their CRC when read
+
+/* Free extents are counted by size class: class c holds the runs of 2^c to
+   2^(c+1) - 1 blocks, and the last class every run from 2^(FS_EXTENT_CLASSES - 1) up */
+#define FS_EXTENT_CLASSES 8
+
+/* Layout of the data blocks of a file, filled by fragmentationFile */
+typedef struct FileFragmentation {
+    long num_blocks;                // Data blocks, not counting holes and indirect blocks
+    long num_extents;               // Runs of consecutive data blocks
+    double fragmentation;           // 0 when contiguous, 1 when no two blocks are consecutive
+} FileFragmentation;
+
+/* Handle of a call queued with readFileAsync, writeFileAsync or checkFileAsync */
+typedef struct FSRequest FSRequest;
+
+/* Called from a worker thread once a request is served, with the value the
+   synchronous call returned. The request is released later with waitRequest */
+typedef void (*FSCallback)(FSRequest *request, long result, void *arg);
+
+/* Capacity and free space of the file system, filled by statFS */
+typedef struct FSUsage {
+    long block_size;
+    long total_inodes;
+    long free_inodes;               // Inodes of removed files count once they are reclaimed
+    long num_files;
+    long total_blocks;              // Data blocks
+    long free_blocks;
+    long free_extents;              // Runs of consecutive free data blocks
+    long free_extent_sizes[FS_EXTENT_CLASSES]; // Runs of every size class
+} FSUsage;
+
+
+/*
+ * @brief 	Generates the proper file system structure in a storage device, using the
+ * 		layout options given in flags (FS_FLAG_*).
+ * @return 	0 if success, -1 otherwise.
+ */
+int mkFSWithFlags(long deviceSize, int flags);
+
 
 /*
  * @brief 	Generates the proper file system structure in a storage device, as designed by the student.
@@ -26,7 +83,8 @@
  */
 int mkFS(long deviceSize);
 /*
- * @brief 	Mounts a file system in the simulated device.
+ * @brief 	Mounts a file system in the simulated device. Images formatted with a block
+ * 		size other than FS_BLOCK_SIZE are refused.
  * @return 	0 if success, -1 otherwise.
  */
 int mountFS(void);
@@ -44,11 +102,35 @@ int unmountFS(void);
 int createFile(char *fileName);
 
 /*
- * @brief	Deletes a file, provided it exists in the file system.
+ * @brief	Deletes a file, provided it exists in the file system. Its space is given back
+ * 		in the background, or right away by reclaimFS.
  * @return	0 if success, -1 if the file does not exist, -2 in case of error..
  */
 int removeFile(char *fileName);
 
+/*
+ * @brief	Creates several files at once, storing in results[i] what createFile would
+ * 		return for fileNames[i]. The directory, the inode bitmap and the inode table
+ * 		are updated once for the whole batch.
+ * @return	Number of files created, -2 in case of error.
+ */
+int createFiles(char **fileNames, int count, int *results);
+
+/*
+ * @brief	Deletes several files at once, storing in results[i] what removeFile would
+ * 		return for fileNames[i]. The directory and the inode table are updated once
+ * 		for the whole batch.
+ * @return	Number of files removed, -2 in case of error.
+ */
+int removeFiles(char **fileNames, int count, int *results);
+
+/*
+ * @brief	Creates dstName as a copy of srcName that shares its data blocks. Each
+ * 		block is copied only when one of the files writes it.
+ * @return	0 if success, -1 if srcName does not exist or dstName already exists, -2 in case of error.
+ */
+int cloneFile(char *srcName, char *dstName);
+
 /*
  * @brief	Opens an existing file.
  * @return	The file descriptor if possible, -1 if file does not exist, -2 in case of error..
@@ -79,6 +161,15 @@ int writeFile(int fileDescriptor, void *buffer, int numBytes);
  */
 int lseekFile(int fileDescriptor, long offset, int whence);
 
+/*
+ * @brief	Copies len bytes at srcOff of the file open as srcFd to dstOff of the file open
+ * 		as dstFd, inside the file system. Neither descriptor moves. Blocks copied
+ * 		unchanged keep the CRC they had.
+ * @return	Number of bytes copied, which is less than len at the end of the source,
+ * 		-1 in case of error or if the ranges overlap in the same file.
+ */
+long copyFileRange(int srcFd, long srcOff, int dstFd, long dstOff, long len);
+
 /*
  * @brief 	Verifies the integrity of the file system metadata.
  * @return 	0 if the file system is correct, -1 if the file system is corrupted, -2 in case of error.
@@ -91,4 +182,118 @@ int checkFS(void);
  */
 int checkFile(char *fileName);
 
+/*
+ * @brief	Enables or disables transparent compression of a file. It can only be changed
+ * 		while the file has no data blocks (it is empty or stored inline).
+ * @return	0 if success, -1 if the file does not exist or already has data blocks, -2 in case of error.
+ */
+int setFileCompression(char *fileName, int enabled);
+
+/*
+ * @brief	Fills frag with the layout of the data blocks of a file.
+ * @return	0 if success, -1 if the file does not exist, -2 in case of error.
+ */
+int fragmentationFile(char *fileName, FileFragmentation *frag);
+
+/*
+ * @brief	Moves the data blocks of a file into a run of consecutive free blocks.
+ * 		Blocks shared with other files stay where they are.
+ * @return	Number of blocks moved, -1 if the file does not exist, -2 in case of error.
+ */
+long defragFile(char *fileName);
+
+/*
+ * @brief	Runs one step of the defragmentation of every file, moving at most
+ * 		maxBlocks blocks unless the first file needs more, or no limit if it is 0.
+ * 		Each call resumes where the previous one stopped.
+ * @return	Number of blocks moved, 0 once no file can be improved, -2 in case of error.
+ */
+long defragFS(long maxBlocks);
+
+/*
+ * @brief	Releases the space of every removed file now, instead of waiting for the
+ * 		background reclaimer.
+ * @return	0 if success, -1 if no file system is mounted.
+ */
+int reclaimFS(void);
+
+/*
+ * @brief	Runs the segment cleaner of a log-structured file system now, instead of
+ * 		waiting for the log tail to wrap around: the blocks in use of every segment
+ * 		that is less than half full are moved to the log tail.
+ * @return	Number of blocks moved, -1 if no log-structured file system is mounted,
+ * 		-2 in case of error.
+ */
+long cleanFS(void);
+
+/*
+ * @brief	Fills usage with the capacity and free space of the mounted file system,
+ * 		without reading the device.
+ * @return	0 if success, -1 if no file system is mounted.
+ */
+int statFS(FSUsage *usage);
+
+/*
+ * @brief	Queues a readFile call on a worker thread, calling callback, unless it is
+ * 		NULL, once it is served. Requests on the same descriptor are served in
+ * 		submission order.
+ * @return	The request, NULL in case of error.
+ */
+FSRequest * readFileAsync(int fileDescriptor, void *buffer, int numBytes, FSCallback callback, void *arg);
+
+/*
+ * @brief	Queues a writeFile call on a worker thread, as readFileAsync does.
+ * @return	The request, NULL in case of error.
+ */
+FSRequest * writeFileAsync(int fileDescriptor, void *buffer, int numBytes, FSCallback callback, void *arg);
+
+/*
+ * @brief	Queues a checkFile call on a worker thread, as readFileAsync does.
+ * @return	The request, NULL in case of error.
+ */
+FSRequest * checkFileAsync(char *fileName, FSCallback callback, void *arg);
+
+/*
+ * @brief	Tells whether a request was served, without waiting, storing its result
+ * 		in result unless it is NULL.
+ * @return	1 if it was served, 0 if it is still pending.
+ */
+int pollRequest(FSRequest *request, long *result);
+
+/*
+ * @brief	Waits for a request to be served and releases it. Every request must be
+ * 		released this way, after its callback if it has one. unmountFS and mkFS
+ * 		wait for the pending requests.
+ * @return	The value returned by the synchronous call.
+ */
+long waitRequest(FSRequest *request);
+
+/*
+ * @brief	Fills stats with the counters of every public call and block layer primitive
+ * 		since the last fsStatsReset, merged over all the threads.
+ * @return	0 if success, -1 otherwise.
+ */
+int fsStats(FSStats *stats);
+
+/*
+ * @brief	Restarts the counters reported by fsStats from zero.
+ * @return	0 if success, -1 otherwise.
+ */
+int fsStatsReset(void);
+
+/*
+ * @brief	Writes the trace events recorded by every thread to path, in the Chrome trace
+ * 		format. Tracing is only available when the library is built with FS_TRACE.
+ * @return	0 if success, -1 otherwise.
+ */
+int fsTraceDump(char *path);
+
+/*
+ * @brief	Chooses the device used by the following mkFS and mountFS calls, instead of
+ * 		the DEVICE_IMAGE file. NULL goes back to DEVICE_IMAGE. The backend is still
+ * 		owned by the caller and cannot be changed while a file system is mounted.
+ * @return	0 if success, -1 otherwise.
+ */
+int fsSetBackend(BlockBackend *backend);
+
 #endif
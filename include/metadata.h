@@ -7,6 +7,8 @@
  */
 
 #include "blocks_cache.h"
+#include "filesystem.h"
+#include <stdint.h>
 #define MAX_FILENAME 32 
 
 #define bitmap_getbit(bitmap_, i_) (bitmap_[i_ >> 3] & (1 << (i_ & 0x07)))
@@ -17,30 +19,156 @@ static inline void bitmap_setbit(char *bitmap_, int i_, int val_) {
     bitmap_[(i_ >> 3)] &= ~(1 << (i_ & 0x07));
 }
 
-/* Maps a filename to its INode */
+/* Maps a filename to its INode. Names of MAX_FILENAME characters are not
+   null-terminated */
 typedef struct filename { 
     char name[MAX_FILENAME]; 
-    long index;
+    int32_t index;
 } filename_t;
 
+#define SUPERBLOCK_FIELDS (20 + FS_EXTENT_CLASSES)
+
 /* Contains information about the structure of the disk */
 typedef struct SuperBlock {
     long num_crc_blocks; // The number of blocks to be used for CRC hashes
     long num_inodes_in_use; // The number of files that are stored on this disk
     long max_inodes; // The maximum number of files that can be stored on this disk
     long max_data_blocks; // The maximum amount of data blocks that are available
-
-    /* A mapping of a filename to its index in the INode blocks */
-    filename_t filenames[(BLOCK_SIZE - 2 * sizeof(long)) / MAX_FILENAME];  
+    long flags; // Options chosen at mkFS time (FS_FLAG_*)
+    long log_tail; // Next data block to try when appending in log-structured mode
+    long num_refcount_blocks; // Blocks holding the reference count of every data block
+    long num_dedup_blocks; // Blocks of the content hash index used for deduplication
+    long num_imap_blocks; // Blocks of the inode map, only in log-structured mode
+    long num_inode_bitmap_blocks; // Blocks of the inode allocation bitmap
+    long num_data_bitmap_blocks; // Blocks of the data block allocation bitmap
+    long dir_root; // Data block of the root node of the directory, -1 if there are no files
+    long num_lazy_groups; // Groups the CRC, inode, reference count and hash index regions are split in
+    long lazy_group_blocks; // Blocks of every group
+    long free_inodes; // Inodes not allocated, updated on every allocation and release
+    long free_data_blocks; // Data blocks not allocated
+    long free_extents; // Runs of consecutive free data blocks
+    long free_extent_sizes[FS_EXTENT_CLASSES]; // Runs of every size class
+    long free_hint; // Every data block before it is allocated
+    long block_size; // Bytes per block the image was formatted with, which must be FS_BLOCK_SIZE to mount it
+    long mounted; // Set from mountFS to unmountFS: found set at mount, the image was not unmounted
+    char uninit_groups[FS_BLOCK_SIZE - SUPERBLOCK_FIELDS * sizeof(long)]; // Bitmap of the groups not written yet
 } SuperBlock;
 
-/* Keeps track of the locations of the data blocks associated with this file */
+/* With lazy initialization the metadata regions between the CRC region and
+   the data blocks are zeroed one group at a time, on first use or in the
+   background, instead of by mkFS */
+#define LAZY_MAX_GROUPS (sizeof(((SuperBlock *) 0)->uninit_groups) * 8)
+#define LAZY_MIN_GROUP_BLOCKS (FS_BLOCK_SIZE < 16384 ? 16384 / FS_BLOCK_SIZE : 1) // At least 16 KiB
+
+/* The directory is a B-tree of minimum degree DIR_MIN_DEGREE ordered by
+   filename. Every node takes one data block */
+#define DIR_MIN_DEGREE 25
+#define DIR_MAX_KEYS (2 * DIR_MIN_DEGREE - 1)
+#define DIR_CACHE_SIZE 64 // Directory nodes kept in memory
+
+typedef struct DirNode {
+    int32_t leaf;
+    int32_t num_keys;
+    filename_t keys[DIR_MAX_KEYS];
+    int32_t children[DIR_MAX_KEYS + 1]; // Data blocks of the subtrees, unused in leaves
+    char padding[FS_BLOCK_SIZE - 2 * sizeof(int32_t) - DIR_MAX_KEYS * sizeof(filename_t)
+                 - (DIR_MAX_KEYS + 1) * sizeof(int32_t)];
+} DirNode;
+
+#define BITS_PER_BLOCK (FS_BLOCK_SIZE * 8) // Entries of an allocation bitmap block
+#define INODE_RATIO 32 // Device blocks per inode
+
+#define FS_HOLE -1 // Block map entry of a block that was never written
+#define INODE_SIZE 256 // Bytes of an inode on disk
+#define INODES_PER_BLOCK (FS_BLOCK_SIZE / INODE_SIZE)
+#define INODE_HEADER_SIZE (sizeof(int64_t) + 2 * sizeof(int32_t))
+#define INODE_INDIRECT_LEVELS 3 // Single, double and triple indirect blocks
+#define INODE_DIRECT_BLOCKS ((INODE_SIZE - INODE_HEADER_SIZE) / sizeof(int32_t) - INODE_INDIRECT_LEVELS)
+#define INODE_INLINE_SIZE (INODE_SIZE - INODE_HEADER_SIZE) // Largest file stored inside its inode
+#define MAP_ENTRIES_PER_BLOCK (FS_BLOCK_SIZE / sizeof(int32_t)) // Block map entries of an indirect block
+
+#define INODE_INLINE 0x1 // The file data lives in the inode block instead of data blocks
+#define INODE_COMPRESSED 0x2 // The file data is stored as zlib-compressed clusters
+#define INODE_ORPHAN 0x4 // Removed from the directory, its blocks are not released yet
+
+/* Compressed files group their block map in clusters of CLUSTER_BLOCKS entries.
+   A compressed cluster uses its first entries for the compressed stream and its
+   last entry stores the stream length (encoded as a value below FS_HOLE); a
+   cluster that does not compress is stored raw, one block per entry */
+#define CLUSTER_BLOCKS 4
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * FS_BLOCK_SIZE)
+#define CLUSTER_LENGTH_TO_ENTRY(len_) (-2 - (long) (len_))
+#define CLUSTER_ENTRY_TO_LENGTH(entry_) (-2 - (entry_))
+
+/* Keeps track of the locations of the data blocks associated with this file.
+   It takes INODE_SIZE bytes on disk, so INODES_PER_BLOCK inodes share every
+   block of the inode table. The first entries of the block map live in the
+   inode; the rest are reached through a tree of indirect blocks, each one
+   holding MAP_ENTRIES_PER_BLOCK entries */
 typedef struct INode {
-    long size;
-    long num_blocks;
-    long blocks[BLOCK_SIZE - 2 * sizeof(long)];
+    int64_t size;
+    int32_t num_blocks; // Length of the block map, holes included
+    int32_t flags; // INODE_* attributes
+    union {
+        struct {
+            int32_t blocks[INODE_DIRECT_BLOCKS]; // Direct block map entries
+            int32_t indirect[INODE_INDIRECT_LEVELS]; // Roots of the indirect trees, FS_HOLE if absent
+        };
+        char inline_data[INODE_INLINE_SIZE]; // Used instead of the block map by INODE_INLINE files
+    };
 } INode;
 
+/* Caches the indirect blocks visited while walking the block map of a file,
+   one per depth of the tree. Modified blocks are written back when they are
+   replaced or when the map is flushed */
+typedef struct BlockMap {
+    INode * inode;
+    long loaded[INODE_INDIRECT_LEVELS]; // Data block cached at each depth, -1 if none
+    int dirty[INODE_INDIRECT_LEVELS];
+    int32_t entries[INODE_INDIRECT_LEVELS][MAP_ENTRIES_PER_BLOCK];
+} BlockMap;
+
+/* Number of files sharing each data block, used when blocks can be shared */
+typedef uint16_t refcount_t;
+#define REFCOUNTS_PER_BLOCK (FS_BLOCK_SIZE / sizeof(refcount_t))
+#define MAX_REFCOUNT UINT16_MAX
+
+/* Entry of the on-disk content hash index. Blocks are found by their CRC16
+   and CRC32 and confirmed with a byte comparison, so entries are only hints:
+   stale ones are harmless and get overwritten */
+typedef struct DedupEntry {
+    uint32_t hash;
+    uint16_t crc;
+    uint16_t used;
+    int32_t block;
+} DedupEntry;
+#define DEDUP_ENTRIES_PER_BLOCK (FS_BLOCK_SIZE / sizeof(DedupEntry))
+
+/* Block of the hash index. The entries do not fill it, so it is read and
+   written as a whole through raw */
+typedef union DedupBlock {
+    DedupEntry entries[DEDUP_ENTRIES_PER_BLOCK];
+    char raw[FS_BLOCK_SIZE];
+} DedupBlock;
+
+/* In log-structured mode the inode table blocks are appended to the log as
+   well, and the inode map tells where the latest copy of each one is: its
+   data block plus one, 0 while it is still in the inode table */
+#define IMAP_ENTRIES_PER_BLOCK (FS_BLOCK_SIZE / sizeof(int32_t))
+
+/* The cleaner splits the log in segments of LOG_SEGMENT_BLOCKS data blocks
+   and empties those with fewer than LOG_CLEAN_THRESHOLD blocks in use */
+#define LOG_SEGMENT_BLOCKS 64
+#define LOG_CLEAN_THRESHOLD (LOG_SEGMENT_BLOCKS / 2)
+
+/* Removed file waiting in the queue of the reclaimer */
+typedef struct ReclaimEntry {
+    long inode;
+    struct ReclaimEntry * next;
+} ReclaimEntry;
+
+#define MAX_NUMBER_OF_FILES 10 // Entries of the open file table
+
 /* Contains in-memory data to process a file */
 typedef struct OFT_Entry {
     int fd;
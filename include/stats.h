@@ -0,0 +1,94 @@
+/*
+ * OPERATING SYSTEMS DESING - 16/17
+ *
+ * @file 	stats.h
+ * @brief 	Runtime statistics of the file system calls and of the block layer.
+ * @date	01/03/2017
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#define STATS_HISTOGRAM_BUCKETS 32 // Bucket i counts latencies in [2^i, 2^(i+1)) nanoseconds
+
+/* Operations with their own counters: the public calls first, then the
+   block layer primitives */
+typedef enum StatOp {
+    STAT_MKFS,
+    STAT_MOUNT,
+    STAT_UNMOUNT,
+    STAT_CREATE,
+    STAT_REMOVE,
+    STAT_OPEN,
+    STAT_CLOSE,
+    STAT_READ,
+    STAT_WRITE,
+    STAT_LSEEK,
+    STAT_CHECKFS,
+    STAT_CHECKFILE,
+    STAT_CLONE,
+    STAT_DEFRAG, // Both defragFile and defragFS
+    STAT_RECLAIM,
+    STAT_COPY,
+    STAT_SET_COMPRESSION,
+    STAT_FRAGMENTATION,
+    STAT_CREATE_BATCH, // createFiles, once per batch
+    STAT_REMOVE_BATCH,
+    STAT_CLEAN,
+    STAT_BREAD,
+    STAT_BWRITE,
+    STAT_BWRITE_CRC, // Also counts the batched writes, once per batch
+    STAT_CHECK_CRC,
+    STAT_BREAD_BLOCKS, // Batches of bread_blocks, once per batch
+    STAT_BWRITE_BLOCKS,
+    STAT_DISCARD, // Ranges given back to the device, bytes discarded
+    NUM_STAT_OPS
+} StatOp;
+
+typedef struct OpStats {
+    long calls;
+    long bytes; // File bytes for readFile and writeFile, device bytes for the primitives
+    long total_ns;
+    long histogram[STATS_HISTOGRAM_BUCKETS];
+} OpStats;
+
+typedef struct FSStats {
+    OpStats ops[NUM_STAT_OPS];
+    long metadata_reads; // Device blocks read before the data region
+    long metadata_writes;
+    long data_reads; // Device blocks read from the data region
+    long data_writes;
+    long dir_cache_hits; // Directory nodes found in memory
+    long dir_cache_misses;
+    long verify_checks; // Data blocks checked against their CRC when read, with FS_FLAG_VERIFY
+    long verify_skips; // Data blocks read that were verified before
+} FSStats;
+
+/* Printable name of every StatOp */
+extern const char * STAT_OP_NAMES[NUM_STAT_OPS];
+
+/* Returns a monotonic timestamp, in nanoseconds, to be passed to stats_record */
+long stats_now(void);
+
+/* Counts a call to op that started at start and moved bytes */
+void stats_record(StatOp op, long start, long bytes);
+
+/* Counts a device block read or write, classified by the region of block */
+void stats_count_io(int block, int is_write);
+
+/* Sets the first block of the data region, -1 if there is no file system */
+void stats_set_data_start(long block);
+
+/* Counts a lookup of the directory node cache */
+void stats_count_dir_cache(int hit);
+
+/* Counts a data block read with FS_FLAG_VERIFY, skipped if it was verified before */
+void stats_count_verify(int skipped);
+
+/* Merges the counters of every thread since the last stats_reset */
+void stats_collect(FSStats * stats);
+
+/* Makes the following stats_collect calls count from now on */
+void stats_reset(void);
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * OPERATING SYSTEMS DESING - 16/17
+ *
+ * @file 	trace.h
+ * @brief 	Tracepoints of the file system calls and of the block layer.
+ * @date	01/03/2017
+ *
+ * Tracepoints are only compiled in when FS_TRACE is defined (make TRACE=1).
+ * Otherwise they expand to nothing.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#define TRACE_RING_SIZE 65536 // Events kept per thread, the oldest are overwritten
+
+#ifdef FS_TRACE
+#define TRACE_BEGIN(name_, arg_) trace_event(name_, 'B', arg_)
+#define TRACE_END(name_, arg_) trace_event(name_, 'E', arg_)
+#else
+#define TRACE_BEGIN(name_, arg_) ((void) 0)
+#define TRACE_END(name_, arg_) ((void) 0)
+#endif
+
+/* Appends an event to the ring buffer of the calling thread. phase is 'B'
+   when the operation starts and 'E' when it ends; name must be a literal */
+void trace_event(const char * name, char phase, long arg);
+
+/* Writes the events of every thread to path in the Chrome trace format.
+   Returns 0 on success, -1 otherwise */
+int trace_dump(const char * path);
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ * OPERATING SYSTEMS DESING - 16/17
+ *
+ * @file 	stats.c
+ * @brief 	Runtime statistics of the file system calls and of the block layer.
+ * @date	01/03/2017
+ */
+
+#include "include/stats.h"		// Headers for the statistics
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+const char * STAT_OP_NAMES[NUM_STAT_OPS] = {
+    "mkFS", "mountFS", "unmountFS", "createFile", "removeFile", "openFile", "closeFile",
+    "readFile", "writeFile", "lseekFile", "checkFS", "checkFile", "cloneFile",
+    "defrag", "reclaimFS", "copyFileRange", "setFileCompression", "fragmentationFile",
+    "createFiles", "removeFiles", "cleanFS",
+    "bread", "bwrite", "bwrite_with_crc", "check_crc",
+    "bread_blocks", "bwrite_blocks", "bdiscard"
+};
+
+/* Every thread updates its own copy of the counters without locking.
+   Copies are linked on first use and merged when they are read */
+typedef struct StatsShard {
+    FSStats stats;
+    struct StatsShard * next;
+} StatsShard;
+
+static __thread StatsShard * LOCAL_SHARD = NULL;
+static StatsShard * SHARDS = NULL;
+static pthread_mutex_t SHARDS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static FSStats BASELINE; // Totals at the last reset, subtracted from the merged counters
+static long DATA_START = -1;
+
+static FSStats * local_stats(void)
+{
+    if (LOCAL_SHARD == NULL) {
+        StatsShard * shard = calloc(1, sizeof(StatsShard));
+        if (shard == NULL) {
+            return NULL;
+        }
+        pthread_mutex_lock(&SHARDS_LOCK);
+        shard->next = SHARDS;
+        SHARDS = shard;
+        pthread_mutex_unlock(&SHARDS_LOCK);
+        LOCAL_SHARD = shard;
+    }
+    return &LOCAL_SHARD->stats;
+}
+
+/* Only the owner thread writes a counter, so a relaxed load and store is
+   enough and lets other threads read it while it changes */
+static inline void bump(long * counter, long value)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+/* Returns a monotonic timestamp, in nanoseconds, to be passed to stats_record */
+long stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Counts a call to op that started at start and moved bytes */
+void stats_record(StatOp op, long start, long bytes)
+{
+    FSStats * stats = local_stats();
+    if (stats == NULL) {
+        return;
+    }
+    long elapsed = stats_now() - start;
+    int bucket = elapsed > 0 ? 63 - __builtin_clzl(elapsed) : 0;
+    if (bucket >= STATS_HISTOGRAM_BUCKETS) {
+        bucket = STATS_HISTOGRAM_BUCKETS - 1;
+    }
+    OpStats * op_stats = &stats->ops[op];
+    bump(&op_stats->calls, 1);
+    bump(&op_stats->bytes, bytes);
+    bump(&op_stats->total_ns, elapsed);
+    bump(&op_stats->histogram[bucket], 1);
+}
+
+/* Counts a device block read or write, classified by the region of block */
+void stats_count_io(int block, int is_write)
+{
+    FSStats * stats = local_stats();
+    if (stats == NULL) {
+        return;
+    }
+    long data_start = __atomic_load_n(&DATA_START, __ATOMIC_RELAXED);
+    int is_data = data_start != -1 && block >= data_start;
+    if (is_write) {
+        bump(is_data ? &stats->data_writes : &stats->metadata_writes, 1);
+    } else {
+        bump(is_data ? &stats->data_reads : &stats->metadata_reads, 1);
+    }
+}
+
+/* Sets the first block of the data region, -1 if there is no file system */
+void stats_set_data_start(long block)
+{
+    __atomic_store_n(&DATA_START, block, __ATOMIC_RELAXED);
+}
+
+/* Counts a lookup of the directory node cache */
+void stats_count_dir_cache(int hit)
+{
+    FSStats * stats = local_stats();
+    if (stats != NULL) {
+        bump(hit ? &stats->dir_cache_hits : &stats->dir_cache_misses, 1);
+    }
+}
+
+/* Counts a data block read with FS_FLAG_VERIFY, skipped if it was verified before */
+void stats_count_verify(int skipped)
+{
+    FSStats * stats = local_stats();
+    if (stats != NULL) {
+        bump(skipped ? &stats->verify_skips : &stats->verify_checks, 1);
+    }
+}
+
+/* Adds (sign 1) or subtracts (sign -1) every counter of from to to */
+static void merge(FSStats * to, FSStats * from, int sign)
+{
+    long * dst = (long *) to;
+    long * src = (long *) from;
+    for (size_t i = 0; i < sizeof(FSStats) / sizeof(long); i++) {
+        dst[i] += sign * __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+static void collect_totals(FSStats * stats)
+{
+    memset(stats, 0, sizeof(FSStats));
+    pthread_mutex_lock(&SHARDS_LOCK);
+    for (StatsShard * shard = SHARDS; shard != NULL; shard = shard->next) {
+        merge(stats, &shard->stats, 1);
+    }
+    pthread_mutex_unlock(&SHARDS_LOCK);
+}
+
+/* Merges the counters of every thread since the last stats_reset */
+void stats_collect(FSStats * stats)
+{
+    collect_totals(stats);
+    pthread_mutex_lock(&SHARDS_LOCK);
+    merge(stats, &BASELINE, -1);
+    pthread_mutex_unlock(&SHARDS_LOCK);
+}
+
+/* Makes the following stats_collect calls count from now on */
+void stats_reset(void)
+{
+    FSStats totals;
+    collect_totals(&totals);
+    pthread_mutex_lock(&SHARDS_LOCK);
+    BASELINE = totals;
+    pthread_mutex_unlock(&SHARDS_LOCK);
+}
@@ -9,9 +9,12 @@
 #include <stdio.h>
 #include <string.h>
 #include "include/metadata.h"
-#include "include/auxiliary.h"
 #include "include/filesystem.h"
+#include "include/auxiliary.h"
 #include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 // Color definitions for asserts
 #define ANSI_COLOR_RESET   "\x1b[0m"
@@ -19,8 +22,9 @@
 #define ANSI_COLOR_GREEN   "\x1b[32m"
 #define ANSI_COLOR_BLUE   "\x1b[34m"
 
-#define N_BLOCKS	2055                    // Number of blocks in the device
-#define DEV_SIZE 	N_BLOCKS * BLOCK_SIZE	// Device size, in bytes
+#define N_BLOCKS	2055                    // Number of file system blocks in the device
+#define DEVICE_BLOCKS	(N_BLOCKS * FS_DEVICE_BLOCKS)	// The same, in device blocks
+#define DEV_SIZE 	N_BLOCKS * FS_BLOCK_SIZE	// Device size, in bytes
 
 #define TEST_FILE "paella.jpg"
 
@@ -36,6 +40,29 @@ int test_checkFS();
 int realtest(char * in_file);
 
 int test_interleave();
+int test_log_write();
+int test_log_clean();
+int test_sparse();
+int test_inline();
+int test_compression();
+int test_dedup();
+int test_indirect();
+int test_directory();
+int test_lazy_init();
+int test_stats();
+int test_trace();
+int test_backends();
+int test_stripe();
+int test_mirror();
+int test_clone();
+int test_defrag();
+int test_reclaim();
+int test_statfs();
+int test_async();
+int test_copy();
+int test_batch();
+int test_verify();
+int test_block_size();
 
 int main() {
 	int ret;
@@ -149,6 +176,200 @@ int main() {
 	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST checkFS ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
 
 
+   //////// 
+
+   ret = test_log_write();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST log write ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST log write ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+
+   //////// 
+
+   ret = test_log_clean();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST log cleaner ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST log cleaner ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+
+   //////// 
+
+   ret = test_sparse();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST sparse ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST sparse ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+
+   //////// 
+
+   ret = test_inline();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST inline ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST inline ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+
+   //////// 
+
+   ret = test_compression();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST compression ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST compression ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+
+   //////// 
+
+   ret = test_dedup();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST dedup ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST dedup ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+
+   //////// 
+
+   ret = test_indirect();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST indirect ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST indirect ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+
+   //////// 
+
+   ret = test_directory();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST directory ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST directory ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+
+   //////// 
+
+   ret = test_lazy_init();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST lazy init ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST lazy init ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+
+   //////// 
+
+   ret = test_stats();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST stats ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST stats ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+
+   //////// 
+
+   ret = test_trace();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST trace ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST trace ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+   ret = test_backends();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST backends ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST backends ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+   ret = test_stripe();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST stripe ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST stripe ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+   ret = test_mirror();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST mirror ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST mirror ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+   ret = test_clone();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST clone ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST clone ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+   ret = test_defrag();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST defrag ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST defrag ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+   ret = test_reclaim();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST reclaim ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST reclaim ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+   ret = test_statfs();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST statFS ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST statFS ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+   ret = test_async();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST async ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST async ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+   ret = test_copy();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST copy ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST copy ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+   ret = test_batch();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST batch ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST batch ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+   ret = test_verify();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST verify ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST verify ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+   ret = test_block_size();
+	if(ret != 0) {
+		fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST block size ", ANSI_COLOR_RED, "FAILED\n", ANSI_COLOR_RESET);
+		return -1;
+	}
+	fprintf(stdout, "%s%s%s%s%s", ANSI_COLOR_BLUE, "TEST block size ", ANSI_COLOR_GREEN, "SUCCESS\n", ANSI_COLOR_RESET);
+
+
    //////// 
  
 
@@ -160,18 +381,18 @@ int test_mkFS() {
     if (mkFS(DEV_SIZE) != 0) {
         return -1;
     }
-    char buffer[BLOCK_SIZE] = {0};
-    bread(DEVICE_IMAGE, 0, buffer);
+    char buffer[FS_BLOCK_SIZE] = {0};
+    fs_bread(DEVICE_IMAGE, 0, buffer);
    
     SuperBlock sblock = *(SuperBlock *) buffer;
     
-    long necessary_space = sblock.max_inodes * (MAX_FILE_SIZE / BLOCK_SIZE);
-    //printf("necessary_space = %ld\n", necessary_space);
-    if (sblock.max_data_blocks < necessary_space) {
+    // Files no longer reserve MAX_FILE_SIZE each: most of the disk must be data blocks
+    if (sblock.max_data_blocks < (DEV_SIZE / FS_BLOCK_SIZE) * 9 / 10) {
         return -1;
     }
 
-    if (sblock.max_data_blocks + sblock.max_inodes + 3 > (DEV_SIZE / BLOCK_SIZE)) {
+    long inode_blocks = (sblock.max_inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+    if (sblock.max_data_blocks + inode_blocks + sblock.num_crc_blocks + 3 > (DEV_SIZE / FS_BLOCK_SIZE)) {
         return -1;
     }
     //printf("num_inodes: %ld \n", sblock.num_inodes);
@@ -179,9 +400,9 @@ int test_mkFS() {
 
     // Check that the allocation blocks are all 0
     for (int i = 1; i <= 2; i++) {
-        bread(DEVICE_IMAGE, i, buffer);
-        char buffer2[BLOCK_SIZE] = {0};
-        if (memcmp(buffer, buffer2, BLOCK_SIZE) != 0) {
+        fs_bread(DEVICE_IMAGE, i, buffer);
+        char buffer2[FS_BLOCK_SIZE] = {0};
+        if (memcmp(buffer, buffer2, FS_BLOCK_SIZE) != 0) {
             return -1;
         }
     }
@@ -209,8 +430,8 @@ int test_createFile() {
     SuperBlock sblock = load_superblock();
     int inode_index = get_inode_index(&sblock, "test.txt");
 
-    char bitmap[BLOCK_SIZE];
-    bread(DEVICE_IMAGE, 1, bitmap);
+    char bitmap[FS_BLOCK_SIZE];
+    fs_bread(DEVICE_IMAGE, 1, bitmap);
 
     // Check that this inode has been correctly allocated
     if (bitmap_getbit(bitmap, inode_index) == 0) {
@@ -231,8 +452,8 @@ int test_removeFile() {
     SuperBlock sblock = load_superblock();
     int inode_index = get_inode_index(&sblock, "test.txt");
 
-    char bitmap[BLOCK_SIZE];
-    bread(DEVICE_IMAGE, 1, bitmap);
+    char bitmap[FS_BLOCK_SIZE];
+    fs_bread(DEVICE_IMAGE, 1, bitmap);
     if (bitmap_getbit(bitmap, inode_index) == 0) {
         return -1;    
     }
@@ -240,7 +461,9 @@ int test_removeFile() {
     if (ret != 0) {
         return -1;
     }
-    bread(DEVICE_IMAGE, 1, bitmap);
+    // The inode is released in the background
+    reclaimFS();
+    fs_bread(DEVICE_IMAGE, 1, bitmap);
     if (bitmap_getbit(bitmap, inode_index) == 1) {
         return -1;
     }
@@ -292,36 +515,36 @@ int test_big_write() {
     if (fd == -1) {
         return -1;    
     }
-    char buffer[2 * BLOCK_SIZE];
-    for (int i = 0; i < 2 * BLOCK_SIZE / 12; i++) {
+    char buffer[2 * FS_BLOCK_SIZE];
+    for (int i = 0; i < 2 * FS_BLOCK_SIZE / 12; i++) {
         strcpy(&buffer[i * 12], "Hello world");    
     }
-    int ret = writeFile(fd, buffer, 2 * BLOCK_SIZE);
+    int ret = writeFile(fd, buffer, 2 * FS_BLOCK_SIZE);
     if (ret < 0) {
         return -1;    
     }
     
     lseekFile(fd, 0, FS_SEEK_BEGIN);
-    char buffer2[2 * BLOCK_SIZE];
-    ret = readFile(fd, buffer2, 2 * BLOCK_SIZE);
+    char buffer2[2 * FS_BLOCK_SIZE];
+    ret = readFile(fd, buffer2, 2 * FS_BLOCK_SIZE);
     if (ret < 0) {
         return -1;    
     }
     closeFile(fd);
     int i;
-    for (i = 0; i < BLOCK_SIZE * 2; i++) {
+    for (i = 0; i < FS_BLOCK_SIZE * 2; i++) {
         if (buffer[i] != buffer2[i]) {
             break;       
         }
     }
-    if (i != 2 * BLOCK_SIZE) {
+    if (i != 2 * FS_BLOCK_SIZE) {
         buffer[i + 10] = '\0';
         buffer2[i + 10] = '\0';
         printf("At index %d: %s != %s\n", i, &buffer[i], &buffer2[i]);
         return -1;
     }
 
-    ret = memcmp(buffer, buffer2, 2 * BLOCK_SIZE);
+    ret = memcmp(buffer, buffer2, 2 * FS_BLOCK_SIZE);
     if (ret != 0) {
         return -1;    
     }
@@ -379,19 +602,19 @@ int test_interleave() {
     int fd1 = openFile("F1");
     int fd2 = openFile("F2");
 
-    char buff1[BLOCK_SIZE];
-    memset(buff1, 'a', BLOCK_SIZE);
+    char buff1[FS_BLOCK_SIZE];
+    memset(buff1, 'a', FS_BLOCK_SIZE);
 
-    char buff2[BLOCK_SIZE];
-    memset(buff2, 'b', BLOCK_SIZE);
+    char buff2[FS_BLOCK_SIZE];
+    memset(buff2, 'b', FS_BLOCK_SIZE);
 
-    writeFile(fd1, buff1, BLOCK_SIZE);
+    writeFile(fd1, buff1, FS_BLOCK_SIZE);
 
 
-    writeFile(fd2, buff2, BLOCK_SIZE);
-    memset(buff1, 'a', BLOCK_SIZE);
-    writeFile(fd1, buff1, BLOCK_SIZE);
-    writeFile(fd2, buff2, BLOCK_SIZE);
+    writeFile(fd2, buff2, FS_BLOCK_SIZE);
+    memset(buff1, 'a', FS_BLOCK_SIZE);
+    writeFile(fd1, buff1, FS_BLOCK_SIZE);
+    writeFile(fd2, buff2, FS_BLOCK_SIZE);
     closeFile(fd1);
     closeFile(fd2);
 
@@ -400,11 +623,1328 @@ int test_interleave() {
 
     int fd3 = openFile("F3");
 
-    char buff3[BLOCK_SIZE];
-    memset(buff3, 'c', BLOCK_SIZE);
+    char buff3[FS_BLOCK_SIZE];
+    memset(buff3, 'c', FS_BLOCK_SIZE);
     
-    writeFile(fd3, buff3, BLOCK_SIZE);
+    writeFile(fd3, buff3, FS_BLOCK_SIZE);
 
     closeFile(fd3);
     return 0;
 }
+
+/* Counts the data blocks in use */
+int count_used_blocks() {
+    char bitmap[FS_BLOCK_SIZE];
+    fs_bread(DEVICE_IMAGE, 2, bitmap);
+    int used = 0;
+    for (int i = 0; i < FS_BLOCK_SIZE * 8; i++) {
+        if (bitmap_getbit(bitmap, i)) {
+            used++;
+        }
+    }
+    return used;
+}
+
+/* Reformats the disk in log-structured mode: overwrites must move the block,
+   and the inode table block after it, to the log tail */
+int test_log_write() {
+    unmountFS();
+    if (mkFSWithFlags(DEV_SIZE, FS_FLAG_LOG) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    createFile("log.txt");
+    int fd = openFile("log.txt");
+    char buffer[FS_BLOCK_SIZE];
+    memset(buffer, 'a', FS_BLOCK_SIZE);
+    writeFile(fd, buffer, FS_BLOCK_SIZE);
+
+    SuperBlock sblock = load_superblock();
+    int inode_index = get_inode_index(&sblock, "log.txt");
+    INode inode;
+    read_inode(inode_index, &inode);
+    long first_location = inode.blocks[0];
+    long first_inode_location = inode_location(inode_index / INODES_PER_BLOCK);
+
+    // Overwrite part of the block
+    lseekFile(fd, 10, FS_SEEK_BEGIN);
+    writeFile(fd, "bbbb", 4);
+    read_inode(inode_index, &inode);
+    if (inode.blocks[0] == first_location || inode.size != FS_BLOCK_SIZE) {
+        return -1;
+    }
+    // The inode is logged right after the data, the inode map finds it
+    long inode_location_now = inode_location(inode_index / INODES_PER_BLOCK);
+    if (inode_location_now == first_inode_location ||
+            inode_location_now - inode.blocks[0] != first_inode_location - first_location) {
+        return -1;
+    }
+
+    char buffer2[FS_BLOCK_SIZE];
+    memcpy(&buffer[10], "bbbb", 4);
+    lseekFile(fd, 0, FS_SEEK_BEGIN);
+    if (readFile(fd, buffer2, FS_BLOCK_SIZE) != FS_BLOCK_SIZE || memcmp(buffer, buffer2, FS_BLOCK_SIZE) != 0) {
+        return -1;
+    }
+    closeFile(fd);
+    if (checkFile("log.txt") != 0) {
+        return -1;
+    }
+    // The inode map is saved with the superblock
+    if (unmountFS() != 0 || mountFS() != 0 || inode_location(inode_index / INODES_PER_BLOCK) != inode_location_now ||
+            read_inode(inode_index, &inode) != 0 || inode.size != FS_BLOCK_SIZE || checkFS() != 0) {
+        return -1;
+    }
+    return unmountFS();
+}
+
+/* Two files written in turns leave the log full of holes once one is removed:
+   the cleaner must move the other to the log tail, leaving fewer free extents */
+int test_log_clean() {
+    if (mkFSWithFlags(DEV_SIZE, FS_FLAG_LOG) != 0 || mountFS() != 0 || cleanFS() != 0) {
+        return -1;
+    }
+    char buffer[FS_BLOCK_SIZE];
+    createFile("kept.dat");
+    createFile("gone.dat");
+    int fds[2] = {openFile("kept.dat"), openFile("gone.dat")};
+    for (int b = 0; b < 80; b++) {
+        memset(buffer, 'a' + b % 26, FS_BLOCK_SIZE);
+        writeFile(fds[b % 2], buffer, FS_BLOCK_SIZE);
+    }
+    closeFile(fds[1]);
+    removeFile("gone.dat");
+    reclaimFS();
+
+    FSUsage before, after;
+    statFS(&before);
+    long moved = cleanFS();
+    statFS(&after);
+    if (moved <= 0 || after.free_blocks != before.free_blocks || after.free_extents >= before.free_extents) {
+        return -1;
+    }
+    lseekFile(fds[0], 0, FS_SEEK_BEGIN);
+    for (int b = 0; b < 80; b += 2) {
+        memset(buffer, 0, FS_BLOCK_SIZE);
+        if (readFile(fds[0], buffer, FS_BLOCK_SIZE) != FS_BLOCK_SIZE || buffer[0] != 'a' + b % 26 ||
+                buffer[FS_BLOCK_SIZE - 1] != 'a' + b % 26) {
+            return -1;
+        }
+    }
+    closeFile(fds[0]);
+    if (checkFile("kept.dat") != 0 || checkFS() != 0 || unmountFS() != 0 || mountFS() != 0 ||
+            checkFile("kept.dat") != 0 || checkFS() != 0) {
+        return -1;
+    }
+    return unmountFS();
+}
+
+/* Writing past EOF must only allocate the touched block and read the gap back as zeros */
+int test_sparse() {
+    if (mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    createFile("sparse.txt");
+    int fd = openFile("sparse.txt");
+    lseekFile(fd, 5 * FS_BLOCK_SIZE + 100, FS_SEEK_BEGIN);
+    if (writeFile(fd, "tail", 4) != 4) {
+        return -1;
+    }
+
+    // Only one data block may be in use, besides the directory root
+    if (count_used_blocks() != 2) {
+        return -1;
+    }
+
+    char buffer[5 * FS_BLOCK_SIZE + 104];
+    lseekFile(fd, 0, FS_SEEK_BEGIN);
+    if (readFile(fd, buffer, sizeof(buffer)) != sizeof(buffer)) {
+        return -1;
+    }
+    for (int i = 0; i < 5 * FS_BLOCK_SIZE + 100; i++) {
+        if (buffer[i] != 0) {
+            return -1;
+        }
+    }
+    if (memcmp(&buffer[5 * FS_BLOCK_SIZE + 100], "tail", 4) != 0) {
+        return -1;
+    }
+    closeFile(fd);
+    if (checkFile("sparse.txt") != 0 || removeFile("sparse.txt") != 0) {
+        return -1;
+    }
+    return unmountFS();
+}
+
+/* Small files must live in the inode and be promoted when they grow */
+int test_inline() {
+    if (mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    createFile("small.txt");
+    int fd = openFile("small.txt");
+    char buffer[2 * FS_BLOCK_SIZE];
+    for (int i = 0; i < 2 * FS_BLOCK_SIZE; i++) {
+        buffer[i] = 'a' + i % 26;
+    }
+    if (writeFile(fd, buffer, 200) != 200) {
+        return -1;
+    }
+
+    SuperBlock sblock = load_superblock();
+    int inode_index = get_inode_index(&sblock, "small.txt");
+    INode inode;
+    read_inode(inode_index, &inode);
+    if (!(inode.flags & INODE_INLINE) || inode.num_blocks != 0) {
+        return -1;
+    }
+    if (checkFile("small.txt") != 0) {
+        return -1;
+    }
+
+    // Grow past the inline capacity
+    if (writeFile(fd, buffer + 200, 2 * FS_BLOCK_SIZE - 200) != 2 * FS_BLOCK_SIZE - 200) {
+        return -1;
+    }
+    read_inode(inode_index, &inode);
+    if ((inode.flags & INODE_INLINE) || inode.num_blocks != 2) {
+        return -1;
+    }
+    char buffer2[2 * FS_BLOCK_SIZE];
+    lseekFile(fd, 0, FS_SEEK_BEGIN);
+    if (readFile(fd, buffer2, 2 * FS_BLOCK_SIZE) != 2 * FS_BLOCK_SIZE || memcmp(buffer, buffer2, 2 * FS_BLOCK_SIZE) != 0) {
+        return -1;
+    }
+    closeFile(fd);
+    if (checkFile("small.txt") != 0) {
+        return -1;
+    }
+    return unmountFS();
+}
+
+/* Compressible data must take fewer blocks and read back unchanged, also after a partial overwrite */
+int test_compression() {
+    if (mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    createFile("log.gz");
+    if (setFileCompression("log.gz", 1) != 0) {
+        return -1;
+    }
+    int fd = openFile("log.gz");
+    int size = 16 * FS_BLOCK_SIZE;
+    char * buffer = malloc(size);
+    char * buffer2 = malloc(size);
+    for (int i = 0; i < size; i++) {
+        buffer[i] = "Hello world "[i % 12];
+    }
+    if (writeFile(fd, buffer, size) != size) {
+        return -1;
+    }
+
+    if (count_used_blocks() >= size / FS_BLOCK_SIZE) {
+        return -1;
+    }
+
+    // Overwrite a range that straddles two clusters
+    lseekFile(fd, CLUSTER_SIZE - 10, FS_SEEK_BEGIN);
+    writeFile(fd, "0123456789abcdefghij", 20);
+    memcpy(buffer + CLUSTER_SIZE - 10, "0123456789abcdefghij", 20);
+
+    lseekFile(fd, 0, FS_SEEK_BEGIN);
+    if (readFile(fd, buffer2, size) != size || memcmp(buffer, buffer2, size) != 0) {
+        return -1;
+    }
+    lseekFile(fd, 3 * CLUSTER_SIZE + 5, FS_SEEK_BEGIN);
+    if (readFile(fd, buffer2, 100) != 100 || memcmp(buffer + 3 * CLUSTER_SIZE + 5, buffer2, 100) != 0) {
+        return -1;
+    }
+    closeFile(fd);
+    free(buffer);
+    free(buffer2);
+    if (checkFile("log.gz") != 0 || setFileCompression("log.gz", 0) != -1) {
+        return -1;
+    }
+    return unmountFS();
+}
+
+/* Identical blocks must be stored once and survive the removal of one of their owners */
+int test_dedup() {
+    if (mkFSWithFlags(DEV_SIZE, FS_FLAG_DEDUP) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    char buffer[4 * FS_BLOCK_SIZE];
+    char buffer2[4 * FS_BLOCK_SIZE];
+    memset(buffer, 'x', 2 * FS_BLOCK_SIZE);
+    memset(buffer + 2 * FS_BLOCK_SIZE, 'y', 2 * FS_BLOCK_SIZE);
+    createFile("A");
+    createFile("B");
+    int fd1 = openFile("A");
+    int fd2 = openFile("B");
+    writeFile(fd1, buffer, 4 * FS_BLOCK_SIZE);
+    writeFile(fd2, buffer, 4 * FS_BLOCK_SIZE);
+    // Within a call identical blocks may still be written twice, across calls never.
+    // One more block holds the directory
+    if (count_used_blocks() > 5) {
+        return -1;
+    }
+    // Overwriting a shared block must not change the other copies
+    lseekFile(fd2, 0, FS_SEEK_BEGIN);
+    writeFile(fd2, "zzzz", 4);
+    lseekFile(fd1, 0, FS_SEEK_BEGIN);
+    if (readFile(fd1, buffer2, 4 * FS_BLOCK_SIZE) != 4 * FS_BLOCK_SIZE || memcmp(buffer, buffer2, 4 * FS_BLOCK_SIZE) != 0) {
+        return -1;
+    }
+    closeFile(fd1);
+    if (removeFile("A") != 0) {
+        return -1;
+    }
+    memcpy(buffer, "zzzz", 4);
+    lseekFile(fd2, 0, FS_SEEK_BEGIN);
+    if (readFile(fd2, buffer2, 4 * FS_BLOCK_SIZE) != 4 * FS_BLOCK_SIZE || memcmp(buffer, buffer2, 4 * FS_BLOCK_SIZE) != 0) {
+        return -1;
+    }
+    if (checkFile("B") != 0) {
+        return -1;
+    }
+    closeFile(fd2);
+    if (removeFile("B") != 0 || reclaimFS() != 0 || count_used_blocks() != 0) {
+        return -1;
+    }
+    return unmountFS();
+}
+
+/* Files larger than 1 MiB and far sparse offsets must go through the indirect blocks */
+int test_indirect() {
+    if (mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    createFile("big.dat");
+    int fd = openFile("big.dat");
+    int size = 3 * 512 * 1024;
+    char * buffer = malloc(size);
+    char * buffer2 = malloc(size);
+    for (int i = 0; i < size; i++) {
+        buffer[i] = i % 251;
+    }
+    if (writeFile(fd, buffer, size) != size) {
+        return -1;
+    }
+    // Far enough to need the double indirect tree
+    long far = 300L * 1024 * 1024;
+    if (lseekFile(fd, (1L << 33) + 1, FS_SEEK_BEGIN) != 0 || lseekFile(fd, far, FS_SEEK_BEGIN) != 0 ||
+            writeFile(fd, buffer, FS_BLOCK_SIZE) != FS_BLOCK_SIZE) {
+        return -1;
+    }
+
+    lseekFile(fd, 0, FS_SEEK_BEGIN);
+    if (readFile(fd, buffer2, size) != size || memcmp(buffer, buffer2, size) != 0) {
+        return -1;
+    }
+    lseekFile(fd, far, FS_SEEK_BEGIN);
+    if (readFile(fd, buffer2, size) != FS_BLOCK_SIZE || memcmp(buffer, buffer2, FS_BLOCK_SIZE) != 0) {
+        return -1;
+    }
+
+    // With a single free block left, a write that also needs an indirect block must fail and change nothing
+    FSUsage usage;
+    createFile("fill.dat");
+    int fill = openFile("fill.dat");
+    while (statFS(&usage) == 0 && usage.free_blocks > 1 && writeFile(fill, buffer, FS_BLOCK_SIZE) == FS_BLOCK_SIZE) {
+    }
+    closeFile(fill);
+    long free_blocks = usage.free_blocks;
+    lseekFile(fd, far + 2L * MAP_ENTRIES_PER_BLOCK * FS_BLOCK_SIZE, FS_SEEK_BEGIN);
+    if (free_blocks != 1 || writeFile(fd, buffer, FS_BLOCK_SIZE) != -1 ||
+        statFS(&usage) != 0 || usage.free_blocks != free_blocks || checkFS() != 0) {
+        return -1;
+    }
+    if (removeFile("fill.dat") != 0) {
+        return -1;
+    }
+    closeFile(fd);
+    free(buffer);
+    free(buffer2);
+    if (checkFile("big.dat") != 0 || removeFile("big.dat") != 0 || reclaimFS() != 0 || count_used_blocks() != 0) {
+        return -1;
+    }
+    return unmountFS();
+}
+
+/* Filling the inodes must split the directory root and emptying it must free every node */
+int test_directory() {
+    if (mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    SuperBlock sblock = load_superblock();
+    char name[MAX_FILENAME + 1];
+    for (int i = 0; i < sblock.max_inodes; i++) {
+        sprintf(name, "file%ld", (i * 37) % sblock.max_inodes);
+        if (createFile(name) != 0) {
+            return -1;
+        }
+    }
+    if (createFile("one.too.many") == 0 || createFile("file5") != -1) {
+        return -1;
+    }
+    // More names than fit in a node, so the tree has a root and two leaves at least
+    if (sblock.max_inodes > DIR_MAX_KEYS && count_used_blocks() < 3) {
+        return -1;
+    }
+    for (int i = 0; i < sblock.max_inodes; i++) {
+        sprintf(name, "file%d", i);
+        int fd = openFile(name);
+        if (fd < 0 || closeFile(fd) != 0) {
+            return -1;
+        }
+    }
+    if (checkFS() != 0) {
+        return -1;
+    }
+    // Remaining names must survive a remount
+    for (int i = 0; i < sblock.max_inodes; i += 2) {
+        sprintf(name, "file%d", i);
+        if (removeFile(name) != 0) {
+            return -1;
+        }
+    }
+    if (unmountFS() != 0 || mountFS() != 0) {
+        return -1;
+    }
+    for (int i = 0; i < sblock.max_inodes; i++) {
+        sprintf(name, "file%d", i);
+        if (removeFile(name) != (i % 2 == 0 ? -1 : 0)) {
+            return -1;
+        }
+    }
+    if (count_used_blocks() != 0 || load_superblock().dir_root != -1 || checkFS() != 0) {
+        return -1;
+    }
+    return unmountFS();
+}
+
+/* A lazily formatted disk must leave the last inode table blocks untouched until they are used */
+int test_lazy_init() {
+    if (mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    // Leave garbage in the last inode table block, as create_disk would
+    char buffer[FS_BLOCK_SIZE];
+    memset(buffer, '0', FS_BLOCK_SIZE);
+    SuperBlock sblock = load_superblock();
+    long last_inode_block = 3 + sblock.num_crc_blocks + (sblock.max_inodes - 1) / INODES_PER_BLOCK;
+    fs_bwrite(DEVICE_IMAGE, last_inode_block, buffer);
+    unmountFS();
+
+    if (mkFSWithFlags(DEV_SIZE, FS_FLAG_LAZY_INIT) != 0) {
+        return -1;
+    }
+    sblock = load_superblock();
+    long last_group = sblock.num_lazy_groups - 1;
+    if (last_group < 1 || !bitmap_getbit(sblock.uninit_groups, last_group)) {
+        return -1;
+    }
+    char buffer2[FS_BLOCK_SIZE];
+    fs_bread(DEVICE_IMAGE, last_inode_block, buffer2);
+    if (memcmp(buffer, buffer2, FS_BLOCK_SIZE) != 0) {
+        return -1;
+    }
+
+    // Using every inode initializes every group, whether the background thread got there first or not
+    if (mountFS() != 0) {
+        return -1;
+    }
+    char name[MAX_FILENAME + 1];
+    for (int i = 0; i < sblock.max_inodes; i++) {
+        sprintf(name, "lazy%d", i);
+        if (createFile(name) != 0) {
+            return -1;
+        }
+    }
+    if (checkFS() != 0 || unmountFS() != 0) {
+        return -1;
+    }
+    sblock = load_superblock();
+    for (int i = 0; i < sblock.num_lazy_groups; i++) {
+        if (bitmap_getbit(sblock.uninit_groups, i)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Reads a few blocks from another thread, whose counters must be merged too */
+void * read_superblocks(void * arg) {
+    char buffer[FS_BLOCK_SIZE];
+    for (int i = 0; i < 5; i++) {
+        fs_bread(DEVICE_IMAGE, 0, buffer);
+    }
+    return NULL;
+}
+
+/* Counters must account for every call, split device I/O by region and fill the histograms */
+int test_stats() {
+    if (mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    createFile("stats.txt");
+    int fd = openFile("stats.txt");
+    char buffer[3 * FS_BLOCK_SIZE];
+    memset(buffer, 's', sizeof(buffer));
+
+    fsStatsReset();
+    if (writeFile(fd, buffer, sizeof(buffer)) != sizeof(buffer)) {
+        return -1;
+    }
+    pthread_t thread;
+    pthread_create(&thread, NULL, read_superblocks, NULL);
+    pthread_join(thread, NULL);
+
+    FSStats stats;
+    fsStats(&stats);
+    OpStats * write = &stats.ops[STAT_WRITE];
+    if (write->calls != 1 || write->bytes != sizeof(buffer) || stats.ops[STAT_READ].calls != 0) {
+        return -1;
+    }
+    long samples = 0;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        samples += write->histogram[i];
+    }
+    if (samples != 1 || write->total_ns <= 0) {
+        return -1;
+    }
+    // The file data takes three data blocks, written through the CRC layer
+    if (stats.data_writes < 3 || stats.metadata_writes < 1 || stats.ops[STAT_BWRITE_CRC].bytes < sizeof(buffer)) {
+        return -1;
+    }
+    // Batched blocks count as device I/O too
+    long blocks_written = stats.ops[STAT_BWRITE].calls + stats.ops[STAT_BWRITE_BLOCKS].bytes / BLOCK_SIZE;
+    long blocks_read = stats.ops[STAT_BREAD].calls + stats.ops[STAT_BREAD_BLOCKS].bytes / BLOCK_SIZE;
+    if (blocks_written != stats.data_writes + stats.metadata_writes) {
+        return -1;
+    }
+    if (blocks_read != stats.data_reads + stats.metadata_reads || stats.metadata_reads < 5) {
+        return -1;
+    }
+    closeFile(fd);
+    return unmountFS();
+}
+
+/* With tracing compiled in, the dump must hold the API call and the block writes under it */
+int test_trace() {
+#ifdef FS_TRACE
+    if (mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    createFile("trace.txt");
+    int fd = openFile("trace.txt");
+    char buffer[FS_BLOCK_SIZE] = {0};
+    writeFile(fd, buffer, FS_BLOCK_SIZE);
+    closeFile(fd);
+    if (fsTraceDump("trace.json") != 0) {
+        return -1;
+    }
+    FILE * file = fopen("trace.json", "r");
+    char * dump = calloc(1, 1 << 24);
+    fread(dump, 1, (1 << 24) - 1, file);
+    fclose(file);
+    int found = strstr(dump, "\"name\": \"writeFile\", \"cat\": \"fs\", \"ph\": \"E\"") != NULL &&
+                strstr(dump, "\"name\": \"bwrite_blocks_with_crc\"") != NULL;
+    free(dump);
+    remove("trace.json");
+    if (!found) {
+        return -1;
+    }
+    return unmountFS();
+#else
+    // Without tracepoints there is nothing to dump
+    return fsTraceDump("trace.json") == -1 ? 0 : -1;
+#endif
+}
+
+/* A RAM disk must hold a file system that survives being saved to an image and
+   loaded again, also behind the latency wrapper */
+int test_backends() {
+    char data[3 * FS_BLOCK_SIZE], buffer[3 * FS_BLOCK_SIZE];
+    for (int i = 0; i < sizeof(data); i++) {
+        data[i] = i % 251;
+    }
+
+    BlockBackend * ram = backend_ram_create(DEVICE_BLOCKS);
+    if (ram == NULL || fsSetBackend(ram) != 0 || mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    createFile("ram.txt");
+    int fd = openFile("ram.txt");
+    if (writeFile(fd, data, sizeof(data)) != sizeof(data)) {
+        return -1;
+    }
+    closeFile(fd);
+    // Past the end of the device, and no other device while mounted
+    if (fs_bread(DEVICE_IMAGE, N_BLOCKS, buffer) != -1 || fsSetBackend(NULL) != -1) {
+        return -1;
+    }
+    unmountFS();
+    if (backend_ram_save(ram, "ram.dat") != 0) {
+        return -1;
+    }
+    fsSetBackend(NULL);
+    ram->close(ram);
+
+    // 200us per read plus up to 100us of jitter
+    BlockBackend * slow = backend_latency_wrap(backend_ram_load("ram.dat"), 200, 0, 100);
+    remove("ram.dat");
+    if (slow == NULL || slow->num_blocks(slow) != DEVICE_BLOCKS || fsSetBackend(slow) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    fsStatsReset();
+    fd = openFile("ram.txt");
+    int ret = readFile(fd, buffer, sizeof(buffer)) == sizeof(buffer) && memcmp(data, buffer, sizeof(data)) == 0 ? 0 : -1;
+    closeFile(fd);
+    FSStats stats;
+    fsStats(&stats);
+    // Blocks of several device blocks are read as batches
+    OpStats * reads = &stats.ops[FS_DEVICE_BLOCKS == 1 ? STAT_BREAD : STAT_BREAD_BLOCKS];
+    if (reads->calls == 0 || reads->total_ns < reads->calls * 200000L) {
+        ret = -1;
+    }
+    if (checkFile("ram.txt") != 0 || checkFS() != 0) {
+        ret = -1;
+    }
+    unmountFS();
+    fsSetBackend(NULL);
+    slow->close(slow);
+    return ret;
+}
+
+/* A file system striped over three RAM disks must read back what was written,
+   with the data spread over every member */
+int test_stripe() {
+    BlockBackend * members[3];
+    for (int m = 0; m < 3; m++) {
+        members[m] = backend_ram_create(700 * FS_DEVICE_BLOCKS);
+    }
+    BlockBackend * stripe = backend_stripe_create(members, 3, 4);
+    if (stripe == NULL || stripe->num_blocks(stripe) != 2100 * FS_DEVICE_BLOCKS) {
+        return -1;
+    }
+    fsSetBackend(stripe);
+    if (mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    int size = 64 * FS_BLOCK_SIZE;
+    char * data = malloc(size);
+    char * buffer = malloc(size);
+    for (int i = 0; i < size; i++) {
+        data[i] = (i / FS_BLOCK_SIZE) ^ (i % 253);
+    }
+    createFile("stripe.txt");
+    int fd = openFile("stripe.txt");
+    int ret = writeFile(fd, data, size) == size ? 0 : -1;
+    lseekFile(fd, 0, FS_SEEK_BEGIN);
+    if (readFile(fd, buffer, size) != size || memcmp(data, buffer, size) != 0) {
+        ret = -1;
+    }
+    closeFile(fd);
+    if (checkFile("stripe.txt") != 0 || checkFS() != 0) {
+        ret = -1;
+    }
+    int blocks[2] = {0, 2100};
+    if (fs_bread_blocks(DEVICE_IMAGE, blocks, buffer, 2) != -1) {
+        ret = -1;
+    }
+    unmountFS();
+
+    // Every member holds a share of the written blocks
+    for (int m = 0; m < 3; m++) {
+        int used = 0;
+        char block[BLOCK_SIZE], zeros[BLOCK_SIZE] = {0};
+        for (int b = 0; b < 700 * FS_DEVICE_BLOCKS; b++) {
+            members[m]->read(members[m], b, block);
+            used += memcmp(block, zeros, BLOCK_SIZE) != 0;
+        }
+        if (used < 20) {
+            ret = -1;
+        }
+    }
+    fsSetBackend(NULL);
+    stripe->close(stripe);
+    free(data);
+    free(buffer);
+    return ret;
+}
+
+/* Corrupting the blocks of a file in one mirror must go unnoticed by checkFile,
+   which rewrites them from the other mirror, but not in both */
+int test_mirror() {
+    BlockBackend * members[2] = {backend_ram_create(DEVICE_BLOCKS), backend_ram_create(DEVICE_BLOCKS)};
+    BlockBackend * mirror = backend_mirror_create(members, 2);
+    if (mirror == NULL || fsSetBackend(mirror) != 0 || mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    char data[4 * FS_BLOCK_SIZE], block[BLOCK_SIZE], garbage[BLOCK_SIZE];
+    memset(data, 'm', sizeof(data));
+    memset(garbage, 'x', sizeof(garbage));
+    createFile("mirror.txt");
+    int fd = openFile("mirror.txt");
+    writeFile(fd, data, sizeof(data));
+    closeFile(fd);
+
+    // Find the file blocks by their contents and damage them in the second mirror
+    int damaged[DEVICE_BLOCKS];
+    int num_damaged = 0;
+    for (int b = 0; b < DEVICE_BLOCKS; b++) {
+        members[0]->read(members[0], b, block);
+        if (memcmp(block, data, BLOCK_SIZE) == 0) {
+            damaged[num_damaged++] = b;
+            members[1]->write(members[1], b, garbage);
+        }
+    }
+    int ret = num_damaged == 4 * FS_DEVICE_BLOCKS ? 0 : -1;
+    if (checkFile("mirror.txt") != 0) {
+        ret = -1;
+    }
+    // The repairs run in the background
+    int healed = 0;
+    for (int tries = 0; tries < 200 && !healed; tries++) {
+        healed = 1;
+        for (int i = 0; i < num_damaged; i++) {
+            members[1]->read(members[1], damaged[i], block);
+            healed &= memcmp(block, data, BLOCK_SIZE) == 0;
+        }
+        usleep(10000);
+    }
+    if (!healed) {
+        ret = -1;
+    }
+    // Without a good copy left the damage is reported
+    for (int m = 0; m < 2; m++) {
+        members[m]->write(members[m], damaged[0], garbage);
+    }
+    if (checkFile("mirror.txt") != -1) {
+        ret = -1;
+    }
+    unmountFS();
+    fsSetBackend(NULL);
+    mirror->close(mirror);
+    return ret;
+}
+
+/* A clone of a 1 MiB file must only take a new indirect block, and writing
+   either file must copy just the blocks written */
+int test_clone() {
+    if (mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    int size = 512 * FS_BLOCK_SIZE;
+    char * data = malloc(size);
+    char * buffer = malloc(size);
+    for (int i = 0; i < size; i++) {
+        data[i] = i % 241;
+    }
+    createFile("original.dat");
+    int fd = openFile("original.dat");
+    writeFile(fd, data, size);
+    closeFile(fd);
+
+    int ret = 0;
+    int used = count_used_blocks();
+    if (cloneFile("original.dat", "clone.dat") != 0 || count_used_blocks() != used + 1) {
+        ret = -1;
+    }
+    if (cloneFile("missing.dat", "other.dat") != -1 || cloneFile("original.dat", "clone.dat") != -1) {
+        ret = -1;
+    }
+
+    // Rewrite one direct and one indirect block of the clone
+    char patch[FS_BLOCK_SIZE];
+    memset(patch, 'c', FS_BLOCK_SIZE);
+    fd = openFile("clone.dat");
+    lseekFile(fd, 3 * FS_BLOCK_SIZE, FS_SEEK_BEGIN);
+    writeFile(fd, patch, FS_BLOCK_SIZE);
+    lseekFile(fd, 300 * FS_BLOCK_SIZE + 10, FS_SEEK_BEGIN);
+    writeFile(fd, patch, 100);
+    if (count_used_blocks() != used + 3) {
+        ret = -1;
+    }
+    lseekFile(fd, 0, FS_SEEK_BEGIN);
+    readFile(fd, buffer, size);
+    closeFile(fd);
+    memcpy(data + 3 * FS_BLOCK_SIZE, patch, FS_BLOCK_SIZE);
+    memcpy(data + 300 * FS_BLOCK_SIZE + 10, patch, 100);
+    if (memcmp(data, buffer, size) != 0) {
+        ret = -1;
+    }
+
+    // The original keeps its contents, and outlives nothing but its own blocks
+    removeFile("clone.dat");
+    fd = openFile("original.dat");
+    readFile(fd, buffer, size);
+    closeFile(fd);
+    for (int i = 0; i < size; i++) {
+        if (buffer[i] != (char) (i % 241)) {
+            ret = -1;
+            break;
+        }
+    }
+    if (reclaimFS() != 0 || count_used_blocks() != used || checkFile("original.dat") != 0 || checkFS() != 0) {
+        ret = -1;
+    }
+
+    // With no room to copy the indirect block, the clone fails without adding references
+    memset(buffer, 'f', FS_BLOCK_SIZE);
+    createFile("fill.dat");
+    fd = openFile("fill.dat");
+    while (writeFile(fd, buffer, FS_BLOCK_SIZE) == FS_BLOCK_SIZE) {
+    }
+    closeFile(fd);
+    used = count_used_blocks();
+    if (cloneFile("original.dat", "clone.dat") != -2 || count_used_blocks() != used || checkFS() != 0) {
+        ret = -1;
+    }
+    if (removeFile("fill.dat") != 0 || removeFile("original.dat") != 0 || reclaimFS() != 0 ||
+            count_used_blocks() != 0) {
+        ret = -1;
+    }
+    free(data);
+    free(buffer);
+    unmountFS();
+    return ret;
+}
+
+/* Three files written a block at a time in turns are fully interleaved: the
+   defragmenter must make each one contiguous, within its budget per step */
+int test_defrag() {
+    if (mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    char * names[3] = {"frag0.dat", "frag1.dat", "frag2.dat"};
+    int fds[3];
+    char buffer[FS_BLOCK_SIZE];
+    for (int f = 0; f < 3; f++) {
+        createFile(names[f]);
+        fds[f] = openFile(names[f]);
+    }
+    for (int b = 0; b < 20; b++) {
+        for (int f = 0; f < 3; f++) {
+            memset(buffer, 'a' + f + b, FS_BLOCK_SIZE);
+            writeFile(fds[f], buffer, FS_BLOCK_SIZE);
+        }
+    }
+    for (int f = 0; f < 3; f++) {
+        closeFile(fds[f]);
+    }
+
+    FileFragmentation frag;
+    int used = count_used_blocks();
+    if (fragmentationFile(names[0], &frag) != 0 || frag.num_blocks != 20 || frag.num_extents != 20 ||
+            frag.fragmentation != 1.0) {
+        return -1;
+    }
+    // One file, then a step per file as each one needs more than the budget
+    if (defragFile(names[0]) != 20 || defragFS(5) != 20 || defragFS(5) != 20 || defragFS(5) != 0) {
+        return -1;
+    }
+    for (int f = 0; f < 3; f++) {
+        if (fragmentationFile(names[f], &frag) != 0 || frag.num_extents != 1 || frag.fragmentation != 0) {
+            return -1;
+        }
+        int fd = openFile(names[f]);
+        for (int b = 0; b < 20; b++) {
+            readFile(fd, buffer, FS_BLOCK_SIZE);
+            if (buffer[0] != 'a' + f + b || buffer[FS_BLOCK_SIZE - 1] != 'a' + f + b) {
+                return -1;
+            }
+        }
+        closeFile(fd);
+        if (checkFile(names[f]) != 0) {
+            return -1;
+        }
+    }
+    if (count_used_blocks() != used || checkFS() != 0 || defragFile("missing.dat") != -1) {
+        return -1;
+    }
+
+    // A damaged block keeps its stored CRC when it moves, so it stays detectable
+    char * bad[2] = {"bad0.dat", "bad1.dat"};
+    for (int f = 0; f < 2; f++) {
+        createFile(bad[f]);
+        fds[f] = openFile(bad[f]);
+    }
+    for (int b = 0; b < 4; b++) {
+        for (int f = 0; f < 2; f++) {
+            memset(buffer, 'A' + 4 * f + b, FS_BLOCK_SIZE);
+            writeFile(fds[f], buffer, FS_BLOCK_SIZE);
+        }
+    }
+    closeFile(fds[0]);
+    closeFile(fds[1]);
+    char block[FS_BLOCK_SIZE];
+    memset(buffer, 'A' + 2, FS_BLOCK_SIZE);
+    for (int i = 0; i < N_BLOCKS; i++) {
+        if (fs_bread(DEVICE_IMAGE, i, block) == 0 && memcmp(block, buffer, FS_BLOCK_SIZE) == 0) {
+            block[11] ^= 0x20;
+            fs_bwrite(DEVICE_IMAGE, i, block);
+        }
+    }
+    if (defragFile(bad[0]) != 4 || checkFile(bad[0]) != -1 || checkFile(bad[1]) != 0) {
+        return -1;
+    }
+    return unmountFS();
+}
+
+/* Counts the file system blocks of a device that only hold zeros */
+int count_zero_blocks(BlockBackend * backend) {
+    char buffer[FS_BLOCK_SIZE], zeros[FS_BLOCK_SIZE] = {0};
+    int zero = 0;
+    for (int i = 0; i < backend->num_blocks(backend); i++) {
+        backend->read(backend, i, buffer + i % FS_DEVICE_BLOCKS * BLOCK_SIZE);
+        zero += i % FS_DEVICE_BLOCKS == FS_DEVICE_BLOCKS - 1 && memcmp(buffer, zeros, FS_BLOCK_SIZE) == 0;
+    }
+    return zero;
+}
+
+/* Removing a file only unlinks its name: the reclaimer gives its blocks
+   back and discards them from the device, which the RAM disk zeroes */
+int test_reclaim() {
+    BlockBackend * ram = backend_ram_create(DEVICE_BLOCKS);
+    if (ram == NULL || fsSetBackend(ram) != 0 || mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    int used = count_used_blocks();
+    char * data = malloc(100 * FS_BLOCK_SIZE);
+    memset(data, 'r', 100 * FS_BLOCK_SIZE);
+    createFile("gone.dat");
+    int fd = openFile("gone.dat");
+    if (writeFile(fd, data, 100 * FS_BLOCK_SIZE) != 100 * FS_BLOCK_SIZE) {
+        return -1;
+    }
+    closeFile(fd);
+    int zero = count_zero_blocks(ram);
+
+    // The name can be used again right away
+    if (removeFile("gone.dat") != 0 || openFile("gone.dat") != -1 || createFile("gone.dat") != 0 ||
+            removeFile("gone.dat") != 0) {
+        return -1;
+    }
+    int ret = 0;
+    if (reclaimFS() != 0 || count_used_blocks() != used || count_zero_blocks(ram) < zero + 100 || checkFS() != 0) {
+        ret = -1;
+    }
+
+    // Unmounting waits for the files still queued
+    createFile("gone.dat");
+    fd = openFile("gone.dat");
+    writeFile(fd, data, 100 * FS_BLOCK_SIZE);
+    closeFile(fd);
+    removeFile("gone.dat");
+    if (unmountFS() != 0 || mountFS() != 0 || count_used_blocks() != used || checkFS() != 0) {
+        ret = -1;
+    }
+    free(data);
+    unmountFS();
+    fsSetBackend(NULL);
+    ram->close(ram);
+    return ret;
+}
+
+/* statFS must agree with a scan of the bitmaps after every kind of change,
+   and across a remount */
+int test_statfs() {
+    FSUsage usage;
+    long free_inodes, free_blocks, free_extents, extent_sizes[FS_EXTENT_CLASSES];
+    if (statFS(&usage) != -1 || mkFS(DEV_SIZE) != 0 || mountFS() != 0 || statFS(&usage) != 0) {
+        return -1;
+    }
+    if (usage.block_size != FS_BLOCK_SIZE || usage.free_blocks != usage.total_blocks || usage.free_extents != 1 ||
+            usage.free_extent_sizes[FS_EXTENT_CLASSES - 1] != 1 ||
+            usage.free_inodes != usage.total_inodes || usage.num_files != 0) {
+        return -1;
+    }
+    // Two files written in turns, then one removed: its blocks leave nine
+    // holes between the blocks of the other, plus the free space at the end
+    char buffer[FS_BLOCK_SIZE];
+    memset(buffer, 's', FS_BLOCK_SIZE);
+    createFile("even.dat");
+    createFile("odd.dat");
+    int fds[2] = {openFile("even.dat"), openFile("odd.dat")};
+    for (int b = 0; b < 20; b++) {
+        writeFile(fds[b % 2], buffer, FS_BLOCK_SIZE);
+    }
+    closeFile(fds[0]);
+    closeFile(fds[1]);
+    removeFile("odd.dat");
+    reclaimFS();
+    if (statFS(&usage) != 0 || count_free_space(&free_inodes, &free_blocks, &free_extents, extent_sizes) != 0) {
+        return -1;
+    }
+    if (usage.free_inodes != free_inodes || usage.free_blocks != free_blocks || usage.free_extents != free_extents ||
+            usage.free_blocks != usage.total_blocks - count_used_blocks() || usage.free_extents != 10 ||
+            memcmp(usage.free_extent_sizes, extent_sizes, sizeof(extent_sizes)) != 0 ||
+            usage.free_extent_sizes[0] != 9 || usage.num_files != 1) {
+        return -1;
+    }
+    if (unmountFS() != 0 || mountFS() != 0 || statFS(&usage) != 0 || usage.free_blocks != free_blocks ||
+            usage.free_extents != free_extents || checkFS() != 0) {
+        return -1;
+    }
+    // The next block goes to the first hole, leaving eight of them
+    createFile("next.dat");
+    int fd = openFile("next.dat");
+    writeFile(fd, buffer, FS_BLOCK_SIZE);
+    closeFile(fd);
+    if (statFS(&usage) != 0 || usage.free_extents != 9 || usage.free_extent_sizes[0] != 8 || checkFS() != 0 ||
+            unmountFS() != 0) {
+        return -1;
+    }
+
+    // A process that ends without unmountFS leaves counters older than the bitmaps, recounted at the next mount
+    pid_t pid = fork();
+    if (pid == 0) {
+        char data[10000];
+        memset(data, 'c', sizeof(data));
+        mkFS(DEV_SIZE);
+        mountFS();
+        createFile("first.dat");
+        createFile("second.dat");
+        createFile("removed.dat");
+        removeFile("removed.dat");
+        fd = openFile("first.dat");
+        writeFile(fd, data, sizeof(data));
+        // The reclaimer must be idle, ending in the middle of one of its writes would leave a stale CRC
+        reclaimFS();
+        _exit(0);
+    }
+    if (pid == -1 || waitpid(pid, NULL, 0) != pid || mountFS() != 0 || reclaimFS() != 0 || checkFS() != 0 ||
+            statFS(&usage) != 0 ||
+            count_free_space(&free_inodes, &free_blocks, &free_extents, extent_sizes) != 0) {
+        return -1;
+    }
+    if (usage.free_blocks != free_blocks || usage.free_inodes != free_inodes ||
+            usage.free_blocks != usage.total_blocks - count_used_blocks() || usage.free_inodes != usage.total_inodes - 2 ||
+            usage.num_files != 2) {
+        return -1;
+    }
+    return unmountFS();
+}
+
+static void count_completion(FSRequest * request, long result, void * arg) {
+    __atomic_add_fetch((int *) arg, 1, __ATOMIC_RELAXED);
+}
+
+/* Requests queued on one descriptor are served in order, so consecutive
+   writes and reads see the offset left by the previous one */
+int test_async() {
+    if (mkFS(DEV_SIZE) != 0 || mountFS() != 0 || createFile("async.dat") != 0) {
+        return -1;
+    }
+    int fd = openFile("async.dat");
+    char * data = malloc(16 * FS_BLOCK_SIZE);
+    char * buffer = calloc(16, FS_BLOCK_SIZE);
+    FSRequest * requests[16];
+    int completed = 0;
+    for (int i = 0; i < 16 * FS_BLOCK_SIZE; i++) {
+        data[i] = i / FS_BLOCK_SIZE + i % 7;
+    }
+    for (int i = 0; i < 16; i++) {
+        requests[i] = writeFileAsync(fd, data + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE, count_completion, &completed);
+    }
+    FSRequest * check = checkFileAsync("async.dat", NULL, NULL);
+    int ret = 0;
+    for (int i = 0; i < 16; i++) {
+        if (requests[i] == NULL || waitRequest(requests[i]) != FS_BLOCK_SIZE) {
+            ret = -1;
+        }
+    }
+    if (check == NULL || waitRequest(check) < 0 || completed != 16) {
+        ret = -1;
+    }
+
+    lseekFile(fd, 0, FS_SEEK_BEGIN);
+    for (int i = 0; i < 16; i++) {
+        requests[i] = readFileAsync(fd, buffer + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE, NULL, NULL);
+    }
+    long result;
+    while (!pollRequest(requests[15], &result));
+    for (int i = 0; i < 16; i++) {
+        if (waitRequest(requests[i]) != FS_BLOCK_SIZE) {
+            ret = -1;
+        }
+    }
+    if (result != FS_BLOCK_SIZE || memcmp(data, buffer, 16 * FS_BLOCK_SIZE) != 0) {
+        ret = -1;
+    }
+    closeFile(fd);
+    // Pending requests are served before the file system goes away
+    FSRequest * last = checkFileAsync("async.dat", NULL, NULL);
+    if (unmountFS() != 0 || !pollRequest(last, NULL) || waitRequest(last) != 0) {
+        ret = -1;
+    }
+    free(data);
+    free(buffer);
+    return ret;
+}
+
+/* Compares size bytes of a file from its start with expected */
+int file_equals(char * name, char * expected, int size) {
+    char * buffer = malloc(size + 1);
+    int fd = openFile(name);
+    int ret = readFile(fd, buffer, size + 1) == size && memcmp(buffer, expected, size) == 0 ? 0 : -1;
+    closeFile(fd);
+    free(buffer);
+    return ret;
+}
+
+/* Aligned copies move whole blocks and keep the holes of the source, unaligned
+   ones go through a buffer. A corrupted source block stays detectable in the
+   copy, as its CRC is carried over instead of computed from the bad data */
+int test_copy() {
+    BlockBackend * ram = backend_ram_create(DEVICE_BLOCKS);
+    if (ram == NULL || fsSetBackend(ram) != 0 || mkFS(DEV_SIZE) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    int size = 50 * FS_BLOCK_SIZE + 100;
+    char * data = calloc(size, 1);
+    char * expected = calloc(size, 1);
+    for (int i = 0; i < 40 * FS_BLOCK_SIZE; i++) {
+        data[i] = (i / FS_BLOCK_SIZE) * 3 + i % 13 + 1;
+    }
+    memset(data + 50 * FS_BLOCK_SIZE, 'e', 100);
+    createFile("src.dat");
+    int src = openFile("src.dat");
+    writeFile(src, data, 40 * FS_BLOCK_SIZE);
+    lseekFile(src, 50 * FS_BLOCK_SIZE, FS_SEEK_BEGIN);
+    writeFile(src, data + 50 * FS_BLOCK_SIZE, 100);
+    lseekFile(src, 0, FS_SEEK_BEGIN);
+
+    int ret = 0;
+    FileFragmentation frag;
+    createFile("whole.dat");
+    int dst = openFile("whole.dat");
+    if (copyFileRange(src, 0, dst, 0, 1L << 30) != size || readFile(dst, expected, size) != size ||
+            memcmp(expected, data, size) != 0 || fragmentationFile("whole.dat", &frag) != 0 || frag.num_blocks != 41) {
+        ret = -1;
+    }
+    closeFile(dst);
+
+    // Different positions inside a block, then the same one with partial blocks at both ends
+    createFile("shifted.dat");
+    createFile("partial.dat");
+    int shifted = openFile("shifted.dat");
+    int partial = openFile("partial.dat");
+    memset(expected, 0, size);
+    memcpy(expected + 3 * FS_BLOCK_SIZE + 5, data + 10, 5 * FS_BLOCK_SIZE);
+    if (copyFileRange(src, 10, shifted, 3 * FS_BLOCK_SIZE + 5, 5 * FS_BLOCK_SIZE) != 5 * FS_BLOCK_SIZE ||
+            file_equals("shifted.dat", expected, 8 * FS_BLOCK_SIZE + 5) != 0) {
+        ret = -1;
+    }
+    memset(expected, 0, size);
+    memcpy(expected + 100, data + 100, 10 * FS_BLOCK_SIZE);
+    if (copyFileRange(src, 100, partial, 100, 10 * FS_BLOCK_SIZE) != 10 * FS_BLOCK_SIZE ||
+            file_equals("partial.dat", expected, 10 * FS_BLOCK_SIZE + 100) != 0) {
+        ret = -1;
+    }
+    if (copyFileRange(src, 0, src, FS_BLOCK_SIZE, 2 * FS_BLOCK_SIZE) != -1 ||
+            checkFile("whole.dat") != 0 || checkFile("shifted.dat") != 0 || checkFile("partial.dat") != 0) {
+        ret = -1;
+    }
+
+    // Corrupt block 5 of the source behind the file system and copy it
+    char block[FS_BLOCK_SIZE];
+    for (int i = 0; i < N_BLOCKS; i++) {
+        fs_bread(DEVICE_IMAGE, i, block);
+        if (memcmp(block, data + 5 * FS_BLOCK_SIZE, FS_BLOCK_SIZE) == 0) {
+            block[7] ^= 0x40;
+            fs_bwrite(DEVICE_IMAGE, i, block);
+        }
+    }
+    if (copyFileRange(src, 5 * FS_BLOCK_SIZE, partial, 0, FS_BLOCK_SIZE) != FS_BLOCK_SIZE || checkFile("partial.dat") == 0) {
+        ret = -1;
+    }
+    closeFile(src);
+    closeFile(shifted);
+    closeFile(partial);
+    free(data);
+    free(expected);
+    unmountFS();
+    fsSetBackend(NULL);
+    ram->close(ram);
+    return ret;
+}
+
+/* A batch reports every name on its own: names that exist, repeat or are too
+   long fail without stopping the rest, which need far fewer writes than one
+   createFile per name */
+int test_batch() {
+    FSUsage usage;
+    if (mkFS(DEV_SIZE) != 0 || mountFS() != 0 || createFile("old.dat") != 0 || statFS(&usage) != 0) {
+        return -1;
+    }
+    int count = usage.total_inodes - 1 < 200 ? usage.total_inodes - 1 : 200;
+    char (*names)[40] = calloc(count + 3, sizeof(*names));
+    char ** list = calloc(count + 3, sizeof(char *));
+    int * results = calloc(count + 3, sizeof(int));
+    for (int i = 0; i < count; i++) {
+        sprintf(names[i], "batch%d", i);
+        list[i] = names[i];
+    }
+    strcpy(names[count], "old.dat");
+    strcpy(names[count + 1], "batch7");
+    strcpy(names[count + 2], "a_name_that_is_longer_than_allowed");
+    for (int i = count; i < count + 3; i++) {
+        list[i] = names[i];
+    }
+
+    int ret = 0;
+    FSStats stats;
+    fsStatsReset();
+    if (createFiles(list, count + 3, results) != count || results[count] != -1 || results[count + 1] != -1 ||
+            results[count + 2] != -2) {
+        ret = -1;
+    }
+    fsStats(&stats);
+    long blocks_written = (stats.ops[STAT_BWRITE].bytes + stats.ops[STAT_BWRITE_BLOCKS].bytes) / FS_BLOCK_SIZE;
+    if (blocks_written >= count || stats.ops[STAT_CREATE_BATCH].calls != 1 || stats.ops[STAT_CREATE].calls != 0) {
+        ret = -1;
+    }
+    for (int i = 0; i < count && ret == 0; i++) {
+        int fd = openFile(list[i]);
+        if (results[i] != 0 || fd < 0 || closeFile(fd) != 0) {
+            ret = -1;
+        }
+    }
+    if (statFS(&usage) != 0 || usage.num_files != count + 1 || checkFS() != 0) {
+        ret = -1;
+    }
+
+    // The names removed once are gone the second time
+    strcpy(names[count], "missing.dat");
+    if (removeFiles(list + 1, count + 1, results) != count - 1 || results[count - 2] != 0 ||
+            results[count - 1] != -1 || results[count] != -1) {
+        ret = -1;
+    }
+    reclaimFS();
+    if (statFS(&usage) != 0 || usage.num_files != 2 || usage.free_inodes != usage.total_inodes - 2 ||
+            checkFS() != 0) {
+        ret = -1;
+    }
+    if (unmountFS() != 0 || mountFS() != 0 || openFile("batch1") != -1 || openFile("batch7") != -1) {
+        ret = -1;
+    }
+    int fd = openFile("batch0");
+    if (fd < 0 || closeFile(fd) != 0 || (fd = openFile("old.dat")) < 0 || closeFile(fd) != 0 || checkFS() != 0) {
+        ret = -1;
+    }
+    free(names);
+    free(list);
+    free(results);
+    unmountFS();
+    return ret;
+}
+
+/* Reads with FS_FLAG_VERIFY check each block once per mount, and fail on a
+   block corrupted behind the file system until it is written again */
+int test_verify() {
+    BlockBackend * ram = backend_ram_create(DEVICE_BLOCKS);
+    if (ram == NULL || fsSetBackend(ram) != 0 || mkFSWithFlags(DEV_SIZE, FS_FLAG_VERIFY) != 0 || mountFS() != 0) {
+        return -1;
+    }
+    int size = 8 * FS_BLOCK_SIZE;
+    char * data = malloc(size);
+    char * buffer = malloc(size);
+    for (int i = 0; i < size; i++) {
+        data[i] = (i / FS_BLOCK_SIZE) * 5 + i % 11 + 1;
+    }
+    createFile("verify.dat");
+    int fd = openFile("verify.dat");
+    writeFile(fd, data, size);
+    closeFile(fd);
+    unmountFS();
+
+    int ret = 0;
+    FSStats stats;
+    mountFS();
+    fd = openFile("verify.dat");
+    fsStatsReset();
+    if (readFile(fd, buffer, size) != size || memcmp(buffer, data, size) != 0) {
+        ret = -1;
+    }
+    fsStats(&stats);
+    if (stats.verify_checks != 8 || stats.verify_skips != 0) {
+        ret = -1;
+    }
+    fsStatsReset();
+    lseekFile(fd, 0, FS_SEEK_BEGIN);
+    if (readFile(fd, buffer, size) != size || memcmp(buffer, data, size) != 0) {
+        ret = -1;
+    }
+    fsStats(&stats);
+    if (stats.verify_checks != 0 || stats.verify_skips != 8) {
+        ret = -1;
+    }
+    closeFile(fd);
+    unmountFS();
+
+    // Corrupt block 3 behind the file system
+    char block[FS_BLOCK_SIZE];
+    for (int i = 0; i < N_BLOCKS; i++) {
+        fs_bread(DEVICE_IMAGE, i, block);
+        if (memcmp(block, data + 3 * FS_BLOCK_SIZE, FS_BLOCK_SIZE) == 0) {
+            block[9] ^= 0x10;
+            fs_bwrite(DEVICE_IMAGE, i, block);
+        }
+    }
+    mountFS();
+    fd = openFile("verify.dat");
+    if (readFile(fd, buffer, 3 * FS_BLOCK_SIZE) != 3 * FS_BLOCK_SIZE || readFile(fd, buffer, FS_BLOCK_SIZE) != -1) {
+        ret = -1;
+    }
+    // Writing the block again makes it readable, without checking it once more
+    lseekFile(fd, 3 * FS_BLOCK_SIZE, FS_SEEK_BEGIN);
+    writeFile(fd, data + 3 * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+    lseekFile(fd, 0, FS_SEEK_BEGIN);
+    fsStatsReset();
+    if (readFile(fd, buffer, size) != size || memcmp(buffer, data, size) != 0 || checkFile("verify.dat") != 0) {
+        ret = -1;
+    }
+    fsStats(&stats);
+    if (stats.verify_checks != 4 || stats.verify_skips != 4) {
+        ret = -1;
+    }
+    closeFile(fd);
+    free(data);
+    free(buffer);
+    unmountFS();
+    fsSetBackend(NULL);
+    ram->close(ram);
+    return ret;
+}
+
+/* Images formatted with another block size, or not formatted at all, are
+   not mounted */
+int test_block_size() {
+    BlockBackend * ram = backend_ram_create(DEVICE_BLOCKS);
+    if (ram == NULL || fsSetBackend(ram) != 0 || mountFS() != -1) {
+        return -1;
+    }
+    int ret = 0;
+    SuperBlock sblock;
+    FSUsage usage;
+    if (mkFS(DEV_SIZE) != 0 || mountFS() != 0 || statFS(&usage) != 0 || usage.block_size != FS_BLOCK_SIZE ||
+            unmountFS() != 0) {
+        ret = -1;
+    }
+    ram->read(ram, 0, (char *) &sblock);
+    sblock.block_size = FS_BLOCK_SIZE == 65536 ? 2048 : 65536;
+    ram->write(ram, 0, (char *) &sblock);
+    if (mountFS() != -1) {
+        ret = -1;
+    }
+    sblock.block_size = FS_BLOCK_SIZE;
+    ram->write(ram, 0, (char *) &sblock);
+    if (mountFS() != 0 || checkFS() != 0 || unmountFS() != 0) {
+        ret = -1;
+    }
+    fsSetBackend(NULL);
+    ram->close(ram);
+    return ret;
+}
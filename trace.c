@@ -0,0 +1,100 @@
+/*
+ * OPERATING SYSTEMS DESING - 16/17
+ *
+ * @file 	trace.c
+ * @brief 	Per-thread ring buffers of trace events and their Chrome trace export.
+ * @date	01/03/2017
+ */
+
+#define _GNU_SOURCE
+#include "include/trace.h"		// Headers for the tracepoints
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+typedef struct TraceEvent {
+    const char * name;
+    long timestamp; // Nanoseconds of CLOCK_MONOTONIC
+    long arg;
+    char phase;
+} TraceEvent;
+
+/* Only the owner thread writes its ring. The number of events is published
+   after every event is stored, so a dump never waits for the writers; it
+   may only miss the events written while it runs */
+typedef struct TraceRing {
+    TraceEvent events[TRACE_RING_SIZE];
+    unsigned long count; // Events ever written, the last TRACE_RING_SIZE are kept
+    long tid;
+    struct TraceRing * next;
+} TraceRing;
+
+static __thread TraceRing * LOCAL_RING = NULL;
+static TraceRing * RINGS = NULL;
+static pthread_mutex_t RINGS_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+static TraceRing * local_ring(void)
+{
+    if (LOCAL_RING == NULL) {
+        TraceRing * ring = calloc(1, sizeof(TraceRing));
+        if (ring == NULL) {
+            return NULL;
+        }
+        ring->tid = syscall(SYS_gettid);
+        pthread_mutex_lock(&RINGS_LOCK);
+        ring->next = RINGS;
+        RINGS = ring;
+        pthread_mutex_unlock(&RINGS_LOCK);
+        LOCAL_RING = ring;
+    }
+    return LOCAL_RING;
+}
+
+/* Appends an event to the ring buffer of the calling thread */
+void trace_event(const char * name, char phase, long arg)
+{
+    TraceRing * ring = local_ring();
+    if (ring == NULL) {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long count = ring->count;
+    TraceEvent * event = &ring->events[count % TRACE_RING_SIZE];
+    event->name = name;
+    event->timestamp = ts.tv_sec * 1000000000L + ts.tv_nsec;
+    event->arg = arg;
+    event->phase = phase;
+    __atomic_store_n(&ring->count, count + 1, __ATOMIC_RELEASE);
+}
+
+/* Writes the events of every thread to path in the Chrome trace format */
+int trace_dump(const char * path)
+{
+    FILE * file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    long pid = getpid();
+    int first = 1;
+    fprintf(file, "{\"traceEvents\": [");
+    pthread_mutex_lock(&RINGS_LOCK);
+    for (TraceRing * ring = RINGS; ring != NULL; ring = ring->next) {
+        unsigned long count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+        unsigned long oldest = count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0;
+        for (unsigned long i = oldest; i < count; i++) {
+            TraceEvent * event = &ring->events[i % TRACE_RING_SIZE];
+            fprintf(file, "%s\n{\"name\": \"%s\", \"cat\": \"fs\", \"ph\": \"%c\", \"ts\": %.3f, "
+                    "\"pid\": %ld, \"tid\": %ld, \"args\": {\"%s\": %ld}}",
+                    first ? "" : ",", event->name, event->phase, event->timestamp / 1000.0,
+                    pid, ring->tid, event->phase == 'B' ? "arg" : "ret", event->arg);
+            first = 0;
+        }
+    }
+    pthread_mutex_unlock(&RINGS_LOCK);
+    fprintf(file, "\n], \"displayTimeUnit\": \"ns\"}\n");
+    return fclose(file) == 0 ? 0 : -1;
+}